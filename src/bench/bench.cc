@@ -0,0 +1,163 @@
+/* Microbenchmarks for hot paths in libutil and libexpr.  Run via
+   'make bench'.  Each benchmark is repeated until it has run for a
+   minimum wall-clock time, and the results are printed as JSON on
+   stdout so that they can be tracked across commits. */
+
+#include "shared.hh"
+#include "util.hh"
+#include "hash.hh"
+#include "compression.hh"
+#include "archive.hh"
+#include "serialise.hh"
+#include "json.hh"
+#include "eval.hh"
+#include "store-api.hh"
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+
+using namespace nix;
+
+typedef std::function<void()> BenchFn;
+
+/* Run 'f' repeatedly, doubling the iteration count until the batch
+   takes at least 200 ms, and return the duration of the final batch
+   in seconds. */
+static double timeIt(const BenchFn & f, uint64_t & iterations)
+{
+    using clock = std::chrono::steady_clock;
+
+    f(); // warm up
+
+    uint64_t n = 1;
+    while (true) {
+        auto start = clock::now();
+        for (uint64_t i = 0; i < n; ++i) f();
+        double secs = std::chrono::duration<double>(clock::now() - start).count();
+        if (secs >= 0.2 || n >= (1ULL << 30)) {
+            iterations = n;
+            return secs;
+        }
+        n *= 2;
+    }
+}
+
+int main(int argc, char * * argv)
+{
+    return handleExceptions(argv[0], [&]() {
+        initNix();
+        initGC();
+
+        /* 1 MiB of moderately compressible data. */
+        std::string data;
+        {
+            uint64_t x = 0x2545f4914f6cdd1d;
+            while (data.size() < 1024 * 1024) {
+                data += "the quick brown fox jumps over the lazy dog ";
+                x = x * 6364136223846793005 + 1442695040888963407;
+                data += std::to_string(x >> 33);
+            }
+            data.resize(1024 * 1024);
+        }
+
+        JSONList json(std::cout, true);
+
+        /* Run one benchmark and emit its result.  'bytesPerOp' is the
+           amount of data processed per iteration, used to derive a
+           throughput figure (0 if not meaningful). */
+        auto bench = [&](const std::string & name, uint64_t bytesPerOp, const BenchFn & f) {
+            uint64_t n;
+            double secs = timeIt(f, n);
+            auto obj = json.object();
+            obj.attr("name", name);
+            obj.attr("iterations", n);
+            obj.attr("ns_per_op", (uint64_t) (secs * 1e9 / n));
+            if (bytesPerOp)
+                obj.attr("mb_per_sec", (uint64_t) (bytesPerOp * n / secs / 1e6));
+        };
+
+        /* Hashing. */
+        bench("hashString-sha256", data.size(), [&]() {
+            hashString(htSHA256, data);
+        });
+
+        bench("hashString-sha512", data.size(), [&]() {
+            hashString(htSHA512, data);
+        });
+
+        /* Base-32 codec. */
+        auto h = hashString(htSHA256, data);
+        auto h32 = h.to_string(Base32, false);
+        bench("printHash32", 0, [&]() {
+            h.to_string(Base32, false);
+        });
+        bench("parseHash32", 0, [&]() {
+            Hash(h32, htSHA256);
+        });
+
+        /* Compression. */
+        for (auto & method : {"none", "xz", "bzip2"}) {
+            auto compressed = compress(method, data);
+            bench(std::string("compress-") + method, data.size(), [&]() {
+                compress(method, data);
+            });
+            bench(std::string("decompress-") + method, data.size(), [&]() {
+                decompress(method, *compressed);
+            });
+        }
+
+        /* NAR serialisation.  Dump a small tree of files, then parse
+           the resulting archive back. */
+        {
+            Path dir = createTempDir();
+            AutoDelete del(dir);
+            for (int i = 0; i < 32; ++i) {
+                Path sub = dir + "/dir" + std::to_string(i % 4);
+                createDirs(sub);
+                writeFile(sub + "/file" + std::to_string(i), std::string(8192, 'x'));
+            }
+
+            StringSink narSink;
+            dumpPath(dir, narSink);
+            auto nar = narSink.s;
+
+            bench("dumpPath", nar->size(), [&]() {
+                StringSink sink;
+                dumpPath(dir, sink);
+            });
+
+            bench("parseDump", nar->size(), [&]() {
+                StringSource source(*nar);
+                ParseSink sink;
+                parseDump(sink, source);
+            });
+        }
+
+        /* Evaluation. */
+        {
+            auto store = openStore();
+            EvalState state(Strings(), store);
+
+            /* Attribute lookups (Bindings::find) on a wide set. */
+            auto attrExpr = state.parseExprFromString(
+                "let s = builtins.listToAttrs (map (n: { name = \"a\" + toString n; value = n; })"
+                "  (builtins.genList (n: n) 512));"
+                "in builtins.foldl' (a: n: a + s.a255 + s.a0 + s.a511) 0 (builtins.genList (n: n) 1000)",
+                "/");
+            bench("eval-attr-lookup", 0, [&]() {
+                Value v;
+                state.eval(attrExpr, v);
+            });
+
+            /* Forcing a deep chain of thunks. */
+            auto thunkExpr = state.parseExprFromString(
+                "let f = n: if n == 0 then 0 else f (n - 1); in f 10000",
+                "/");
+            bench("eval-force-deep", 0, [&]() {
+                Value v;
+                state.eval(thunkExpr, v);
+            });
+        }
+    });
+}
@@ -0,0 +1,15 @@
+programs += nix-bench
+
+nix-bench_DIR := $(d)
+
+nix-bench_SOURCES := $(d)/bench.cc
+
+nix-bench_INSTALL_DIR := $(libexecdir)/nix
+
+nix-bench_LIBS = libexpr libmain libstore libutil libformat
+
+# Build and run the microbenchmarks, printing JSON results on stdout.
+bench: $(buildprefix)$(d)/nix-bench
+	$<
+
+.PHONY: bench
@@ -98,6 +98,21 @@ int main (int argc, char * * argv)
 
                 Machine * bestMachine = nullptr;
                 unsigned long long bestLoad = 0;
+                double bestLoadFactor = 0;
+                size_t bestSurplus = 0;
+
+                /* Number of features a machine supports beyond what
+                   this build asks for.  Used as a tie-breaker: builds
+                   that don't need e.g. 'kvm' or 'big-parallel' go to
+                   plain machines first, keeping the specialised ones
+                   free for builds that require them. */
+                auto surplusFeatures = [&](const Machine & m) {
+                    size_t n = 0;
+                    for (auto & f : m.supportedFeatures)
+                        if (!requiredFeatures.count(f)) n++;
+                    return n;
+                };
+
                 for (auto & m : machines) {
                     debug("considering building on '%s'", m.storeUri);
 
@@ -122,22 +137,26 @@ int main (int argc, char * * argv)
                         if (!free) {
                             continue;
                         }
+                        /* Compare in floating point: the old integer
+                           division collapsed e.g. load 3 at speed 2
+                           and load 7 at speed 4 into the same value. */
+                        double loadFactor = (double) load / m.speedFactor;
+                        size_t surplus = surplusFeatures(m);
                         bool best = false;
-                        if (!bestSlotLock) {
-                            best = true;
-                        } else if (load / m.speedFactor < bestLoad / bestMachine->speedFactor) {
+                        if (!bestSlotLock)
                             best = true;
-                        } else if (load / m.speedFactor == bestLoad / bestMachine->speedFactor) {
-                            if (m.speedFactor > bestMachine->speedFactor) {
-                                best = true;
-                            } else if (m.speedFactor == bestMachine->speedFactor) {
-                                if (load < bestLoad) {
-                                    best = true;
-                                }
-                            }
-                        }
+                        else if (loadFactor != bestLoadFactor)
+                            best = loadFactor < bestLoadFactor;
+                        else if (m.speedFactor != bestMachine->speedFactor)
+                            best = m.speedFactor > bestMachine->speedFactor;
+                        else if (surplus != bestSurplus)
+                            best = surplus < bestSurplus;
+                        else
+                            best = load < bestLoad;
                         if (best) {
                             bestLoad = load;
+                            bestLoadFactor = loadFactor;
+                            bestSurplus = surplus;
                             bestSlotLock = std::move(free);
                             bestMachine = &m;
                         }
@@ -193,16 +212,21 @@ connected:
 
         auto outputs = tokenizeString<PathSet>(line);
 
-        AutoCloseFD uploadLock = openLockFile(currentLoad + "/" + escapeUri(storeUri) + ".upload-lock", true);
-
-        auto old = signal(SIGALRM, handleAlarm);
-        alarm(15 * 60);
-        if (!lockFile(uploadLock.get(), ltWrite, true))
-            printError("somebody is hogging the upload lock for '%s', continuing...");
-        alarm(0);
-        signal(SIGALRM, old);
-        copyPaths(store, ref<Store>(sshStore), inputs, NoRepair, NoCheckSigs);
-        uploadLock = -1;
+        /* If the remote already has the entire input closure (say,
+           because an earlier build on the same machine shipped it),
+           don't queue behind whatever upload holds the lock; there is
+           nothing to copy. */
+        if (sshStore->queryValidPaths(inputs).size() != inputs.size()) {
+            AutoCloseFD uploadLock = openLockFile(currentLoad + "/" + escapeUri(storeUri) + ".upload-lock", true);
+
+            auto old = signal(SIGALRM, handleAlarm);
+            alarm(15 * 60);
+            if (!lockFile(uploadLock.get(), ltWrite, true))
+                printError("somebody is hogging the upload lock for '%s', continuing...");
+            alarm(0);
+            signal(SIGALRM, old);
+            copyPaths(store, ref<Store>(sshStore), inputs, NoRepair, NoCheckSigs);
+        }
 
         BasicDerivation drv(readDerivation(drvPath));
         drv.inputSrcs = inputs;
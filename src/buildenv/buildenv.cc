@@ -43,7 +43,17 @@ static void createLinks(const Path & srcDir, const Path & dstDir, int priority)
             hasSuffix(srcFile, "/info/dir") ||
             hasSuffix(srcFile, "/log")) {
             continue;
-        } else if (isDirectory(srcFile)) {
+        }
+
+        /* The directory entry type from readdir() usually makes the
+         * stat() below unnecessary; we only need it for symlinks (a
+         * link to a directory is treated as a directory here) and on
+         * filesystems that don't report a type.
+         */
+        auto srcIsDirectory = ent.type == DT_DIR ||
+            ((ent.type == DT_UNKNOWN || ent.type == DT_LNK) && isDirectory(srcFile));
+
+        if (srcIsDirectory) {
             struct stat dstSt;
             auto res = lstat(dstFile.c_str(), &dstSt);
             if (res == 0) {
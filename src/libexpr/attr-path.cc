@@ -50,11 +50,21 @@ Value * findAlongAttrPath(EvalState & state, const string & attrPath,
         if (string2Int(attr, attrIndex)) apType = apIndex;
 
         /* Evaluate the expression. */
-        Value * vNew = state.allocValue();
-        state.autoCallFunction(autoArgs, *v, *vNew);
-        v = vNew;
         state.forceValue(*v);
 
+        /* Auto-call functions, but only if there is something to
+           call: for any other value autoCallFunction() would just
+           copy it into a freshly allocated cell, which adds up when
+           many attribute paths are resolved against the same root. */
+        if (v->type == tLambda
+            || (v->type == tAttrs && v->attrs->find(state.sFunctor) != v->attrs->end()))
+        {
+            Value * vNew = state.allocValue();
+            state.autoCallFunction(autoArgs, *v, *vNew);
+            v = vNew;
+            state.forceValue(*v);
+        }
+
         /* It should evaluate to either a set or an expression,
            according to what is specified in the attrPath. */
 
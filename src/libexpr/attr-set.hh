@@ -57,6 +57,14 @@ public:
 
     iterator find(const Symbol & name)
     {
+        /* Most attribute sets are small, and there a linear scan with
+           a single pointer comparison per element beats binary
+           search. */
+        if (size_ <= 8) {
+            for (iterator i = begin(); i != end(); ++i)
+                if (i->name == name) return i;
+            return end();
+        }
         Attr key(name, 0);
         iterator i = std::lower_bound(begin(), end(), key);
         if (i != end() && i->name == name) return i;
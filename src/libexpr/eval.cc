@@ -5,10 +5,13 @@
 #include "derivations.hh"
 #include "globals.hh"
 #include "eval-inline.hh"
+#include "finally.hh"
 #include "download.hh"
 
 #include <algorithm>
 #include <cstring>
+#include <fstream>
+#include <unordered_set>
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/resource.h>
@@ -168,11 +171,14 @@ string showType(const Value & v)
 
 
 #if HAVE_BOEHMGC
-/* Called when the Boehm GC runs out of memory. */
+/* Called when the Boehm GC runs out of memory, i.e. when the heap
+   limit (if any) cannot be met even after a full collection. */
 static void * oomHandler(size_t requested)
 {
-    /* Convert this to a proper C++ exception. */
-    throw std::bad_alloc();
+    /* Convert this to a proper C++ exception, so that a runaway
+       evaluation unwinds with a message instead of aborting the
+       whole process. */
+    throw EvalError(format("Nix evaluator ran out of memory (failed to allocate %1% bytes)") % requested);
 }
 #endif
 
@@ -204,6 +210,13 @@ void initGC()
 
     GC_set_oom_fn(oomHandler);
 
+    /* Cap the heap if the user asked for it.  libgc collects more
+       eagerly as the heap approaches this bound, and calls the OOM
+       handler above once collection can no longer keep it below the
+       limit. */
+    if (settings.maxEvalHeapSize)
+        GC_set_max_heap_size(settings.maxEvalHeapSize);
+
     /* Set the initial heap size to something fairly big (25% of
        physical RAM, up to a maximum of 384 MiB) so that in most cases
        we don't need to garbage collect at all.  (Collection has a
@@ -293,6 +306,8 @@ EvalState::EvalState(const Strings & _searchPath, ref<Store> store)
     , sWrong(symbols.create("wrong"))
     , sStructuredAttrs(symbols.create("__structuredAttrs"))
     , sBuilder(symbols.create("builder"))
+    , sRecurseForDerivations(symbols.create("recurseForDerivations"))
+    , sCombineChannels(symbols.create("_combineChannels"))
     , repair(NoRepair)
     , store(store)
     , baseEnv(allocEnv(128))
@@ -300,6 +315,8 @@ EvalState::EvalState(const Strings & _searchPath, ref<Store> store)
 {
     countCalls = getEnv("NIX_COUNT_CALLS", "0") != "0";
 
+    profileFile = getEnv("NIX_EVAL_PROFILE", "");
+
     restricted = settings.restrictEval;
 
     assert(gcInitialised);
@@ -314,6 +331,10 @@ EvalState::EvalState(const Strings & _searchPath, ref<Store> store)
     vEmptySet.type = tAttrs;
     vEmptySet.attrs = allocBindings(0);
 
+    mkBool(vTrue, true);
+    mkBool(vFalse, false);
+    mkNull(vNull);
+
     createBaseEnv();
 }
 
@@ -465,13 +486,32 @@ void mkString(Value & v, const char * s)
 
 Value & mkString(Value & v, const string & s, const PathSet & context)
 {
+    if (context.empty() && s.size() <= 32) {
+        /* Short context-free strings (system types, version numbers,
+           output names) recur millions of times during a nixpkgs-scale
+           evaluation; intern them so that all copies share a single
+           allocation.  Like the symbol table, the intern table is
+           append-only and lives for the duration of the process. */
+        static std::unordered_set<string> internedStrings;
+        mkStringNoCopy(v, internedStrings.insert(s).first->c_str());
+        return v;
+    }
     mkString(v, s.c_str());
     if (!context.empty()) {
+        /* The same context elements (store paths, '!out!/...'
+           derivation references) travel through every interpolation
+           that mentions a derivation, so duplicating each element
+           per string makes context copying quadratic in long
+           interpolation chains.  Intern the elements instead: a
+           context array then holds shared pointers, and building one
+           costs a pointer write per element after the first
+           occurrence. */
+        static std::unordered_set<string> internedContext;
         unsigned int n = 0;
         v.string.context = (const char * *)
             allocBytes((context.size() + 1) * sizeof(char *));
         for (auto & i : context)
-            v.string.context[n++] = dupString(i.c_str());
+            v.string.context[n++] = internedContext.insert(i).first->c_str();
         v.string.context[n] = 0;
     }
     return v;
@@ -510,10 +550,28 @@ inline Value * EvalState::lookupVar(Env * env, const ExprVar & var, bool noEval)
 }
 
 
+/* Size of the slabs from which Values and Envs are bump-allocated.
+   With hundreds of millions of allocations during a large eval, the
+   per-cell allocator overhead dominates, so we pay it only once per
+   slab.  Values and Envs share a single slab: an ExprLet or
+   ExprLambda application allocates its Env and then immediately the
+   thunks bound in it, so interleaving puts an Env and its thunks on
+   the same few cache lines and forcing a thunk no longer has to jump
+   between two unrelated heap regions. */
+static const size_t evalSlabSize = 16384;
+
+
 Value * EvalState::allocValue()
 {
     nrValues++;
-    return (Value *) allocBytes(sizeof(Value));
+    if (evalAllocLeft < sizeof(Value)) {
+        evalAllocPos = (char *) allocBytes(evalSlabSize);
+        evalAllocLeft = evalSlabSize;
+    }
+    Value * v = (Value *) evalAllocPos;
+    evalAllocPos += sizeof(Value);
+    evalAllocLeft -= sizeof(Value);
+    return v;
 }
 
 
@@ -523,7 +581,22 @@ Env & EvalState::allocEnv(unsigned int size)
 
     nrEnvs++;
     nrValuesInEnvs += size;
-    Env * env = (Env *) allocBytes(sizeof(Env) + size * sizeof(Value *));
+
+    size_t bytes = sizeof(Env) + size * sizeof(Value *);
+    Env * env;
+    if (bytes > evalSlabSize / 4)
+        /* Unusually large environments get their own allocation so
+           they don't waste slab space. */
+        env = (Env *) allocBytes(bytes);
+    else {
+        if (evalAllocLeft < bytes) {
+            evalAllocPos = (char *) allocBytes(evalSlabSize);
+            evalAllocLeft = evalSlabSize;
+        }
+        env = (Env *) evalAllocPos;
+        evalAllocPos += bytes;
+        evalAllocLeft -= bytes;
+    }
     env->size = size;
 
     /* Clear the values because maybeThunk() and lookupVar fromWith expect this. */
@@ -644,7 +717,21 @@ void EvalState::evalFile(const Path & path, Value & v)
     }
 
     printTalkative("evaluating file '%1%'", path2);
-    Expr * e = parseExprFromFile(checkSourcePath(path2));
+
+    Expr * e = nullptr;
+
+    auto j = fileParseCache.find(path2);
+    if (j != fileParseCache.end())
+        e = j->second.expr;
+
+    if (!e) {
+        e = parseExprFromFile(checkSourcePath(path2));
+        struct stat st;
+        if (stat(path2.c_str(), &st) == -1)
+            st.st_mtime = 0, st.st_size = 0;
+        fileParseCache[path2] = FileParseCacheEntry{e, st.st_mtime, st.st_size};
+    }
+
     try {
         eval(e, v);
     } catch (Error & e) {
@@ -659,7 +746,21 @@ void EvalState::evalFile(const Path & path, Value & v)
 
 void EvalState::resetFileCache()
 {
+    /* Evaluation results can depend transitively on other files, so
+       they all have to go; but a parse tree depends only on its own
+       file's content, so entries whose file is unchanged on disk can
+       be kept.  This makes e.g. a repl reload after a single-file
+       edit re-parse only that file. */
     fileEvalCache.clear();
+    for (auto i = fileParseCache.begin(); i != fileParseCache.end(); ) {
+        struct stat st;
+        if (stat(i->first.c_str(), &st) == 0
+            && st.st_mtime == i->second.mtime
+            && st.st_size == i->second.size)
+            ++i;
+        else
+            i = fileParseCache.erase(i);
+    }
 }
 
 
@@ -1063,6 +1164,14 @@ void EvalState::callFunction(Value & fun, Value & arg, Value & v, const Pos & po
     nrFunctionCalls++;
     if (countCalls) incrFunctionCall(&lambda);
 
+    if (!profileFile.empty()) {
+        profileStack.push_back(&lambda);
+        profileCounts[profileStack]++;
+    }
+    Finally popProfileFrame([&]() {
+        if (!profileFile.empty()) profileStack.pop_back();
+    });
+
     /* Evaluate the body.  This is conditional on showTrace, because
        catching exceptions makes this function not tail-recursive. */
     if (settings.showTrace)
@@ -1246,12 +1355,16 @@ void EvalState::concatLists(Value & v, unsigned int nrLists, Value * * lists, co
         if (l) nonEmpty = lists[n];
     }
 
+    /* If at most one operand is non-empty, reuse it instead of
+       copying; this makes appending empty lists (common in fold-heavy
+       pipelines) O(1). */
     if (nonEmpty && len == nonEmpty->listSize()) {
         v = *nonEmpty;
         return;
     }
 
     mkList(v, len);
+    nrListConcatValuesCopied += len;
     auto out = v.listElems();
     for (unsigned int n = 0, pos = 0; n < nrLists; ++n) {
         unsigned int l = lists[n]->listSize();
@@ -1301,6 +1414,12 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
                 nf += vTmp.fpoint;
             } else
                 throwEvalError("cannot add %1% to a float, at %2%", showType(vTmp), pos);
+        } else if (vTmp.type == tString) {
+            /* Common case: appending a plain string.  Copy the bytes
+               directly instead of round-tripping them through the
+               temporary std::string that coerceToString returns. */
+            copyContext(vTmp, context);
+            s << vTmp.string.s;
         } else
             s << state.coerceToString(pos, vTmp, context, false, firstType == tString);
     }
@@ -1587,11 +1706,21 @@ bool EvalState::eqValues(Value & v1, Value & v2)
         case tList2:
         case tListN:
             if (v1.listSize() != v2.listSize()) return false;
+            /* Two values sharing the same element array (e.g. through
+               list reuse in concatLists or filter) are equal without
+               looking at the elements. */
+            if (v1.listElems() == v2.listElems()) return true;
             for (unsigned int n = 0; n < v1.listSize(); ++n)
                 if (!eqValues(*v1.listElems()[n], *v2.listElems()[n])) return false;
             return true;
 
         case tAttrs: {
+            /* Two values sharing the same Bindings (the common case
+               for things like nixpkgs' license sets, where both sides
+               of the == refer to the same attrset) are equal without
+               a recursive walk. */
+            if (v1.attrs == v2.attrs) return true;
+
             /* If both sets denote a derivation (type = "derivation"),
                then compare their outPaths. */
             if (isDerivation(v1) && isDerivation(v2)) {
@@ -1655,6 +1784,7 @@ void EvalState::printStats()
     printMsg(v, format("  sets allocated: %1% (%2% bytes)") % nrAttrsets % bAttrsets);
     printMsg(v, format("  right-biased unions: %1%") % nrOpUpdates);
     printMsg(v, format("  values copied in right-biased unions: %1%") % nrOpUpdateValuesCopied);
+    printMsg(v, format("  values copied in list concatenations: %1%") % nrListConcatValuesCopied);
     printMsg(v, format("  symbols in symbol table: %1%") % symbols.size());
     printMsg(v, format("  size of symbol table: %1%") % symbols.totalSize());
     printMsg(v, format("  number of thunks: %1%") % nrThunks);
@@ -1699,6 +1829,23 @@ void EvalState::printStats()
             printMsg(v, format("%1$10d %2%") % i->first % i->second);
 
     }
+
+    if (!profileFile.empty()) {
+        /* One line per distinct call stack, semicolon-separated, with
+           its call count; feed the file to flamegraph.pl to see where
+           an evaluation spends its calls. */
+        std::ofstream f(profileFile);
+        for (auto & i : profileCounts) {
+            bool first = true;
+            for (auto & l : i.first) {
+                if (!first) f << ';';
+                first = false;
+                f << l->showNamePos();
+            }
+            f << ' ' << i.second << '\n';
+        }
+        printMsg(v, format("wrote evaluation profile to '%1%'") % profileFile);
+    }
 }
 
 
@@ -69,7 +69,8 @@ public:
     const Symbol sWith, sOutPath, sDrvPath, sType, sMeta, sName, sValue,
         sSystem, sOverrides, sOutputs, sOutputName, sIgnoreNulls,
         sFile, sLine, sColumn, sFunctor, sToString,
-        sRight, sWrong, sStructuredAttrs, sBuilder;
+        sRight, sWrong, sStructuredAttrs, sBuilder,
+        sRecurseForDerivations, sCombineChannels;
     Symbol sDerivationNix;
 
     /* If set, force copying files to the Nix store even if they
@@ -82,6 +83,12 @@ public:
 
     Value vEmptySet;
 
+    /* Shared immediate constants.  Values that are not thunks or
+       applications are never overwritten in place, so frequently
+       produced constants can all point at a single cell instead of
+       getting a fresh allocation each time. */
+    Value vTrue, vFalse, vNull;
+
     const ref<Store> store;
 
 private:
@@ -95,6 +102,18 @@ private:
 #endif
     FileEvalCache fileEvalCache;
 
+    /* A cache from path names to parse trees, along with the stat
+       info each file had when it was parsed, so that stale entries
+       can be dropped selectively by resetFileCache(). */
+    struct FileParseCacheEntry
+    {
+        Expr * expr;
+        time_t mtime;
+        off_t size;
+    };
+    typedef std::map<Path, FileParseCacheEntry> FileParseCache;
+    FileParseCache fileParseCache;
+
     SearchPath searchPath;
 
     std::map<std::string, std::pair<bool, std::string>> searchPathResolved;
@@ -184,6 +203,15 @@ public:
        path.  Nothing is copied to the store. */
     Path coerceToPath(const Pos & pos, Value & v, PathSet & context);
 
+private:
+
+    /* Bump-pointer slab out of which both Values and Envs are carved,
+       so that an Env and the thunks allocated right after it end up
+       adjacent in memory.  Individual cells are never freed; the GC
+       (if enabled) scans and collects each slab as a whole. */
+    char * evalAllocPos = nullptr;
+    size_t evalAllocLeft = 0;
+
 public:
 
     /* The base environment, containing the builtin functions and
@@ -216,7 +244,9 @@ private:
     friend struct ExprAttrs;
     friend struct ExprLet;
 
-    Expr * parse(const char * text, const Path & path,
+    /* Parse `text', which must be writable and end in two NUL bytes
+       (included in `length'), so that it can be scanned in place. */
+    Expr * parse(char * text, size_t length, const Path & path,
         const Path & basePath, StaticEnv & staticEnv);
 
 public:
@@ -256,6 +286,11 @@ public:
 
 private:
 
+    /* Context elements already realised during this evaluation, so
+       that importing from the same derivation repeatedly doesn't
+       repeat the store queries and build calls. */
+    PathSet realisedContext;
+
     unsigned long nrEnvs = 0;
     unsigned long nrValuesInEnvs = 0;
     unsigned long nrValues = 0;
@@ -265,11 +300,19 @@ private:
     unsigned long nrOpUpdates = 0;
     unsigned long nrOpUpdateValuesCopied = 0;
     unsigned long nrListConcats = 0;
+    unsigned long nrListConcatValuesCopied = 0;
     unsigned long nrPrimOpCalls = 0;
     unsigned long nrFunctionCalls = 0;
 
     bool countCalls;
 
+    /* Opt-in evaluation profiler: if NIX_EVAL_PROFILE names a file,
+       function calls are counted per call stack and written out in
+       the folded format consumed by flamegraph tools. */
+    Path profileFile;
+    std::vector<ExprLambda *> profileStack;
+    std::map<std::vector<ExprLambda *>, unsigned long> profileCounts;
+
     typedef std::map<Symbol, unsigned int> PrimOpCalls;
     PrimOpCalls primOpCalls;
 
@@ -157,10 +157,18 @@ bool DrvInfo::checkMeta(Value & v)
 
 Value * DrvInfo::queryMeta(const string & name)
 {
-    if (!getMeta()) return 0;
-    Bindings::iterator a = meta->find(state->symbols.create(name));
-    if (a == meta->end() || !checkMeta(*a->value)) return 0;
-    return a->value;
+    auto cached = metaCache.find(name);
+    if (cached != metaCache.end()) return cached->second;
+
+    Value * res = 0;
+    if (getMeta()) {
+        Bindings::iterator a = meta->find(state->symbols.create(name));
+        if (a != meta->end() && checkMeta(*a->value))
+            res = a->value;
+    }
+
+    metaCache[name] = res;
+    return res;
 }
 
 
@@ -228,6 +236,7 @@ void DrvInfo::setMeta(const string & name, Value * v)
                 meta->push_back(i);
     if (v) meta->push_back(Attr(sym, v));
     meta->sort();
+    metaCache.clear();
 }
 
 
@@ -249,14 +258,13 @@ static bool getDerivation(EvalState & state, Value & v,
 
         /* Remove spurious duplicates (e.g., a set like `rec { x =
            derivation {...}; y = x;}'. */
-        if (done.find(v.attrs) != done.end()) return false;
-        done.insert(v.attrs);
+        if (!done.insert(v.attrs).second) return false;
 
         DrvInfo drv(state, attrPath, v.attrs);
 
         drv.queryName();
 
-        drvs.push_back(drv);
+        drvs.push_back(std::move(drv));
 
         return false;
 
@@ -302,7 +310,7 @@ static void getDerivations(EvalState & state, Value & vIn,
 
         /* !!! undocumented hackery to support combining channels in
            nix-env.cc. */
-        bool combineChannels = v.attrs->find(state.symbols.create("_combineChannels")) != v.attrs->end();
+        bool combineChannels = v.attrs->find(state.sCombineChannels) != v.attrs->end();
 
         /* Consider the attributes in sorted order to get more
            deterministic behaviour in nix-env operations (e.g. when
@@ -321,7 +329,7 @@ static void getDerivations(EvalState & state, Value & vIn,
                    should we recurse into it?  => Only if it has a
                    `recurseForDerivations = true' attribute. */
                 if (i->value->type == tAttrs) {
-                    Bindings::iterator j = i->value->attrs->find(state.symbols.create("recurseForDerivations"));
+                    Bindings::iterator j = i->value->attrs->find(state.sRecurseForDerivations);
                     if (j != i->value->attrs->end() && state.forceBool(*j->value, *j->pos))
                         getDerivations(state, *i->value, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
                 }
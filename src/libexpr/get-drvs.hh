@@ -28,6 +28,11 @@ private:
 
     Bindings * attrs = nullptr, * meta = nullptr;
 
+    /* Memoised queryMeta() results (including negative ones), so
+       that repeated queries don't re-run checkMeta(), which forces
+       the whole meta value each time.  Invalidated by setMeta(). */
+    std::map<string, Value *> metaCache;
+
     Bindings * getMeta();
 
     bool checkMeta(Value & v);
@@ -1,5 +1,7 @@
 #include "json-to-value.hh"
 
+#include <cerrno>
+#include <cstdlib>
 #include <cstring>
 
 namespace nix {
@@ -16,6 +18,14 @@ static string parseJSONString(const char * & s)
     string res;
     if (*s++ != '"') throw JSONParseError("expected JSON string");
     while (*s != '"') {
+        /* Append the longest run without escapes or terminators in
+           one go; strings in big JSON blobs are mostly escape-free. */
+        size_t n = strcspn(s, "\"\\");
+        if (n) {
+            res.append(s, n);
+            s += n;
+            continue;
+        }
         if (!*s) throw JSONParseError("got end-of-string in JSON string");
         if (*s == '\\') {
             s++;
@@ -96,20 +106,34 @@ static void parseJSON(EvalState & state, const char * & s, Value & v)
     }
 
     else if (isdigit(*s) || *s == '-' || *s == '.' ) {
-        // Buffer into a string first, then use built-in C++ conversions
-        std::string tmp_number;
+        /* Scan the number in place; the input is NUL-terminated, so
+           there is no need to copy it into a temporary string
+           first. */
+        const char * start = s;
         ValueType number_type = tInt;
 
         while (isdigit(*s) || *s == '-' || *s == '.' || *s == 'e' || *s == 'E') {
             if (*s == '.' || *s == 'e' || *s == 'E')
                 number_type = tFloat;
-            tmp_number += *s++;
+            s++;
         }
 
-        if (number_type == tFloat)
-            mkFloat(v, stod(tmp_number));
-        else
-            mkInt(v, stoi(tmp_number));
+        /* The scan above accepts any run of number characters, so let
+           the conversion verify that the token really is a number: it
+           must be consumed entirely and must not overflow. */
+        char * end = 0;
+        errno = 0;
+        if (number_type == tFloat) {
+            double d = strtod(start, &end);
+            if (end != s || errno == ERANGE)
+                throw JSONParseError(format("invalid JSON number '%1%'") % string(start, s - start));
+            mkFloat(v, d);
+        } else {
+            long long n = strtoll(start, &end, 10);
+            if (end != s || errno == ERANGE)
+                throw JSONParseError(format("invalid JSON number '%1%'") % string(start, s - start));
+            mkInt(v, n);
+        }
     }
 
     else if (strncmp(s, "true", 4) == 0) {
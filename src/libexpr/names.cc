@@ -1,6 +1,8 @@
 #include "names.hh"
 #include "util.hh"
 
+#include <algorithm>
+
 
 namespace nix {
 
@@ -41,41 +43,68 @@ bool DrvName::matches(DrvName & n)
 }
 
 
-static string nextComponent(string::const_iterator & p,
-    const string::const_iterator end)
+/* Find the next component, i.e. the longest sequence of digits or of
+   non-digit, non-separator characters after any separators.  The
+   component is returned as an iterator range into the version string,
+   so that comparing versions does not allocate. */
+static void nextComponent(string::const_iterator & p,
+    const string::const_iterator end,
+    string::const_iterator & compStart, string::const_iterator & compEnd)
 {
     /* Skip any dots and dashes (component separators). */
     while (p != end && (*p == '.' || *p == '-')) ++p;
 
-    if (p == end) return "";
+    compStart = p;
 
     /* If the first character is a digit, consume the longest sequence
        of digits.  Otherwise, consume the longest sequence of
        non-digit, non-separator characters. */
-    string s;
-    if (isdigit(*p))
-        while (p != end && isdigit(*p)) s += *p++;
-    else
-        while (p != end && (!isdigit(*p) && *p != '.' && *p != '-'))
-            s += *p++;
-
-    return s;
+    if (p != end) {
+        if (isdigit(*p))
+            while (p != end && isdigit(*p)) ++p;
+        else
+            while (p != end && (!isdigit(*p) && *p != '.' && *p != '-'))
+                ++p;
+    }
+
+    compEnd = p;
 }
 
 
-static bool componentsLT(const string & c1, const string & c2)
+/* Compare two all-digit components numerically, without converting
+   them to an integer first (date-like components overflow an int). */
+static int compareNumeric(
+    string::const_iterator b1, string::const_iterator e1,
+    string::const_iterator b2, string::const_iterator e2)
 {
-    int n1, n2;
-    bool c1Num = string2Int(c1, n1), c2Num = string2Int(c2, n2);
+    while (b1 != e1 && *b1 == '0') ++b1;
+    while (b2 != e2 && *b2 == '0') ++b2;
+    if (e1 - b1 != e2 - b2) return e1 - b1 < e2 - b2 ? -1 : 1;
+    for ( ; b1 != e1; ++b1, ++b2)
+        if (*b1 != *b2) return *b1 < *b2 ? -1 : 1;
+    return 0;
+}
+
+
+static bool componentsLT(
+    string::const_iterator b1, string::const_iterator e1,
+    string::const_iterator b2, string::const_iterator e2)
+{
+    bool c1Num = b1 != e1 && isdigit(*b1);
+    bool c2Num = b2 != e2 && isdigit(*b2);
+
+    auto isPre = [](string::const_iterator b, string::const_iterator e) {
+        return e - b == 3 && std::equal(b, e, "pre");
+    };
 
-    if (c1Num && c2Num) return n1 < n2;
-    else if (c1 == "" && c2Num) return true;
-    else if (c1 == "pre" && c2 != "pre") return true;
-    else if (c2 == "pre") return false;
+    if (c1Num && c2Num) return compareNumeric(b1, e1, b2, e2) < 0;
+    else if (b1 == e1 && c2Num) return true;
+    else if (isPre(b1, e1) && !isPre(b2, e2)) return true;
+    else if (isPre(b2, e2)) return false;
     /* Assume that `2.3a' < `2.3.1'. */
     else if (c2Num) return true;
     else if (c1Num) return false;
-    else return c1 < c2;
+    else return std::lexicographical_compare(b1, e1, b2, e2);
 }
 
 
@@ -85,10 +114,11 @@ int compareVersions(const string & v1, const string & v2)
     string::const_iterator p2 = v2.begin();
 
     while (p1 != v1.end() || p2 != v2.end()) {
-        string c1 = nextComponent(p1, v1.end());
-        string c2 = nextComponent(p2, v2.end());
-        if (componentsLT(c1, c2)) return -1;
-        else if (componentsLT(c2, c1)) return 1;
+        string::const_iterator b1, e1, b2, e2;
+        nextComponent(p1, v1.end(), b1, e1);
+        nextComponent(p2, v2.end(), b2, e2);
+        if (componentsLT(b1, e1, b2, e2)) return -1;
+        else if (componentsLT(b2, e2, b1, e1)) return 1;
     }
 
     return 0;
@@ -529,7 +529,7 @@ formal
 namespace nix {
 
 
-Expr * EvalState::parse(const char * text,
+Expr * EvalState::parse(char * text, size_t length,
     const Path & path, const Path & basePath, StaticEnv & staticEnv)
 {
     yyscan_t scanner;
@@ -538,7 +538,10 @@ Expr * EvalState::parse(const char * text,
     data.path = data.symbols.create(path);
 
     yylex_init(&scanner);
-    yy_scan_string(text, scanner);
+    /* Scan the text in place rather than through yy_scan_string(),
+       which would copy all of it into a fresh buffer.  The caller must
+       provide the two NUL bytes at the end that flex requires. */
+    yy_scan_buffer(text, length, scanner);
     int res = yyparse(scanner, &data);
     yylex_destroy(scanner);
 
@@ -585,13 +588,17 @@ Expr * EvalState::parseExprFromFile(const Path & path)
 
 Expr * EvalState::parseExprFromFile(const Path & path, StaticEnv & staticEnv)
 {
-    return parse(readFile(path).c_str(), path, dirOf(path), staticEnv);
+    auto buffer = readFile(path);
+    buffer.append("\0\0", 2);
+    return parse(&buffer[0], buffer.size(), path, dirOf(path), staticEnv);
 }
 
 
 Expr * EvalState::parseExprFromString(const string & s, const Path & basePath, StaticEnv & staticEnv)
 {
-    return parse(s.c_str(), "(string)", basePath, staticEnv);
+    auto buffer = s;
+    buffer.append("\0\0", 2);
+    return parse(&buffer[0], buffer.size(), "(string)", basePath, staticEnv);
 }
 
 
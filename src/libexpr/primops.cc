@@ -5,8 +5,10 @@
 #include "eval.hh"
 #include "globals.hh"
 #include "json-to-value.hh"
+#include "lru-cache.hh"
 #include "names.hh"
 #include "store-api.hh"
+#include "sync.hh"
 #include "util.hh"
 #include "json.hh"
 #include "value-to-json.hh"
@@ -18,8 +20,11 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <condition_variable>
 #include <cstring>
+#include <queue>
 #include <regex>
+#include <thread>
 #include <dlfcn.h>
 
 
@@ -50,6 +55,10 @@ void EvalState::realiseContext(const PathSet & context)
 {
     PathSet drvs;
     for (auto & i : context) {
+        /* Each context element is realised at most once per
+           evaluation; repeated imports from the same derivation cost
+           no further store round-trips. */
+        if (realisedContext.count(i)) continue;
         std::pair<string, string> decoded = decodeContext(i);
         Path ctx = decoded.first;
         assert(store->isStorePath(ctx));
@@ -67,6 +76,8 @@ void EvalState::realiseContext(const PathSet & context)
         store->queryMissing(drvs, willBuild, willSubstitute, unknown, downloadSize, narSize);
         store->buildPaths(drvs);
     }
+    for (auto & i : context)
+        realisedContext.insert(i);
 }
 
 
@@ -86,7 +97,11 @@ static void prim_scopedImport(EvalState & state, const Pos & pos, Value * * args
 
     path = state.checkSourcePath(path);
 
-    if (state.store->isStorePath(path) && state.store->isValidPath(path) && isDerivation(path)) {
+    /* Check the cheap .drv suffix before querying the store: when
+       nixpkgs itself lives in the store, every single import otherwise
+       pays a validity lookup just to find out it's not importing a
+       derivation. */
+    if (state.store->isStorePath(path) && isDerivation(path) && state.store->isValidPath(path)) {
         Derivation drv = readDerivation(path);
         Value & w = *state.allocValue();
         state.mkAttrs(w, 3 + drv.outputs.size());
@@ -136,6 +151,34 @@ static void prim_scopedImport(EvalState & state, const Pos & pos, Value * * args
 }
 
 
+/* Realise the store paths referenced by a list of strings in a single
+   batched build, and return the list unchanged.  The evaluator is
+   strict, so an expression like 'map import drvSrcs' realises each
+   derivation only at the moment its import is forced, one build
+   invocation at a time.  Wrapping the list as
+   'map import (builtins.realisePaths drvSrcs)' collects the whole
+   batch up front and hands it to the build machinery in one
+   buildPaths() call, which builds and substitutes the members in
+   parallel; the subsequent imports then find everything valid. */
+static void prim_realisePaths(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    state.forceList(*args[0], pos);
+
+    PathSet context;
+    for (unsigned int n = 0; n < args[0]->listSize(); ++n)
+        state.coerceToString(pos, *args[0]->listElems()[n], context, false, false);
+
+    try {
+        state.realiseContext(context);
+    } catch (InvalidPathError & e) {
+        throw EvalError(format("cannot realise path '%1%', since it is not valid, at %2%")
+            % e.path % pos);
+    }
+
+    v = *args[0];
+}
+
+
 /* Want reasonable symbol names, so extern C */
 /* !!! Should we pass the Pos or the file name too? */
 extern "C" typedef void (*ValueInitializer)(EvalState & state, Value & v);
@@ -157,24 +200,37 @@ static void prim_importNative(EvalState & state, const Pos & pos, Value * * args
 
     string sym = state.forceStringNoCtx(*args[1], pos);
 
-    void *handle = dlopen(path.c_str(), RTLD_LAZY | RTLD_LOCAL);
-    if (!handle)
-        throw EvalError(format("could not open '%1%': %2%") % path % dlerror());
+    /* Since we never dlclose (v may be a primop referencing a
+       function in the shared object), handles and resolved symbols
+       stay valid for the lifetime of the process, so cache them and
+       pay the loader only once per (path, symbol) pair. */
+    static std::map<std::pair<Path, string>, ValueInitializer> importNativeCache;
 
-    dlerror();
-    ValueInitializer func = (ValueInitializer) dlsym(handle, sym.c_str());
-    if(!func) {
-        char *message = dlerror();
-        if (message)
-            throw EvalError(format("could not load symbol '%1%' from '%2%': %3%") % sym % path % message);
-        else
-            throw EvalError(format("symbol '%1%' from '%2%' resolved to NULL when a function pointer was expected")
-                    % sym % path);
+    ValueInitializer func;
+
+    auto cached = importNativeCache.find({path, sym});
+    if (cached != importNativeCache.end())
+        func = cached->second;
+    else {
+        void *handle = dlopen(path.c_str(), RTLD_LAZY | RTLD_LOCAL);
+        if (!handle)
+            throw EvalError(format("could not open '%1%': %2%") % path % dlerror());
+
+        dlerror();
+        func = (ValueInitializer) dlsym(handle, sym.c_str());
+        if(!func) {
+            char *message = dlerror();
+            if (message)
+                throw EvalError(format("could not load symbol '%1%' from '%2%': %3%") % sym % path % message);
+            else
+                throw EvalError(format("symbol '%1%' from '%2%' resolved to NULL when a function pointer was expected")
+                        % sym % path);
+        }
+
+        importNativeCache.emplace(std::make_pair(path, sym), func);
     }
 
     (func)(state, v);
-
-    /* We don't dlclose because v may be a primop referencing a function in the shared object file */
 }
 
 
@@ -426,10 +482,10 @@ static void prim_tryEval(EvalState & state, const Pos & pos, Value * * args, Val
     try {
         state.forceValue(*args[0]);
         v.attrs->push_back(Attr(state.sValue, args[0]));
-        mkBool(*state.allocAttr(v, state.symbols.create("success")), true);
+        v.attrs->push_back(Attr(state.symbols.create("success"), &state.vTrue));
     } catch (AssertionError & e) {
-        mkBool(*state.allocAttr(v, state.sValue), false);
-        mkBool(*state.allocAttr(v, state.symbols.create("success")), false);
+        v.attrs->push_back(Attr(state.sValue, &state.vFalse));
+        v.attrs->push_back(Attr(state.symbols.create("success"), &state.vFalse));
     }
     v.attrs->sort();
 }
@@ -495,6 +551,89 @@ void prim_valueSize(EvalState & state, const Pos & pos, Value * * args, Value &
    derivation; `drvPath' containing the path of the Nix expression;
    and `type' set to `derivation' to indicate that this is a
    derivation. */
+/* Speculatively probe the substituters for the outputs of every
+   derivation as it is instantiated, so that by the time evaluation
+   finishes and the build graph is ready, the narinfo caches are
+   already warm and substitution can start without a burst of
+   lookups.  A single background thread feeds the probes; for binary
+   cache substituters the query itself is asynchronous, so the
+   thread mostly just keeps the download queue filled. */
+class OutputPrefetcher
+{
+    struct State
+    {
+        std::queue<Path> left;
+        PathSet seen;
+        bool quit = false;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+    std::thread thread;
+
+    void run()
+    {
+        std::list<ref<Store>> substituters;
+        try {
+            substituters = getDefaultSubstituters();
+        } catch (...) {
+            return;
+        }
+
+        while (true) {
+            Path path;
+            {
+                auto state(state_.lock());
+                while (state->left.empty() && !state->quit)
+                    state.wait(wakeup);
+                if (state->quit) return;
+                path = state->left.front();
+                state->left.pop();
+            }
+
+            for (auto & sub : substituters)
+                try {
+                    sub->queryPathInfo(path,
+                        [](ref<ValidPathInfo>) { },
+                        [](std::exception_ptr) { });
+                } catch (...) {
+                    /* Prefetching is best-effort; real errors recur
+                       during substitution, where they are handled. */
+                }
+        }
+    }
+
+public:
+
+    OutputPrefetcher() : thread([this]() { run(); }) { }
+
+    ~OutputPrefetcher()
+    {
+        state_.lock()->quit = true;
+        wakeup.notify_one();
+        thread.join();
+    }
+
+    void add(const Path & path)
+    {
+        {
+            auto state(state_.lock());
+            if (!state->seen.insert(path).second) return;
+            state->left.push(path);
+        }
+        wakeup.notify_one();
+    }
+};
+
+
+static void prefetchOutputs(const Derivation & drv)
+{
+    static OutputPrefetcher prefetcher;
+    for (auto & i : drv.outputs)
+        prefetcher.add(i.second.path);
+}
+
+
 static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceAttrs(*args[0], pos);
@@ -751,6 +890,9 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
        read them later. */
     drvHashes[drvPath] = hashDerivationModulo(*state.store, drv);
 
+    if (settings.evalSubstituterPrefetch)
+        prefetchOutputs(drv);
+
     state.mkAttrs(v, 1 + drv.outputs.size());
     mkString(*state.allocAttr(v, state.sDrvPath), drvPath, {"=" + drvPath});
     for (auto & i : drv.outputs) {
@@ -1290,8 +1432,7 @@ static void prim_functionArgs(EvalState & state, const Pos & pos, Value * * args
 
     state.mkAttrs(v, args[0]->lambda.fun->formals->formals.size());
     for (auto & i : args[0]->lambda.fun->formals->formals)
-        // !!! should optimise booleans (allocate only once)
-        mkBool(*state.allocAttr(v, i.name), i.def);
+        v.attrs->push_back(Attr(i.name, i.def ? &state.vTrue : &state.vFalse));
     v.attrs->sort();
 }
 
@@ -1361,6 +1502,36 @@ static void prim_map(EvalState & state, const Pos & pos, Value * * args, Value &
 }
 
 
+/* Apply a function to every element of a list, and concatenate the
+   resulting lists.  Equivalent to (but much faster than) the
+   corresponding fold in nixpkgs' lib, which builds a fresh list per
+   ++. */
+static void prim_concatMap(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    state.forceFunction(*args[0], pos);
+    state.forceList(*args[1], pos);
+    auto nrLists = args[1]->listSize();
+
+    Value lists[nrLists];
+    size_t len = 0;
+
+    for (unsigned int n = 0; n < nrLists; ++n) {
+        Value * vElem = args[1]->listElems()[n];
+        state.callFunction(*args[0], *vElem, lists[n], pos);
+        state.forceList(lists[n], pos);
+        len += lists[n].listSize();
+    }
+
+    state.mkList(v, len);
+    auto out = v.listElems();
+    for (unsigned int n = 0, pos = 0; n < nrLists; ++n) {
+        auto l = lists[n].listSize();
+        memcpy(out + pos, lists[n].listElems(), l * sizeof(Value *));
+        pos += l;
+    }
+}
+
+
 /* Filter a list using a predicate; that is, return a list containing
    every element from the list for which the predicate function
    returns true. */
@@ -1510,12 +1681,76 @@ static void prim_sort(EvalState & state, const Pos & pos, Value * * args, Value
     }
 
 
+    /* Optimization: if the comparator is lessThan, bypass
+       callFunction.  Hoisted out of the comparator so the check runs
+       once, not once per comparison. */
+    bool isLessThan =
+        args[0]->type == tPrimOp && args[0]->primOp->fun == prim_lessThan;
+
+    /* Fast path for the very common key-selection comparator
+       'a: b: a.x < b.x' (and 'a.x > b.x', which the parser turns
+       into the same application with the operands swapped).  The
+       selections are then done natively, saving two thunk
+       allocations and two callFunction() invocations per
+       comparison. */
+    Symbol attrSym;
+    bool fastCmp = false, swapped = false;
+
+    if (!isLessThan && len >= 2 && args[0]->type == tLambda && !args[0]->lambda.fun->matchAttrs) {
+        auto inner = dynamic_cast<ExprLambda *>(args[0]->lambda.fun->body);
+        ExprApp * app1, * app2;
+        if (inner && !inner->matchAttrs
+            && (app1 = dynamic_cast<ExprApp *>(inner->body))
+            && (app2 = dynamic_cast<ExprApp *>(app1->e1)))
+        {
+            auto fun = dynamic_cast<ExprVar *>(app2->e1);
+            auto sel1 = dynamic_cast<ExprSelect *>(app2->e2);
+            auto sel2 = dynamic_cast<ExprSelect *>(app1->e2);
+            ExprVar * var1, * var2;
+            if (fun && !fun->fromWith && fun->level >= 2
+                && sel1 && !sel1->def && sel1->attrPath.size() == 1 && sel1->attrPath[0].symbol.set()
+                && sel2 && !sel2->def && sel2->attrPath.size() == 1 && sel2->attrPath[0].symbol.set()
+                && sel1->attrPath[0].symbol == sel2->attrPath[0].symbol
+                && (var1 = dynamic_cast<ExprVar *>(sel1->e)) && !var1->fromWith && var1->displ == 0
+                && (var2 = dynamic_cast<ExprVar *>(sel2->e)) && !var2->fromWith && var2->displ == 0
+                && ((var1->level == 1 && var2->level == 0)
+                    || (var1->level == 0 && var2->level == 1)))
+            {
+                /* Check that the applied function really is the
+                   builtin lessThan and not something shadowing it:
+                   resolve the variable in the environment the lambda
+                   closes over. */
+                Env * env = args[0]->lambda.env;
+                for (unsigned int l = 2; l < fun->level; ++l) env = env->up;
+                Value * fv = env->values[fun->displ];
+                if (fv) {
+                    state.forceValue(*fv);
+                    if (fv->type == tPrimOp && fv->primOp->fun == prim_lessThan) {
+                        attrSym = sel1->attrPath[0].symbol;
+                        swapped = var1->level == 0;
+                        fastCmp = true;
+                    }
+                }
+            }
+        }
+    }
+
+    auto getKey = [&](Value * v) -> Value * {
+        state.forceAttrs(*v, pos);
+        Bindings::iterator j = v->attrs->find(attrSym);
+        if (j == v->attrs->end())
+            throw EvalError(format("attribute '%1%' missing, at %2%") % attrSym % pos);
+        state.forceValue(*j->value);
+        return j->value;
+    };
+
     auto comparator = [&](Value * a, Value * b) {
-        /* Optimization: if the comparator is lessThan, bypass
-           callFunction. */
-        if (args[0]->type == tPrimOp && args[0]->primOp->fun == prim_lessThan)
+        if (isLessThan)
             return CompareValues()(a, b);
 
+        if (fastCmp)
+            return CompareValues()(getKey(swapped ? b : a), getKey(swapped ? a : b));
+
         Value vTmp1, vTmp2;
         state.callFunction(*args[0], *a, vTmp1, pos);
         state.callFunction(vTmp1, *b, vTmp2, pos);
@@ -1707,19 +1942,38 @@ static void prim_hashString(EvalState & state, const Pos & pos, Value * * args,
 
 /* Match a regular expression against a string and return either
    ‘null’ or a list containing substring matches. */
+/* Return the compiled form of a regular expression.  nixpkgs' version
+   helpers apply the same handful of patterns hundreds of thousands of
+   times, and std::regex construction costs far more than matching, so
+   compiled regexes are kept in an LRU cache.  The regex is handed out
+   as a shared_ptr: the caller may run nested evaluation (e.g. forcing
+   the string to match) before matching, which can compile further
+   regexes and evict this one from the cache. */
+static std::shared_ptr<std::regex> getRegex(const std::string & re)
+{
+    static LRUCache<std::string, std::shared_ptr<std::regex>> regexCache(256);
+    auto r = regexCache.get(re);
+    if (!r) {
+        regexCache.upsert(re, std::make_shared<std::regex>(re, std::regex::extended));
+        r = regexCache.get(re);
+    }
+    return *r;
+}
+
+
 static void prim_match(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     auto re = state.forceStringNoCtx(*args[0], pos);
 
     try {
 
-        std::regex regex(re, std::regex::extended);
+        auto regex = getRegex(re);
 
         PathSet context;
         const std::string str = state.forceString(*args[1], context, pos);
 
         std::smatch match;
-        if (!std::regex_match(str, match, regex)) {
+        if (!std::regex_match(str, match, *regex)) {
             mkNull(v);
             return;
         }
@@ -1729,7 +1983,7 @@ static void prim_match(EvalState & state, const Pos & pos, Value * * args, Value
         state.mkList(v, len);
         for (size_t i = 0; i < len; ++i) {
             if (!match[i+1].matched)
-                mkNull(*(v.listElems()[i] = state.allocValue()));
+                v.listElems()[i] = &state.vNull;
             else
                 mkString(*(v.listElems()[i] = state.allocValue()), match[i + 1].str().c_str());
         }
@@ -1753,12 +2007,12 @@ static void prim_split(EvalState & state, const Pos & pos, Value * * args, Value
 
     try {
 
-        std::regex regex(re, std::regex::extended);
+        auto regex = getRegex(re);
 
         PathSet context;
         const std::string str = state.forceString(*args[1], context, pos);
 
-        auto begin = std::sregex_iterator(str.begin(), str.end(), regex);
+        auto begin = std::sregex_iterator(str.begin(), str.end(), *regex);
         auto end = std::sregex_iterator();
 
         // Any matches results are surrounded by non-matching results.
@@ -1788,7 +2042,7 @@ static void prim_split(EvalState & state, const Pos & pos, Value * * args, Value
             state.mkList(*elem, slen);
             for (size_t si = 0; si < slen; ++si) {
                 if (!match[si + 1].matched)
-                    mkNull(*(elem->listElems()[si] = state.allocValue()));
+                    elem->listElems()[si] = &state.vNull;
                 else
                     mkString(*(elem->listElems()[si] = state.allocValue()), match[si + 1].str().c_str());
             }
@@ -1825,7 +2079,15 @@ static void prim_concatStringSep(EvalState & state, const Pos & pos, Value * * a
 
     for (unsigned int n = 0; n < args[1]->listSize(); ++n) {
         if (first) first = false; else res += sep;
-        res += state.coerceToString(pos, *args[1]->listElems()[n], context);
+        Value & elem = *args[1]->listElems()[n];
+        state.forceValue(elem);
+        if (elem.type == tString) {
+            /* Append plain strings directly rather than through the
+               temporary copy coerceToString returns. */
+            copyContext(elem, context);
+            res += elem.string.s;
+        } else
+            res += state.coerceToString(pos, elem, context);
     }
 
     mkString(v, res, context);
@@ -2013,6 +2275,7 @@ void EvalState::createBaseEnv()
 
     // Miscellaneous
     addPrimOp("scopedImport", 2, prim_scopedImport);
+    addPrimOp("__realisePaths", 1, prim_realisePaths);
     Value * v2 = allocValue();
     mkAttrs(*v2, 0);
     mkApp(v, *baseEnv.values[baseEnvDispl - 1], *v2);
@@ -2080,6 +2343,7 @@ void EvalState::createBaseEnv()
     addPrimOp("__head", 1, prim_head);
     addPrimOp("__tail", 1, prim_tail);
     addPrimOp("map", 2, prim_map);
+    addPrimOp("__concatMap", 2, prim_concatMap);
     addPrimOp("__filter", 2, prim_filter);
     addPrimOp("__elem", 2, prim_elem);
     addPrimOp("__concatLists", 1, prim_concatLists);
@@ -75,14 +75,47 @@ Path exportGit(ref<Store> store, const std::string & uri,
         }
     }
 
-    // FIXME: should pipe this, or find some better way to extract a
-    // revision.
-    auto tar = runProgram("git", true, { "-C", cacheDir, "archive", commitHash });
-
     Path tmpDir = createTempDir();
     AutoDelete delTmpDir(tmpDir, true);
 
-    runProgram("tar", true, { "x", "-C", tmpDir }, tar);
+    /* Stream the archive from git straight into tar.  The archive
+       used to be buffered in memory in its entirety and then copied
+       through a second pipe, which for large repositories both
+       wasted memory and serialized the export and the extraction. */
+    Pipe pipe;
+    pipe.create();
+
+    Pid gitPid = startProcess([&]() {
+        if (dup2(pipe.writeSide.get(), STDOUT_FILENO) == -1)
+            throw SysError("dupping stdout");
+        pipe.readSide = -1;
+        restoreSignals();
+        Strings args = { "git", "-C", cacheDir, "archive", commitHash };
+        execvp("git", stringsToCharPtrs(args).data());
+        throw SysError("executing 'git archive'");
+    });
+
+    pipe.writeSide = -1;
+
+    Pid tarPid = startProcess([&]() {
+        if (dup2(pipe.readSide.get(), STDIN_FILENO) == -1)
+            throw SysError("dupping stdin");
+        pipe.writeSide = -1;
+        restoreSignals();
+        Strings args = { "tar", "x", "-C", tmpDir };
+        execvp("tar", stringsToCharPtrs(args).data());
+        throw SysError("executing 'tar'");
+    });
+
+    pipe.readSide = -1;
+
+    int status = tarPid.wait();
+    if (!statusOk(status))
+        throw ExecError(status, format("program 'tar' %1%") % statusToString(status));
+
+    status = gitPid.wait();
+    if (!statusOk(status))
+        throw ExecError(status, format("program 'git archive' %1%") % statusToString(status));
 
     auto storePath = store->addToStore("git-export", tmpDir);
 
@@ -63,6 +63,14 @@ private:
     Symbols symbols;
 
 public:
+    SymbolTable()
+    {
+        /* Parsing nixpkgs creates tens of thousands of symbols;
+           reserving up front avoids a series of full rehashes while
+           the parser is hot. */
+        symbols.reserve(16 * 1024);
+    }
+
     Symbol create(const string & s)
     {
         std::pair<Symbols::iterator, bool> res = symbols.insert(s);
@@ -43,13 +43,12 @@ void printValueAsJSON(EvalState & state, bool strict,
             Bindings::iterator i = v.attrs->find(state.sOutPath);
             if (i == v.attrs->end()) {
                 auto obj(out.object());
-                StringSet names;
-                for (auto & j : *v.attrs)
-                    names.insert(j.name);
-                for (auto & j : names) {
-                    Attr & a(*v.attrs->find(state.symbols.create(j)));
-                    auto placeholder(obj.placeholder(j));
-                    printValueAsJSON(state, strict, *a.value, placeholder, context);
+                /* Iterate in lexicographic order directly; building a
+                   StringSet and looking every attribute up again was
+                   two extra tree walks per attrset. */
+                for (auto & a : v.attrs->lexicographicOrder()) {
+                    auto placeholder(obj.placeholder(a->name));
+                    printValueAsJSON(state, strict, *a->value, placeholder, context);
                 }
             } else
                 printValueAsJSON(state, strict, *i->value, out, context);
@@ -112,6 +112,10 @@ void initNix()
 
     settings.loadConfFile();
 
+    /* Load plugins (if any) before anything constructs an EvalState,
+       so that primops they register end up in the base environment. */
+    initPlugins();
+
     startSignalHandlerThread();
 
     /* Reset SIGCHLD to its default. */
@@ -129,6 +133,21 @@ void initNix()
     /* Register a SIGSEGV handler to detect stack overflows. */
     detectStackOverflow();
 
+    /* The evaluator recurses on the C++ stack, and deeply nested
+       expressions (e.g. a big module system) can exceed the common
+       8 MiB default.  Raise the soft stack limit towards the hard
+       limit up front, so users don't have to fiddle with ulimit. */
+    struct rlimit stackLimit;
+    const rlim_t maxStackSize = 64 * 1024 * 1024;
+    if (getrlimit(RLIMIT_STACK, &stackLimit) == 0 &&
+        stackLimit.rlim_cur != RLIM_INFINITY &&
+        stackLimit.rlim_cur < maxStackSize)
+    {
+        stackLimit.rlim_cur = stackLimit.rlim_max == RLIM_INFINITY
+            ? maxStackSize : std::min(maxStackSize, stackLimit.rlim_max);
+        setrlimit(RLIMIT_STACK, &stackLimit);
+    }
+
     /* There is no privacy in the Nix system ;-)  At least not for
        now.  In particular, store objects should be readable by
        everybody. */
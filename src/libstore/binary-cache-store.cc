@@ -6,6 +6,7 @@
 #include "globals.hh"
 #include "nar-info.hh"
 #include "sync.hh"
+#include "thread-pool.hh"
 #include "remote-fs-accessor.hh"
 #include "nar-info-disk-cache.hh"
 #include "nar-accessor.hh"
@@ -17,66 +18,6 @@
 
 namespace nix {
 
-/* Given requests for a path /nix/store/<x>/<y>, this accessor will
-   first download the NAR for /nix/store/<x> from the binary cache,
-   build a NAR accessor for that NAR, and use that to access <y>. */
-struct BinaryCacheStoreAccessor : public FSAccessor
-{
-    ref<BinaryCacheStore> store;
-
-    std::map<Path, ref<FSAccessor>> nars;
-
-    BinaryCacheStoreAccessor(ref<BinaryCacheStore> store)
-        : store(store)
-    {
-    }
-
-    std::pair<ref<FSAccessor>, Path> fetch(const Path & path_)
-    {
-        auto path = canonPath(path_);
-
-        auto storePath = store->toStorePath(path);
-        std::string restPath = std::string(path, storePath.size());
-
-        if (!store->isValidPath(storePath))
-            throw InvalidPath(format("path '%1%' is not a valid store path") % storePath);
-
-        auto i = nars.find(storePath);
-        if (i != nars.end()) return {i->second, restPath};
-
-        StringSink sink;
-        store->narFromPath(storePath, sink);
-
-        auto accessor = makeNarAccessor(sink.s);
-        nars.emplace(storePath, accessor);
-        return {accessor, restPath};
-    }
-
-    Stat stat(const Path & path) override
-    {
-        auto res = fetch(path);
-        return res.first->stat(res.second);
-    }
-
-    StringSet readDirectory(const Path & path) override
-    {
-        auto res = fetch(path);
-        return res.first->readDirectory(res.second);
-    }
-
-    std::string readFile(const Path & path) override
-    {
-        auto res = fetch(path);
-        return res.first->readFile(res.second);
-    }
-
-    std::string readLink(const Path & path) override
-    {
-        auto res = fetch(path);
-        return res.first->readLink(res.second);
-    }
-};
-
 BinaryCacheStore::BinaryCacheStore(const Params & params)
     : Store(params)
 {
@@ -92,6 +33,8 @@ void BinaryCacheStore::init()
 {
     std::string cacheInfoFile = "nix-cache-info";
 
+    std::string bloomFile;
+
     auto cacheInfo = getFile(cacheInfoFile);
     if (!cacheInfo) {
         upsertFile(cacheInfoFile, "StoreDir: " + storeDir + "\n", "text/x-nix-cache-info");
@@ -109,9 +52,74 @@ void BinaryCacheStore::init()
                 wantMassQuery_ = value == "1";
             } else if (name == "Priority") {
                 string2Int(value, priority);
+            } else if (name == "BloomFilter") {
+                bloomFile = value;
             }
         }
     }
+
+    if (bloomFile != "") {
+        try {
+            auto data = getFile(bloomFile);
+            if (data) bloomFilter = parseBloomFilter(*data);
+        } catch (Error & e) {
+            printMsg(lvlError, format("warning: ignoring Bloom filter of binary cache '%s': %s")
+                % getUri() % e.msg());
+        }
+    }
+}
+
+/* A Bloom filter file consists of a header line
+
+     NixCacheBloom 1 <number of bits> <number of hash functions>
+
+   followed by the raw bit array, least significant bit first. */
+std::shared_ptr<BinaryCacheStore::BloomFilter> BinaryCacheStore::parseBloomFilter(const std::string & data)
+{
+    auto eol = data.find('\n');
+    if (eol == std::string::npos)
+        throw Error("Bloom filter header is missing");
+
+    auto tokens = tokenizeString<std::vector<std::string>>(data.substr(0, eol), " ");
+    uint64_t nbits;
+    unsigned int k;
+    if (tokens.size() != 4
+        || tokens[0] != "NixCacheBloom"
+        || tokens[1] != "1"
+        || !string2Int(tokens[2], nbits)
+        || !string2Int(tokens[3], k)
+        || nbits == 0 || k == 0 || k > 64)
+        throw Error("Bloom filter has an unsupported header");
+
+    auto filter = std::make_shared<BloomFilter>();
+    filter->bits = data.substr(eol + 1);
+    filter->nbits = nbits;
+    filter->k = k;
+
+    if (filter->bits.size() != (nbits + 7) / 8)
+        throw Error("Bloom filter has a truncated bit array");
+
+    return filter;
+}
+
+bool BinaryCacheStore::BloomFilter::mayContain(const std::string & hashPart)
+{
+    /* Derive the k bit positions from a SHA-256 of the hash part
+       using double hashing (h1 + i * h2). */
+    auto h = hashString(htSHA256, hashPart);
+
+    uint64_t h1 = 0, h2 = 0;
+    for (unsigned int j = 0; j < 8; j++) {
+        h1 = (h1 << 8) | h.hash[j];
+        h2 = (h2 << 8) | h.hash[j + 8];
+    }
+
+    for (unsigned int i = 0; i < k; i++) {
+        uint64_t bit = (h1 + i * h2) % nbits;
+        if (!(bits[bit / 8] & (1 << (bit % 8)))) return false;
+    }
+
+    return true;
 }
 
 std::shared_ptr<std::string> BinaryCacheStore::getFile(const std::string & path)
@@ -133,6 +141,70 @@ Path BinaryCacheStore::narInfoFileFor(const Path & storePath)
     return storePathToHash(storePath) + ".narinfo";
 }
 
+void BinaryCacheStore::deleteUnreachable(const PathSet & roots, bool dryRun, GCResults & results)
+{
+    /* Establish the live set.  Roots that are no longer in the cache
+       are skipped rather than fatal, since closure lists handed to a
+       GC are routinely a bit stale. */
+    auto liveRoots = queryValidPaths(roots);
+    for (auto & root : roots)
+        if (!liveRoots.count(root))
+            printError(format("warning: root '%1%' is not in the binary cache, ignoring") % root);
+
+    PathSet live;
+    computeFSClosure(liveRoots, live);
+
+    auto all = queryAllValidPaths();
+
+    PathSet dead;
+    for (auto & path : all)
+        if (!live.count(path)) dead.insert(path);
+
+    printInfo(format("%1% paths in the cache, %2% live, deleting %3%")
+        % all.size() % live.size() % dead.size());
+
+    struct GCState
+    {
+        PathSet deleted;
+        uint64_t bytesFreed = 0;
+    };
+
+    Sync<GCState> state_;
+
+    ThreadPool pool;
+
+    for (auto & path : dead)
+        pool.enqueue([&, path]() {
+            checkInterrupt();
+
+            auto info = queryPathInfo(path);
+            auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
+                std::shared_ptr<const ValidPathInfo>(info));
+            assert(narInfo);
+
+            if (!dryRun) {
+                /* Remove the narinfo first, so that clients stop
+                   being referred to the NAR we're about to delete; a
+                   crash in between leaves at worst an orphaned NAR. */
+                deleteFile(narInfoFileFor(path));
+                if (writeNARListing)
+                    deleteFile(storePathToHash(path) + ".ls");
+                deleteFile(narInfo->url);
+            }
+
+            auto state(state_.lock());
+            state->deleted.insert(path);
+            state->bytesFreed += narInfo->fileSize;
+        });
+
+    pool.process();
+
+    auto state(state_.lock());
+    results.paths = state->deleted;
+    results.bytesFreed = state->bytesFreed;
+}
+
+
 void BinaryCacheStore::addToStore(const ValidPathInfo & info, const ref<std::string> & nar,
     RepairFlag repair, CheckSigsFlag checkSigs, std::shared_ptr<FSAccessor> accessor)
 {
@@ -161,7 +233,7 @@ void BinaryCacheStore::addToStore(const ValidPathInfo & info, const ref<std::str
     if (info.narHash && info.narHash != narInfo->narHash)
         throw Error(format("refusing to copy corrupted path '%1%' to binary cache") % info.path);
 
-    auto accessor_ = std::dynamic_pointer_cast<BinaryCacheStoreAccessor>(accessor);
+    auto accessor_ = std::dynamic_pointer_cast<RemoteFSAccessor>(accessor);
 
     /* Optionally write a JSON file containing a listing of the
        contents of the NAR. */
@@ -175,44 +247,11 @@ void BinaryCacheStore::addToStore(const ValidPathInfo & info, const ref<std::str
             auto narAccessor = makeNarAccessor(nar);
 
             if (accessor_)
-                accessor_->nars.emplace(info.path, narAccessor);
-
-            std::function<void(const Path &, JSONPlaceholder &)> recurse;
-
-            recurse = [&](const Path & path, JSONPlaceholder & res) {
-                auto st = narAccessor->stat(path);
-
-                auto obj = res.object();
-
-                switch (st.type) {
-                case FSAccessor::Type::tRegular:
-                    obj.attr("type", "regular");
-                    obj.attr("size", st.fileSize);
-                    if (st.isExecutable)
-                        obj.attr("executable", true);
-                    break;
-                case FSAccessor::Type::tDirectory:
-                    obj.attr("type", "directory");
-                    {
-                        auto res2 = obj.object("entries");
-                        for (auto & name : narAccessor->readDirectory(path)) {
-                            auto res3 = res2.placeholder(name);
-                            recurse(path + "/" + name, res3);
-                        }
-                    }
-                    break;
-                case FSAccessor::Type::tSymlink:
-                    obj.attr("type", "symlink");
-                    obj.attr("target", narAccessor->readLink(path));
-                    break;
-                default:
-                    abort();
-                }
-            };
+                accessor_->addToCache(info.path, *nar, narAccessor);
 
             {
                 auto res = jsonRoot.placeholder("root");
-                recurse("", res);
+                listNar(res, narAccessor);
             }
         }
 
@@ -221,13 +260,13 @@ void BinaryCacheStore::addToStore(const ValidPathInfo & info, const ref<std::str
 
     else {
         if (accessor_)
-            accessor_->nars.emplace(info.path, makeNarAccessor(nar));
+            accessor_->addToCache(info.path, *nar, makeNarAccessor(nar));
     }
 
     /* Compress the NAR. */
     narInfo->compression = compression;
     auto now1 = std::chrono::steady_clock::now();
-    auto narCompressed = compress(compression, *nar);
+    auto narCompressed = compress(compression, *nar, parallelCompression);
     auto now2 = std::chrono::steady_clock::now();
     narInfo->fileHash = hashString(htSHA256, *narCompressed);
     narInfo->fileSize = narCompressed->size();
@@ -263,7 +302,7 @@ void BinaryCacheStore::addToStore(const ValidPathInfo & info, const ref<std::str
 
     {
         auto state_(state.lock());
-        state_->pathInfoCache.upsert(hashPart, std::shared_ptr<NarInfo>(narInfo));
+        state_->pathInfoCache.upsert(hashPart, PathInfoCacheValue(std::shared_ptr<NarInfo>(narInfo)));
     }
 
     if (diskCache)
@@ -274,6 +313,11 @@ void BinaryCacheStore::addToStore(const ValidPathInfo & info, const ref<std::str
 
 bool BinaryCacheStore::isValidPathUncached(const Path & storePath)
 {
+    if (bloomFilter && !bloomFilter->mayContain(storePathToHash(storePath))) {
+        stats.narInfoMissing++;
+        return false;
+    }
+
     // FIXME: this only checks whether a .narinfo with a matching hash
     // part exists. So ‘f4kb...-foo’ matches ‘f4kb...-bar’, even
     // though they shouldn't. Not easily fixed.
@@ -291,28 +335,47 @@ void BinaryCacheStore::narFromPath(const Path & storePath, Sink & sink)
     stats.narRead++;
     stats.narReadCompressedBytes += nar->size();
 
-    /* Decompress the NAR. FIXME: would be nice to have the remote
-       side do this. */
+    /* Decompress the NAR directly into the caller's sink, rather
+       than materialising the uncompressed NAR as a second large
+       string.  FIXME: would be nice to have the remote side do
+       this. */
+    struct CountingSink : Sink
+    {
+        Sink & inner;
+        uint64_t size = 0;
+        CountingSink(Sink & inner) : inner(inner) { }
+        void operator () (const unsigned char * data, size_t len) override
+        {
+            size += len;
+            inner(data, len);
+        }
+    };
+
+    CountingSink countingSink(sink);
+
     try {
-        nar = decompress(info->compression, *nar);
+        auto decompressionSink = makeDecompressionSink(info->compression, countingSink);
+        (*decompressionSink)(*nar);
+        decompressionSink->finish();
     } catch (UnknownCompressionMethod &) {
         throw Error(format("binary cache path '%s' uses unknown compression method '%s'")
             % storePath % info->compression);
     }
 
-    stats.narReadBytes += nar->size();
+    stats.narReadBytes += countingSink.size;
 
-    printMsg(lvlTalkative, format("exporting path '%1%' (%2% bytes)") % storePath % nar->size());
-
-    assert(nar->size() % 8 == 0);
-
-    sink((unsigned char *) nar->c_str(), nar->size());
+    printMsg(lvlTalkative, format("exporting path '%1%' (%2% bytes)") % storePath % countingSink.size);
 }
 
 void BinaryCacheStore::queryPathInfoUncached(const Path & storePath,
         std::function<void(std::shared_ptr<ValidPathInfo>)> success,
         std::function<void(std::exception_ptr exc)> failure)
 {
+    if (bloomFilter && !bloomFilter->mayContain(storePathToHash(storePath))) {
+        stats.narInfoMissing++;
+        return success(0);
+    }
+
     auto narInfoFile = narInfoFileFor(storePath);
 
     getFile(narInfoFile,
@@ -372,7 +435,7 @@ Path BinaryCacheStore::addTextToStore(const string & name, const string & s,
 
 ref<FSAccessor> BinaryCacheStore::getFSAccessor()
 {
-    return make_ref<RemoteFSAccessor>(ref<Store>(shared_from_this()));
+    return make_ref<RemoteFSAccessor>(ref<Store>(shared_from_this()), localNarCache);
 }
 
 std::shared_ptr<std::string> BinaryCacheStore::getBuildLog(const Path & path)
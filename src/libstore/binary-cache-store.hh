@@ -18,6 +18,12 @@ public:
     const Setting<std::string> compression{this, "xz", "compression", "NAR compression method ('xz', 'bzip2', or 'none')"};
     const Setting<bool> writeNARListing{this, false, "write-nar-listing", "whether to write a JSON file listing the files in each NAR"};
     const Setting<Path> secretKeyFile{this, "", "secret-key", "path to secret key used to sign the binary cache"};
+    const Setting<bool> parallelCompression{this, false, "parallel-compression",
+        "enable multi-threading compression, available for xz only currently"};
+    /* Note: the NAR cache is not purged automatically; it's up to
+       the user to delete it now and then (like ~/.cache/nix/tarballs). */
+    const Setting<Path> localNarCache{this, "", "local-nar-cache",
+        "path to a local directory in which to cache NARs fetched from this binary cache"};
 
 private:
 
@@ -35,6 +41,13 @@ public:
         const std::string & data,
         const std::string & mimeType) = 0;
 
+    /* Delete the specified file.  Deleting a file that does not
+       exist is not an error (an interrupted GC may already have
+       removed it).  The default is to fail: most cache types are
+       append-only from Nix's point of view. */
+    virtual void deleteFile(const std::string & path)
+    { unsupported(); }
+
     /* Return the contents of the specified file, or null if it
        doesn't exist. */
     virtual void getFile(const std::string & path,
@@ -48,10 +61,35 @@ protected:
     bool wantMassQuery_ = false;
     int priority = 50;
 
+    /* An optional Bloom filter over the hash parts of the paths in
+       the cache, published by the cache operator and advertised
+       through a 'BloomFilter:' field in nix-cache-info.  If a hash
+       part is definitely not in the filter, we can answer lookups
+       negatively without a network probe.  Note that the filter is a
+       snapshot: paths added to the cache after it was generated may
+       be reported as missing until it is regenerated, so operators
+       should refresh it regularly. */
+    struct BloomFilter
+    {
+        std::string bits;
+        uint64_t nbits;
+        unsigned int k;
+        bool mayContain(const std::string & hashPart);
+    };
+
+    static std::shared_ptr<BloomFilter> parseBloomFilter(const std::string & data);
+
+    std::shared_ptr<BloomFilter> bloomFilter;
+
 public:
 
     virtual void init();
 
+    /* Delete all NAR/narinfo pairs not reachable from 'roots'.
+       Requires a cache type that supports listing (see
+       queryAllValidPaths()) and deletion. */
+    void deleteUnreachable(const PathSet & roots, bool dryRun, GCResults & results);
+
 private:
 
     std::string narMagic;
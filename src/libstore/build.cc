@@ -10,6 +10,8 @@
 #include "compression.hh"
 #include "json.hh"
 #include "nar-info.hh"
+#include "thread-pool.hh"
+#include "tracepoints.hh"
 
 #include <algorithm>
 #include <iostream>
@@ -18,6 +20,7 @@
 #include <thread>
 #include <future>
 #include <chrono>
+#include <condition_variable>
 
 #include <limits.h>
 #include <sys/time.h>
@@ -39,6 +42,7 @@
 #if __linux__
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/inotify.h>
 #include <net/if.h>
 #include <netinet/ip.h>
 #include <sys/personality.h>
@@ -222,10 +226,13 @@ private:
     /* Child processes currently running. */
     std::list<Child> children;
 
-    /* Number of build slots occupied.  This includes local builds and
-       substitutions but not remote builds via the build hook. */
+    /* Number of build slots occupied.  This includes local builds
+       but not substitutions or remote builds via the build hook. */
     unsigned int nrLocalBuilds;
 
+    /* Number of substitution slots occupied. */
+    unsigned int nrSubstitutions;
+
     /* Maps used to prevent multiple instantiations of a goal for the
        same derivation / path. */
     WeakGoalMap derivationGoals;
@@ -240,6 +247,14 @@ private:
     /* Last time the goals in `waitingForAWhile' where woken up. */
     steady_time_point lastWokenUp;
 
+#if __linux__
+    /* An inotify instance watching the lock files that goals in
+       `waitingForAWhile' are polling, so that they can be woken as
+       soon as the holder releases a lock instead of at the next poll
+       interval. */
+    AutoCloseFD lockWatchFd;
+#endif
+
     /* Cache for pathContentsGood(). */
     std::map<Path, bool> pathContentsGoodCache;
 
@@ -289,11 +304,18 @@ public:
     /* Wake up a goal (i.e., there is something for it to do). */
     void wakeUp(GoalPtr goal);
 
-    /* Return the number of local build and substitution processes
-       currently running (but not remote builds via the build
-       hook). */
+    /* Return the number of local build processes currently running
+       (but not remote builds via the build hook). */
     unsigned int getNrLocalBuilds();
 
+    /* Return the number of substitution processes currently
+       running. */
+    unsigned int getNrSubstitutions();
+
+    /* Whether the system load average currently exceeds
+       'max-load-average' (always false if that setting is 0). */
+    bool loadTooHigh();
+
     /* Registers a running child process.  `inBuildSlot' means that
        the process counts towards the jobs limit. */
     void childStarted(GoalPtr goal, const set<int> & fds,
@@ -319,6 +341,11 @@ public:
        to wait for multiple locks in the main select() loop. */
     void waitForAWhile(GoalPtr goal);
 
+    /* Wake up the goals in `waitingForAWhile' when the given lock
+       file is written to or deleted (i.e. probably released).  No-op
+       on platforms without inotify; those rely purely on polling. */
+    void watchLockFile(const Path & lockPath);
+
     /* Loop until the specified top-level goals have finished. */
     void run(const Goals & topGoals);
 
@@ -371,6 +398,8 @@ void Goal::waiteeDone(GoalPtr waitee, ExitCode result)
     trace(format("waitee '%1%' done; %2% left") %
         waitee->name % waitees.size());
 
+    NIX_PROBE3(goal_waitee_done, name.c_str(), waitee->name.c_str(), (int) result);
+
     if (result == ecFailed || result == ecNoSubstituters || result == ecIncompleteClosure) ++nrFailed;
 
     if (result == ecNoSubstituters) ++nrNoSubstituters;
@@ -1338,6 +1367,7 @@ void DerivationGoal::tryToBuild()
         if (pathIsLockedByMe(worker.store.toRealPath(i.second.path))) {
             debug(format("putting derivation '%1%' to sleep because '%2%' is locked by another goal")
                 % drvPath % i.second.path);
+            NIX_PROBE1(build_output_locked, drvPath.c_str());
             worker.waitForAnyGoal(shared_from_this());
             return;
         }
@@ -1352,6 +1382,9 @@ void DerivationGoal::tryToBuild()
         lockFiles.insert(worker.store.toRealPath(outPath));
 
     if (!outputLocks.lockPaths(lockFiles, "", false)) {
+        NIX_PROBE1(build_lock_contention, drvPath.c_str());
+        for (auto & lockFile : lockFiles)
+            worker.watchLockFile(lockFile + ".lock");
         worker.waitForAWhile(shared_from_this());
         return;
     }
@@ -1421,7 +1454,9 @@ void DerivationGoal::tryToBuild()
        derivation prefers to be done locally, do it even if
        maxBuildJobs is 0. */
     unsigned int curBuilds = worker.getNrLocalBuilds();
-    if (curBuilds >= settings.maxBuildJobs && !(buildLocally && curBuilds == 0)) {
+    if ((curBuilds >= settings.maxBuildJobs && !(buildLocally && curBuilds == 0))
+        || (curBuilds > 0 && worker.loadTooHigh()))
+    {
         worker.waitForBuildSlot(shared_from_this());
         outputLocks.unlock();
         return;
@@ -1480,7 +1515,9 @@ void DerivationGoal::buildDone()
        to have terminated.  In fact, the builder could also have
        simply have closed its end of the pipe, so just to be sure,
        kill it. */
-    int status = hook ? hook->pid.kill() : pid.kill();
+    struct rusage buildUsage;
+    memset(&buildUsage, 0, sizeof(buildUsage));
+    int status = hook ? hook->pid.kill() : pid.kill(&buildUsage);
 
     debug(format("builder process for '%1%' finished") % drvPath);
 
@@ -1558,6 +1595,26 @@ void DerivationGoal::buildDone()
            being valid. */
         registerOutputs();
 
+        /* Persist a performance record for this build, so that
+           regressions can be spotted by 'nix build-stats' without an
+           external scraping system.  Hook builds ran elsewhere, so
+           there is no resource usage to record for them. */
+        if (!hook && buildMode == bmNormal)
+            try {
+                LocalStore::BuildMetrics metrics;
+                metrics.startTime = result.startTime;
+                metrics.duration = result.stopTime - result.startTime;
+                metrics.cpuUser = buildUsage.ru_utime.tv_sec * 1000 + buildUsage.ru_utime.tv_usec / 1000;
+                metrics.cpuSystem = buildUsage.ru_stime.tv_sec * 1000 + buildUsage.ru_stime.tv_usec / 1000;
+                metrics.peakRSS = buildUsage.ru_maxrss;
+                metrics.outputSize = 0;
+                for (auto & i : drv->outputs)
+                    metrics.outputSize += worker.store.queryPathInfo(i.second.path)->narSize;
+                worker.store.addBuildMetrics(drvPath, metrics);
+            } catch (...) {
+                ignoreException();
+            }
+
         if (buildMode == bmCheck) {
             done(BuildResult::Built);
             return;
@@ -2885,6 +2942,54 @@ PathSet parseReferenceSpecifiers(Store & store, const BasicDerivation & drv, str
 }
 
 
+/* Walk two directory trees and summarise where they differ, one line
+   per differing file, for determinism check reports.  The walk stops
+   after a hundred entries; a diverging timestamp embedded in every
+   file would otherwise produce a report the size of the output. */
+static void diffPaths(const Path & a, const Path & b, const Path & rel, Strings & diffs)
+{
+    if (diffs.size() >= 100) return;
+
+    auto stA = lstat(a);
+    auto stB = lstat(b);
+
+    if ((stA.st_mode & S_IFMT) != (stB.st_mode & S_IFMT)) {
+        diffs.push_back(fmt("%s: file type differs", rel));
+        return;
+    }
+
+    if (S_ISDIR(stA.st_mode)) {
+        auto entriesA = readDirectory(a);
+        StringSet namesA, namesB;
+        for (auto & i : entriesA) namesA.insert(i.name);
+        for (auto & i : readDirectory(b)) namesB.insert(i.name);
+        for (auto & name : namesA)
+            if (!namesB.count(name))
+                diffs.push_back(fmt("%s/%s: missing from the rebuilt output", rel, name));
+        for (auto & name : namesB)
+            if (!namesA.count(name))
+                diffs.push_back(fmt("%s/%s: only in the rebuilt output", rel, name));
+        for (auto & name : namesA)
+            if (namesB.count(name))
+                diffPaths(a + "/" + name, b + "/" + name, rel + "/" + name, diffs);
+    }
+
+    else if (S_ISLNK(stA.st_mode)) {
+        if (readLink(a) != readLink(b))
+            diffs.push_back(fmt("%s: symlink target differs", rel));
+    }
+
+    else if (S_ISREG(stA.st_mode)) {
+        if ((stA.st_mode & S_IXUSR) != (stB.st_mode & S_IXUSR))
+            diffs.push_back(fmt("%s: executable bit differs", rel));
+        else if (stA.st_size != stB.st_size)
+            diffs.push_back(fmt("%s: size differs (%d versus %d bytes)", rel, stA.st_size, stB.st_size));
+        else if (hashFile(htSHA256, a) != hashFile(htSHA256, b))
+            diffs.push_back(fmt("%s: contents differ", rel));
+    }
+}
+
+
 void DerivationGoal::registerOutputs()
 {
     /* When using a build hook, the build hook can register the output
@@ -2899,6 +3004,17 @@ void DerivationGoal::registerOutputs()
 
     ValidPathInfos infos;
 
+    /* Per-output state for the reference scan below, in the order in
+       which the outputs occur in the derivation. */
+    struct OutputScan
+    {
+        Path path, actualPath;
+        ValidPathInfo info;
+        HashResult hash;
+        PathSet references;
+    };
+    std::vector<OutputScan> scans;
+
     /* Set of inodes seen during calls to canonicalisePathMetaData()
        for this build's outputs.  This needs to be shared between
        outputs to allow hard links between outputs. */
@@ -3028,18 +3144,58 @@ void DerivationGoal::registerOutputs()
         canonicalisePathMetaData(actualPath,
             buildUser && !rewritten ? buildUser->getUID() : -1, inodesSeen);
 
-        /* For this output path, find the references to other paths
-           contained in it.  Compute the SHA-256 NAR hash at the same
-           time.  The hash is stored in the database so that we can
-           verify later on whether nobody has messed with the store. */
-        debug("scanning for references inside '%1%'", path);
-        HashResult hash;
-        PathSet references = scanForReferences(actualPath, allPaths, hash);
+        scans.push_back(OutputScan{path, actualPath, info, {}, {}});
+    }
+
+    /* For each output path, find the references to other paths
+       contained in it.  Compute the SHA-256 NAR hash at the same
+       time.  The hash is stored in the database so that we can
+       verify later on whether nobody has messed with the store.
+       Scanning is read-only and independent per path, so the outputs
+       of a multi-output derivation are scanned in parallel. */
+    auto scanOutput = [&](OutputScan & scan) {
+        debug("scanning for references inside '%1%'", scan.path);
+        scan.references = scanForReferences(scan.actualPath, allPaths, scan.hash);
+    };
+
+    if (scans.size() == 1)
+        scanOutput(scans.front());
+    else if (scans.size() > 1) {
+        ThreadPool pool(scans.size());
+        for (auto & scan : scans)
+            pool.enqueue(std::bind(scanOutput, std::ref(scan)));
+        pool.process();
+    }
+
+    for (auto & scan : scans) {
+        Path & path = scan.path;
+        Path & actualPath = scan.actualPath;
+        HashResult & hash = scan.hash;
+        PathSet & references = scan.references;
+        ValidPathInfo & info = scan.info;
 
         if (buildMode == bmCheck) {
             if (!worker.store.isValidPath(path)) continue;
             auto info = *worker.store.queryPathInfo(path);
             if (hash.first != info.narHash) {
+                /* Record where the two builds diverge, both for the
+                   operator and in the DeterminismChecks table so
+                   fleet-wide audits can be collated later. */
+                Strings diffLines;
+                try {
+                    diffPaths(worker.store.toRealPath(path), actualPath, path, diffLines);
+                } catch (...) {
+                    ignoreException();
+                }
+                for (auto & line : diffLines)
+                    printError("  " + line);
+                try {
+                    worker.store.addDeterminismCheck(drvPath,
+                        {time(0), false, concatStringsSep("\n", diffLines)});
+                } catch (...) {
+                    ignoreException();
+                }
+
                 if (settings.keepFailed) {
                     Path dst = worker.store.toRealPath(path + checkSuffix);
                     deletePath(dst);
@@ -3131,7 +3287,15 @@ void DerivationGoal::registerOutputs()
         infos.push_back(info);
     }
 
-    if (buildMode == bmCheck) return;
+    if (buildMode == bmCheck) {
+        /* Every output matched its registered hash. */
+        try {
+            worker.store.addDeterminismCheck(drvPath, {time(0), true, ""});
+        } catch (...) {
+            ignoreException();
+        }
+        return;
+    }
 
     /* Compare the result with the previous round, and report which
        path is different, if any.*/
@@ -3146,6 +3310,21 @@ void DerivationGoal::registerOutputs()
                     ? fmt("output '%1%' of '%2%' differs from '%3%' from previous round", i->path, drvPath, prev)
                     : fmt("output '%1%' of '%2%' differs from previous round", i->path, drvPath);
 
+                Strings diffLines;
+                if (prevExists) {
+                    try {
+                        diffPaths(prev, i->path, i->path, diffLines);
+                    } catch (...) {
+                        ignoreException();
+                    }
+                }
+                try {
+                    worker.store.addDeterminismCheck(drvPath,
+                        {time(0), false, concatStringsSep("\n", diffLines)});
+                } catch (...) {
+                    ignoreException();
+                }
+
                 auto diffHook = settings.diffHook;
                 if (prevExists && diffHook != "" && runDiffHook) {
                     try {
@@ -3198,6 +3377,96 @@ void DerivationGoal::registerOutputs()
 }
 
 
+/* A sink that hands its input to a background thread, so that
+   compressing and writing the build log never blocks the worker's
+   event loop (and thus the build) behind log I/O.  The buffer
+   between the two threads is bounded: a builder that outputs faster
+   than the compressor can drain is throttled rather than allowed to
+   grow the queue without limit. */
+struct AsyncLogSink : CompressionSink
+{
+    std::shared_ptr<BufferedSink> inner;
+
+    struct State
+    {
+        bool quit = false;
+        std::string pending;
+        std::exception_ptr exc;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup, drained;
+    std::thread thread;
+
+    AsyncLogSink(std::shared_ptr<BufferedSink> inner)
+        : inner(inner)
+        , thread([this]() { run(); })
+    {
+    }
+
+    ~AsyncLogSink()
+    {
+        requestStop();
+        if (thread.joinable()) thread.join();
+    }
+
+    void run()
+    {
+        while (true) {
+            std::string chunk;
+            {
+                auto state(state_.lock());
+                while (state->pending.empty()) {
+                    if (state->quit) return;
+                    state.wait(wakeup);
+                }
+                chunk = std::move(state->pending);
+            }
+            try {
+                (*inner)(chunk);
+            } catch (...) {
+                auto state(state_.lock());
+                state->exc = std::current_exception();
+            }
+            drained.notify_one();
+        }
+    }
+
+    void write(const unsigned char * data, size_t len) override
+    {
+        auto state(state_.lock());
+        if (state->exc) std::rethrow_exception(state->exc);
+        while (state->pending.size() > 1024 * 1024)
+            state.wait(drained);
+        state->pending.append((const char *) data, len);
+        wakeup.notify_one();
+    }
+
+    void requestStop()
+    {
+        {
+            auto state(state_.lock());
+            state->quit = true;
+        }
+        wakeup.notify_one();
+    }
+
+    void finish() override
+    {
+        flush();
+        requestStop();
+        if (thread.joinable()) thread.join();
+        {
+            auto state(state_.lock());
+            if (state->exc) std::rethrow_exception(state->exc);
+        }
+        auto inner2 = std::dynamic_pointer_cast<CompressionSink>(inner);
+        if (inner2) inner2->finish();
+        inner->flush();
+    }
+};
+
+
 Path DerivationGoal::openLogFile()
 {
     logSize = 0;
@@ -3219,7 +3488,8 @@ Path DerivationGoal::openLogFile()
     logFileSink = std::make_shared<FdSink>(fdLogFile.get());
 
     if (settings.compressLog)
-        logSink = std::shared_ptr<CompressionSink>(makeCompressionSink("bzip2", *logFileSink));
+        logSink = std::make_shared<AsyncLogSink>(
+            std::shared_ptr<CompressionSink>(makeCompressionSink("bzip2", *logFileSink)));
     else
         logSink = logFileSink;
 
@@ -3400,6 +3670,178 @@ void DerivationGoal::done(BuildResult::Status status, const string & msg)
 //////////////////////////////////////////////////////////////////////
 
 
+/* Exponentially weighted average of how many milliseconds each
+   substituter has recently taken to answer a path-info query (with
+   failures counted as a large penalty sample).  Used to try healthy
+   substituters first. */
+static Sync<std::map<std::string, double>> substituterScores;
+
+static void recordSubstituterScore(const std::string & uri, double ms)
+{
+    auto scores(substituterScores.lock());
+    auto & score = (*scores)[uri];
+    score = score == 0 ? ms : score * 0.8 + ms * 0.2;
+}
+
+
+/* A bounded pool of threads through which all substituter path-info
+   probes flow.  Queries are memoised per (substituter, path) while in
+   flight, so goals racing or retrying the same lookup share a single
+   request instead of piling duplicates onto exactly the caches that
+   are already slow. */
+class SubstituterProber
+{
+public:
+
+    /* A goal's wait for the outcome of a set of probes.  'fd' is the
+       write side of the goal's wakeup pipe; it is closed exactly
+       once, as soon as a probe comes back positive or the last probe
+       has completed. */
+    struct Wait
+    {
+        size_t pending = 0;
+        bool signalled = false;
+        std::shared_ptr<AutoCloseFD> fd;
+    };
+
+    /* One query of one substituter for one path. */
+    struct Result
+    {
+        std::shared_ptr<Store> sub;
+        Path storePath;
+        bool done = false;
+        std::shared_ptr<const ValidPathInfo> info; /* null: miss or failure */
+        std::vector<std::shared_ptr<Wait>> waits;
+    };
+
+private:
+
+    struct State
+    {
+        /* Queries currently queued or running, for deduplication. */
+        std::map<std::pair<std::string, Path>, std::shared_ptr<Result>> inFlight;
+        std::list<std::shared_ptr<Result>> queue;
+        size_t threads = 0;
+        size_t idle = 0;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+
+public:
+
+    /* Ask 'sub' whether it has 'storePath', subscribing 'wait' to the
+       answer.  An in-flight query for the same pair is reused.  The
+       caller must have counted this probe in wait->pending already. */
+    std::shared_ptr<Result> enqueue(std::shared_ptr<Store> sub, const Path & storePath,
+        std::shared_ptr<Wait> wait)
+    {
+        auto state(state_.lock());
+
+        auto key = std::make_pair(sub->getUri(), storePath);
+        auto i = state->inFlight.find(key);
+
+        std::shared_ptr<Result> res;
+        if (i != state->inFlight.end())
+            res = i->second;
+        else {
+            res = std::make_shared<Result>();
+            res->sub = sub;
+            res->storePath = storePath;
+            state->inFlight[key] = res;
+            state->queue.push_back(res);
+            size_t maxThreads = std::max(1U, (unsigned int) settings.maxSubstitutionJobs);
+            if (state->idle == 0 && state->threads < maxThreads) {
+                state->threads++;
+                std::thread([this]() { workerEntry(); }).detach();
+            }
+        }
+
+        res->waits.push_back(wait);
+        wakeup.notify_one();
+        return res;
+    }
+
+    /* Pick the first positive result (in the order given, i.e. in
+       health order) among the probes that have completed, and collect
+       the URIs of substituters that definitively did not have the
+       path.  Probes still in flight are left alone. */
+    void harvest(const std::vector<std::shared_ptr<Result>> & results,
+        std::shared_ptr<Store> & winner,
+        std::shared_ptr<const ValidPathInfo> & winnerInfo,
+        StringSet & misses)
+    {
+        auto state(state_.lock());
+        for (auto & r : results) {
+            if (!r->done) continue;
+            if (r->info) {
+                if (!winner) {
+                    winner = r->sub;
+                    winnerInfo = r->info;
+                }
+            } else
+                misses.insert(r->sub->getUri());
+        }
+    }
+
+private:
+
+    void workerEntry()
+    {
+        while (true) {
+            std::shared_ptr<Result> job;
+            {
+                auto state(state_.lock());
+                while (state->queue.empty()) {
+                    state->idle++;
+                    state.wait(wakeup);
+                    state->idle--;
+                }
+                job = state->queue.front();
+                state->queue.pop_front();
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            std::shared_ptr<const ValidPathInfo> pathInfo;
+            try {
+                pathInfo = job->sub->queryPathInfo(job->storePath);
+            } catch (InvalidPath &) {
+            } catch (Error & e) {
+                printMsg(lvlChatty, format("substituter '%1%': %2%") % job->sub->getUri() % e.msg());
+            } catch (...) {
+            }
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start).count();
+            /* A failed query counts as a very slow one. */
+            recordSubstituterScore(job->sub->getUri(), pathInfo ? ms : ms + 60000);
+
+            {
+                auto state(state_.lock());
+                state->inFlight.erase({job->sub->getUri(), job->storePath});
+                job->done = true;
+                job->info = pathInfo;
+                for (auto & wait : job->waits) {
+                    assert(wait->pending > 0);
+                    wait->pending--;
+                    if (!wait->signalled && (pathInfo || wait->pending == 0)) {
+                        wait->signalled = true;
+                        *wait->fd = AutoCloseFD(); /* wake the goal */
+                    }
+                }
+                job->waits.clear();
+            }
+        }
+    }
+};
+
+
+static SubstituterProber & getProber()
+{
+    static SubstituterProber prober;
+    return prober;
+}
+
+
 class SubstitutionGoal : public Goal
 {
     friend class Worker;
@@ -3428,6 +3870,12 @@ private:
 
     std::promise<void> promise;
 
+    /* Outstanding path-info probes (shared with the prober pool, and
+       possibly with other goals) and the wait that ties them to this
+       goal's wakeup pipe. */
+    std::vector<std::shared_ptr<SubstituterProber::Result>> probes;
+    std::shared_ptr<SubstituterProber::Wait> probeWait;
+
     /* Whether to try to repair a valid path. */
     RepairFlag repair;
 
@@ -3527,6 +3975,20 @@ void SubstitutionGoal::init()
 
     subs = settings.useSubstitutes ? getDefaultSubstituters() : std::list<ref<Store>>();
 
+    /* Prefer substituters that have been answering quickly.  The
+       sort is stable, so substituters without a track record keep
+       their configured relative order. */
+    {
+        auto scores(substituterScores.lock());
+        auto getScore = [&](const ref<Store> & s) {
+            auto i = scores->find(s->getUri());
+            return i == scores->end() ? 0.0 : i->second;
+        };
+        subs.sort([&](const ref<Store> & a, const ref<Store> & b) {
+            return getScore(a) < getScore(b);
+        });
+    }
+
     tryNext();
 }
 
@@ -3553,18 +4015,64 @@ void SubstitutionGoal::tryNext()
         return;
     }
 
-    sub = subs.front();
-    subs.pop_front();
-
-    if (sub->storeDir != worker.store.storeDir) {
+    /* Probe all remaining substituters in parallel and take the
+       first one that has the path, so one slow or unreachable cache
+       doesn't make us wait out its timeout before we ask the
+       others. */
+    std::vector<std::shared_ptr<Store>> candidates;
+    for (auto & s : subs)
+        if (s->storeDir == worker.store.storeDir)
+            candidates.push_back(s);
+
+    if (candidates.empty()) {
+        subs.clear();
         tryNext();
         return;
     }
 
-    try {
-        // FIXME: make async
-        info = sub->queryPathInfo(storePath);
-    } catch (InvalidPath &) {
+    /* Hand the queries to the shared prober pool and wake up when the
+       first one comes back positive (or the last one comes back
+       empty).  The prober closes the write side of our pipe, so no
+       thread of our own is needed to wait for the race. */
+    outPipe.create();
+
+    probeWait = std::make_shared<SubstituterProber::Wait>();
+    probeWait->pending = candidates.size();
+    probeWait->fd = std::make_shared<AutoCloseFD>(std::move(outPipe.writeSide));
+
+    probes.clear();
+    for (auto & s : candidates)
+        probes.push_back(getProber().enqueue(s, storePath, probeWait));
+
+    worker.childStarted(shared_from_this(), {outPipe.readSide.get()}, false, false);
+
+    state = &SubstitutionGoal::gotInfo;
+}
+
+
+void SubstitutionGoal::gotInfo()
+{
+    trace("probe finished");
+
+    worker.childTerminated(this);
+
+    /* Take the best completed probe and drop the definite misses;
+       anything still in flight stays in 'subs' in case the download
+       fails and we have to try again (a retry then re-attaches to the
+       in-flight query instead of repeating it). */
+    sub.reset();
+    info.reset();
+    StringSet misses;
+    getProber().harvest(probes, sub, info, misses);
+    probes.clear();
+    probeWait.reset();
+
+    subs.remove_if([&](const ref<Store> & s) {
+        return (sub && s->getUri() == sub->getUri())
+            || misses.count(s->getUri());
+    });
+
+    if (!sub) {
         tryNext();
         return;
     }
@@ -3629,11 +4137,14 @@ void SubstitutionGoal::tryToRun()
 {
     trace("trying to run");
 
-    /* Make sure that we are allowed to start a build.  Note that even
-       if maxBuildJobs == 0 (no local builds allowed), we still allow
-       a substituter to run.  This is because substitutions cannot be
-       distributed to another machine via the build hook. */
-    if (worker.getNrLocalBuilds() >= std::max(1U, (unsigned int) settings.maxBuildJobs)) {
+    NIX_PROBE1(substitution_try_to_run, storePath.c_str());
+
+    /* Make sure that we are allowed to start a substitution.  Note
+       that even if maxSubstitutionJobs == 0, we still allow a
+       substituter to run.  Substitutions have their own concurrency
+       limit since they are network-bound and shouldn't have to
+       compete with (or starve) local builds. */
+    if (worker.getNrSubstitutions() >= std::max(1U, (unsigned int) settings.maxSubstitutionJobs)) {
         worker.waitForBuildSlot(shared_from_this());
         return;
     }
@@ -3671,6 +4182,8 @@ void SubstitutionGoal::finished()
 {
     trace("substitute finished");
 
+    NIX_PROBE1(substitution_finished, storePath.c_str());
+
     thr.join();
     worker.childTerminated(this);
 
@@ -3679,6 +4192,9 @@ void SubstitutionGoal::finished()
     } catch (Error & e) {
         printInfo(e.msg());
 
+        /* Penalise the substituter whose download failed. */
+        recordSubstituterScore(sub->getUri(), 60000);
+
         /* Try the next substitute. */
         state = &SubstitutionGoal::tryNext;
         worker.wakeUp(shared_from_this());
@@ -3737,6 +4253,7 @@ Worker::Worker(LocalStore & store)
     if (working) abort();
     working = true;
     nrLocalBuilds = 0;
+    nrSubstitutions = 0;
     lastWokenUp = steady_time_point::min();
     permanentFailure = false;
     timedOut = false;
@@ -3843,6 +4360,21 @@ unsigned Worker::getNrLocalBuilds()
 }
 
 
+unsigned Worker::getNrSubstitutions()
+{
+    return nrSubstitutions;
+}
+
+
+bool Worker::loadTooHigh()
+{
+    if (settings.maxLoadAverage.get() == 0) return false;
+    double load;
+    if (getloadavg(&load, 1) != 1) return false;
+    return load >= (double) settings.maxLoadAverage.get();
+}
+
+
 void Worker::childStarted(GoalPtr goal, const set<int> & fds,
     bool inBuildSlot, bool respectTimeouts)
 {
@@ -3854,7 +4386,12 @@ void Worker::childStarted(GoalPtr goal, const set<int> & fds,
     child.inBuildSlot = inBuildSlot;
     child.respectTimeouts = respectTimeouts;
     children.emplace_back(child);
-    if (inBuildSlot) nrLocalBuilds++;
+    if (inBuildSlot) {
+        if (dynamic_cast<SubstitutionGoal *>(goal.get()))
+            nrSubstitutions++;
+        else
+            nrLocalBuilds++;
+    }
 }
 
 
@@ -3865,8 +4402,13 @@ void Worker::childTerminated(Goal * goal, bool wakeSleepers)
     if (i == children.end()) return;
 
     if (i->inBuildSlot) {
-        assert(nrLocalBuilds > 0);
-        nrLocalBuilds--;
+        if (dynamic_cast<SubstitutionGoal *>(goal)) {
+            assert(nrSubstitutions > 0);
+            nrSubstitutions--;
+        } else {
+            assert(nrLocalBuilds > 0);
+            nrLocalBuilds--;
+        }
     }
 
     children.erase(i);
@@ -3887,7 +4429,10 @@ void Worker::childTerminated(Goal * goal, bool wakeSleepers)
 void Worker::waitForBuildSlot(GoalPtr goal)
 {
     debug("wait for build slot");
-    if (getNrLocalBuilds() < settings.maxBuildJobs)
+    bool isSubstitutionGoal = dynamic_cast<SubstitutionGoal *>(goal.get());
+    if ((!isSubstitutionGoal && getNrLocalBuilds() < settings.maxBuildJobs
+            && !(getNrLocalBuilds() > 0 && loadTooHigh())) ||
+        (isSubstitutionGoal && getNrSubstitutions() < std::max(1U, (unsigned int) settings.maxSubstitutionJobs)))
         wakeUp(goal); /* we can do it right away */
     else
         addToWeakGoals(wantingToBuild, goal);
@@ -3908,6 +4453,30 @@ void Worker::waitForAWhile(GoalPtr goal)
 }
 
 
+void Worker::watchLockFile(const Path & lockPath)
+{
+#if __linux__
+    if (!lockWatchFd) {
+        lockWatchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (!lockWatchFd) {
+            /* Not fatal; the poll interval still applies. */
+            debug(format("cannot create inotify instance: %1%") % strerror(errno));
+            return;
+        }
+    }
+
+    /* Releasing a lock writes a token to the lock file and usually
+       unlinks it, so either event means it is worth retrying.  The
+       watch is one-shot: a goal that is still blocked re-adds it on
+       its next attempt. */
+    if (inotify_add_watch(lockWatchFd.get(), lockPath.c_str(),
+            IN_CLOSE_WRITE | IN_MODIFY | IN_DELETE_SELF | IN_ONESHOT) == -1 &&
+        errno != ENOENT)
+        debug(format("cannot watch lock file '%1%': %2%") % lockPath % strerror(errno));
+#endif
+}
+
+
 void Worker::run(const Goals & _topGoals)
 {
     for (auto & i : _topGoals) topGoals.insert(i);
@@ -4017,15 +4586,42 @@ void Worker::waitForInput()
         }
     }
 
-    if (select(fdMax, &fds, 0, 0, useTimeout ? &timeout : 0) == -1) {
+#if __linux__
+    if (lockWatchFd && !waitingForAWhile.empty()) {
+        FD_SET(lockWatchFd.get(), &fds);
+        if (lockWatchFd.get() >= fdMax) fdMax = lockWatchFd.get() + 1;
+    }
+#endif
+
+    int nfds = select(fdMax, &fds, 0, 0, useTimeout ? &timeout : 0);
+    if (nfds == -1) {
         if (errno == EINTR) return;
         throw SysError("waiting for input");
     }
 
+    NIX_PROBE1(worker_wakeup, nfds);
+
+    bool lockReleased = false;
+#if __linux__
+    if (lockWatchFd && FD_ISSET(lockWatchFd.get(), &fds)) {
+        /* Drain the event queue; we don't care which lock it was,
+           since retrying a lock is cheap. */
+        char buf[4096];
+        while (read(lockWatchFd.get(), buf, sizeof(buf)) > 0) ;
+        lockReleased = true;
+    }
+#endif
+
     auto after = steady_time_point::clock::now();
 
     /* Process all available file descriptors. FIXME: this is
        O(children * fds). */
+
+    /* A pipe can hold a full pipe buffer (64 KiB on Linux) of
+       builder output, so read with a buffer of that size to drain
+       it in one syscall instead of sixteen. */
+    std::vector<unsigned char> buffer(64 * 1024);
+
     decltype(children)::iterator i;
     for (auto j = children.begin(); j != children.end(); j = i) {
         i = std::next(j);
@@ -4038,8 +4634,7 @@ void Worker::waitForInput()
         set<int> fds2(j->fds);
         for (auto & k : fds2) {
             if (FD_ISSET(k, &fds)) {
-                unsigned char buffer[4096];
-                ssize_t rd = read(k, buffer, sizeof(buffer));
+                ssize_t rd = read(k, buffer.data(), buffer.size());
                 if (rd == -1) {
                     if (errno != EINTR)
                         throw SysError(format("reading from %1%")
@@ -4051,7 +4646,7 @@ void Worker::waitForInput()
                 } else {
                     printMsg(lvlVomit, format("%1%: read %2% bytes")
                         % goal->getName() % rd);
-                    string data((char *) buffer, rd);
+                    string data((char *) buffer.data(), rd);
                     j->lastOutput = after;
                     goal->handleChildOutput(k, data);
                 }
@@ -4081,7 +4676,8 @@ void Worker::waitForInput()
         }
     }
 
-    if (!waitingForAWhile.empty() && lastWokenUp + std::chrono::seconds(settings.pollInterval) <= after) {
+    if (!waitingForAWhile.empty() &&
+        (lockReleased || lastWokenUp + std::chrono::seconds(settings.pollInterval) <= after)) {
         lastWokenUp = after;
         for (auto & i : waitingForAWhile) {
             GoalPtr goal = i.lock();
@@ -1,4 +1,7 @@
 #include "crypto.hh"
+#include "hash.hh"
+#include "lru-cache.hh"
+#include "sync.hh"
 #include "util.hh"
 #include "globals.hh"
 
@@ -91,9 +94,31 @@ bool verifyDetached(const std::string & data, const std::string & sig,
     if (sig2.size() != crypto_sign_BYTES)
         throw Error("signature is not valid");
 
-    return crypto_sign_verify_detached((unsigned char *) sig2.data(),
+    /* Ed25519 verification is not free on small cores, and the same
+       (fingerprint, signature) pair is typically checked twice per
+       substitution: once before the NAR is downloaded and again when
+       the path is registered by LocalStore::addToStore().  Memoise
+       the outcome, keyed by a hash of the key material, the
+       signature and the signed data, so a change to any of the three
+       gets a fresh verification. */
+    static Sync<LRUCache<std::string, bool>> verifyCache{32 * 1024};
+
+    auto cacheKey = hashString(htSHA256,
+        key->second.key + ";" + sig2 + ";" + data).to_string(Base32, false);
+
+    {
+        auto cache(verifyCache.lock());
+        auto res = cache->get(cacheKey);
+        if (res) return *res;
+    }
+
+    bool valid = crypto_sign_verify_detached((unsigned char *) sig2.data(),
         (unsigned char *) data.data(), data.size(),
         (unsigned char *) key->second.key.data()) == 0;
+
+    verifyCache.lock()->upsert(cacheKey, valid);
+
+    return valid;
 #else
     noSodium();
 #endif
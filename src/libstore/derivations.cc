@@ -1,10 +1,11 @@
 #include "derivations.hh"
+#include "lru-cache.hh"
 #include "store-api.hh"
+#include "sync.hh"
 #include "globals.hh"
 #include "util.hh"
 #include "worker-protocol.hh"
 #include "fs-accessor.hh"
-#include "istringstream_nocopy.hh"
 
 namespace nix {
 
@@ -88,36 +89,62 @@ Path writeDerivation(ref<Store> store,
 }
 
 
-/* Read string `s' from stream `str'. */
-static void expect(std::istream & str, const string & s)
+/* The ATerm parser below works on a raw cursor into the in-memory
+   contents of the drv file.  The previous implementation went
+   through a streambuf, which cost a virtual call per character; drv
+   files are parsed by the tens of thousands in closure queries, so
+   that overhead was measurable. */
+
+struct Cursor
+{
+    const char * p, * end;
+};
+
+/* Read string `s' at the cursor. */
+static void expect(Cursor & str, const string & s)
 {
-    char s2[s.size()];
-    str.read(s2, s.size());
-    if (string(s2, s.size()) != s)
+    if (size_t(str.end - str.p) < s.size() || string(str.p, s.size()) != s)
         throw FormatError(format("expected string '%1%'") % s);
+    str.p += s.size();
 }
 
 
-/* Read a C-style string from stream `str'. */
-static string parseString(std::istream & str)
+/* Read a C-style string at the cursor. */
+static string parseString(Cursor & str)
 {
-    string res;
     expect(str, "\"");
-    int c;
-    while ((c = str.get()) != '"')
+
+    /* Common case: no escapes; the string is a single substring. */
+    const char * q = str.p;
+    while (q != str.end && *q != '"' && *q != '\\') q++;
+    if (q == str.end)
+        throw FormatError("unterminated string in derivation");
+
+    string res(str.p, q - str.p);
+    str.p = q;
+
+    while (*str.p != '"') {
+        char c = *str.p++;
         if (c == '\\') {
-            c = str.get();
+            if (str.p == str.end)
+                throw FormatError("unterminated string in derivation");
+            c = *str.p++;
             if (c == 'n') res += '\n';
             else if (c == 'r') res += '\r';
             else if (c == 't') res += '\t';
             else res += c;
         }
         else res += c;
+        if (str.p == str.end)
+            throw FormatError("unterminated string in derivation");
+    }
+
+    str.p++; /* skip '"' */
     return res;
 }
 
 
-static Path parsePath(std::istream & str)
+static Path parsePath(Cursor & str)
 {
     string s = parseString(str);
     if (s.size() == 0 || s[0] != '/')
@@ -126,21 +153,21 @@ static Path parsePath(std::istream & str)
 }
 
 
-static bool endOfList(std::istream & str)
+static bool endOfList(Cursor & str)
 {
-    if (str.peek() == ',') {
-        str.get();
+    if (str.p != str.end && *str.p == ',') {
+        str.p++;
         return false;
     }
-    if (str.peek() == ']') {
-        str.get();
+    if (str.p != str.end && *str.p == ']') {
+        str.p++;
         return true;
     }
     return false;
 }
 
 
-static StringSet parseStrings(std::istream & str, bool arePaths)
+static StringSet parseStrings(Cursor & str, bool arePaths)
 {
     StringSet res;
     while (!endOfList(str))
@@ -152,7 +179,7 @@ static StringSet parseStrings(std::istream & str, bool arePaths)
 static Derivation parseDerivation(const string & s)
 {
     Derivation drv;
-    istringstream_nocopy str(s);
+    Cursor str{s.data(), s.data() + s.size()};
     expect(str, "Derive([");
 
     /* Parse the list of outputs. */
@@ -213,9 +240,24 @@ Derivation Store::derivationFromPath(const Path & drvPath)
 {
     assertStorePath(drvPath);
     ensurePath(drvPath);
+
+    /* Store paths are immutable, so once a .drv has been parsed the
+       result can be reused for the lifetime of the process.  Builds
+       and closure queries tend to hit the same derivations over and
+       over. */
+    static Sync<LRUCache<Path, Derivation>> drvCache{4096};
+
+    {
+        auto cache(drvCache.lock());
+        auto drv = cache->get(drvPath);
+        if (drv) return *drv;
+    }
+
     auto accessor = getFSAccessor();
     try {
-        return parseDerivation(accessor->readFile(drvPath));
+        auto drv = parseDerivation(accessor->readFile(drvPath));
+        drvCache.lock()->upsert(drvPath, drv);
+        return drv;
     } catch (FormatError & e) {
         throw Error(format("error parsing derivation '%1%': %2%") % drvPath % e.msg());
     }
@@ -248,7 +290,7 @@ static void printStrings(string & res, ForwardIterator i, ForwardIterator j)
 }
 
 
-string Derivation::unparse() const
+string Derivation::unparse(const DerivationInputs * actualInputs) const
 {
     string s;
     s.reserve(65536);
@@ -266,7 +308,7 @@ string Derivation::unparse() const
 
     s += "],[";
     first = true;
-    for (auto & i : inputDrvs) {
+    for (auto & i : actualInputs ? *actualInputs : inputDrvs) {
         if (first) first = false; else s += ',';
         s += '('; printString(s, i.first);
         s += ','; printStrings(s, i.second.begin(), i.second.end());
@@ -332,7 +374,7 @@ DrvHashes drvHashes;
    paths have been replaced by the result of a recursive call to this
    function, and that for fixed-output derivations we return a hash of
    its output path. */
-Hash hashDerivationModulo(Store & store, Derivation drv)
+Hash hashDerivationModulo(Store & store, const Derivation & drv)
 {
     /* Return a fixed hash for fixed-output derivations. */
     if (drv.isFixedOutput()) {
@@ -356,9 +398,8 @@ Hash hashDerivationModulo(Store & store, Derivation drv)
         }
         inputs2[h.to_string(Base16, false)] = i.second;
     }
-    drv.inputDrvs = inputs2;
 
-    return hashString(htSHA256, drv.unparse());
+    return hashString(htSHA256, drv.unparse(&inputs2));
 }
 
 
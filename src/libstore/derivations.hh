@@ -76,8 +76,10 @@ struct Derivation : BasicDerivation
 {
     DerivationInputs inputDrvs; /* inputs that are sub-derivations */
 
-    /* Print a derivation. */
-    std::string unparse() const;
+    /* Print a derivation.  If `actualInputs' is given, it is used in
+       place of `inputDrvs' (used by hashDerivationModulo(), which
+       substitutes input paths by their hashes). */
+    std::string unparse(const DerivationInputs * actualInputs = 0) const;
 };
 
 
@@ -95,7 +97,7 @@ Derivation readDerivation(const Path & drvPath);
    derivations. */
 bool isDerivation(const string & fileName);
 
-Hash hashDerivationModulo(Store & store, Derivation drv);
+Hash hashDerivationModulo(Store & store, const Derivation & drv);
 
 /* Memoisation of hashDerivationModulo(). */
 typedef std::map<Path, Hash> DrvHashes;
@@ -59,6 +59,18 @@ struct CurlDownloader : public Downloader
 
     bool enableHttp2;
 
+    /* Adaptive admission control.  'binary-caches-parallel-connections'
+       is treated as an upper bound; the number of transfers actually
+       in flight starts low and is hill-climbed on measured aggregate
+       goodput, so a fast builder ramps up while a congested uplink
+       settles on a few connections instead of self-inflicted queueing
+       delay.  Only touched from the worker thread. */
+    size_t inflightLimit;
+    uint64_t lastGoodputBytes = 0;
+    double lastGoodput = 0;
+    int adjustDirection = 1;
+    std::chrono::steady_clock::time_point lastAdjust;
+
     struct DownloadItem : public std::enable_shared_from_this<DownloadItem>
     {
         CurlDownloader & downloader;
@@ -74,6 +86,11 @@ struct CurlDownloader : public Downloader
 
         unsigned int attempt = 0;
 
+        /* Whether the data callback has been fed any data. If so, we
+           can't transparently retry, because we can't take back what
+           has already been written to the sink. */
+        bool writtenToSink = false;
+
         /* Don't start this download until the specified time point
            has been reached. */
         std::chrono::steady_clock::time_point embargo;
@@ -82,13 +99,20 @@ struct CurlDownloader : public Downloader
 
         std::string encoding;
 
+        /* Response body bytes salvaged from an attempt that failed
+           with a transient error.  The next attempt then requests
+           only the remainder via a Range request, conditional (via
+           If-Range) on the ETag under which the prefix was
+           received. */
+        std::string previousData;
+        std::string previousEtag;
+
         DownloadItem(CurlDownloader & downloader, const DownloadRequest & request)
             : downloader(downloader)
             , request(request)
             , act(*logger, actDownload, fmt("downloading '%s'", request.uri))
         {
-            if (!request.expectedETag.empty())
-                requestHeaders = curl_slist_append(requestHeaders, ("If-None-Match: " + request.expectedETag).c_str());
+            downloader.stats.requests++;
         }
 
         ~DownloadItem()
@@ -112,13 +136,19 @@ struct CurlDownloader : public Downloader
         {
             assert(!done);
             done = true;
+            downloader.stats.failed++;
             callFailure(failure, std::make_exception_ptr(e));
         }
 
         size_t writeCallback(void * contents, size_t size, size_t nmemb)
         {
             size_t realSize = size * nmemb;
-            result.data->append((char *) contents, realSize);
+            downloader.stats.bytesReceived += realSize;
+            if (request.dataCallback && status == "200") {
+                writtenToSink = true;
+                request.dataCallback((char *) contents, realSize);
+            } else
+                result.data->append((char *) contents, realSize);
             return realSize;
         }
 
@@ -137,6 +167,12 @@ struct CurlDownloader : public Downloader
                 auto ss = tokenizeString<vector<string>>(line, " ");
                 status = ss.size() >= 2 ? ss[1] : "";
                 result.data = std::make_shared<std::string>();
+                /* A 206 means the server honoured our Range request
+                   (and, because of If-Range, that the resource is
+                   unchanged), so the salvaged prefix is still good.
+                   Any other status restarts from an empty body. */
+                if (status == "206")
+                    *result.data = std::move(previousData);
                 encoding = "";
             } else {
                 auto i = line.find(':');
@@ -212,6 +248,20 @@ struct CurlDownloader : public Downloader
             curl_easy_setopt(req, CURLOPT_HEADERFUNCTION, DownloadItem::headerCallbackWrapper);
             curl_easy_setopt(req, CURLOPT_HEADERDATA, this);
 
+            /* The request headers differ between attempts (a retry
+               may resume a partial body), so rebuild them here
+               rather than in the constructor. */
+            if (requestHeaders) {
+                curl_slist_free_all(requestHeaders);
+                requestHeaders = 0;
+            }
+            if (!request.expectedETag.empty())
+                requestHeaders = curl_slist_append(requestHeaders, ("If-None-Match: " + request.expectedETag).c_str());
+            if (!previousData.empty()) {
+                requestHeaders = curl_slist_append(requestHeaders, ("If-Range: " + previousEtag).c_str());
+                curl_easy_setopt(req, CURLOPT_RANGE, (std::to_string(previousData.size()) + "-").c_str());
+            }
+
             curl_easy_setopt(req, CURLOPT_PROGRESSFUNCTION, progressCallbackWrapper);
             curl_easy_setopt(req, CURLOPT_PROGRESSDATA, this);
             curl_easy_setopt(req, CURLOPT_NOPROGRESS, 0);
@@ -231,6 +281,13 @@ struct CurlDownloader : public Downloader
 
             curl_easy_setopt(req, CURLOPT_CONNECTTIMEOUT, settings.connectTimeout.get());
 
+            /* Kill a transfer that makes no progress: a stalled
+               mirror then fails quickly instead of holding the
+               substitution for the full request, and the normal
+               retry/fallback logic takes over. */
+            curl_easy_setopt(req, CURLOPT_LOW_SPEED_LIMIT, 1L);
+            curl_easy_setopt(req, CURLOPT_LOW_SPEED_TIME, (long) settings.stalledDownloadTimeout.get());
+
             /* If no file exist in the specified path, curl continues to work
                anyway as if netrc support was disabled. */
             curl_easy_setopt(req, CURLOPT_NETRC_FILE, settings.netrcFile.get().c_str());
@@ -249,6 +306,10 @@ struct CurlDownloader : public Downloader
             if (effectiveUrlCStr)
                 result.effectiveUrl = effectiveUrlCStr;
 
+            double totalTime = 0;
+            curl_easy_getinfo(req, CURLINFO_TOTAL_TIME, &totalTime);
+            downloader.stats.transferTimeMs += (uint64_t) (totalTime * 1000);
+
             debug(format("finished download of '%s'; curl status = %d, HTTP status = %d, body = %d bytes")
                 % request.uri % code % httpStatus % (result.data ? result.data->size() : 0));
 
@@ -258,10 +319,11 @@ struct CurlDownloader : public Downloader
             }
 
             if (code == CURLE_OK &&
-                (httpStatus == 200 || httpStatus == 304 || httpStatus == 226 /* FTP */ || httpStatus == 0 /* other protocol */))
+                (httpStatus == 200 || httpStatus == 206 || httpStatus == 304 || httpStatus == 226 /* FTP */ || httpStatus == 0 /* other protocol */))
             {
                 result.cached = httpStatus == 304;
                 done = true;
+                downloader.stats.succeeded++;
 
                 try {
                     result.data = decodeContent(encoding, ref<std::string>(result.data));
@@ -284,6 +346,9 @@ struct CurlDownloader : public Downloader
                         //   curl: (23) Failed writing body (315 != 16366)
                         || code == CURLE_WRITE_ERROR
 
+                        // includes low-speed aborts from the stalled-download-timeout
+                        || code == CURLE_OPERATION_TIMEDOUT
+
                         // this is a generic SSL failure that in some cases (e.g., certificate error) is permanent but also appears in transient cases, so we consider it retryable
                         || code == CURLE_SSL_CONNECT_ERROR
 #if LIBCURL_VERSION_NUM >= 0x073200
@@ -304,8 +369,19 @@ struct CurlDownloader : public Downloader
 
                 /* If this is a transient error, then maybe retry the
                    download after a while. */
-                if (err == Transient && attempt < request.tries) {
+                if (err == Transient && attempt < request.tries && !writtenToSink) {
                     int ms = request.baseRetryTimeMs * std::pow(2.0f, attempt - 1 + std::uniform_real_distribution<>(0.0, 0.5)(downloader.mt19937));
+                    /* Keep what we have of the body so the retry can
+                       fetch just the rest, but only if we have an
+                       ETag to validate the prefix against. */
+                    if ((status == "200" || status == "206")
+                        && result.data && !result.data->empty()
+                        && !result.etag.empty())
+                    {
+                        debug(format("salvaging %d bytes of '%s' for resumption") % result.data->size() % request.uri);
+                        previousData = std::move(*result.data);
+                        previousEtag = result.etag;
+                    }
                     printError(format("warning: %s; retrying in %d ms") % exc.what() % ms);
                     embargo = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
                     downloader.enqueueItem(shared_from_this());
@@ -320,7 +396,12 @@ struct CurlDownloader : public Downloader
     {
         struct EmbargoComparator {
             bool operator() (const std::shared_ptr<DownloadItem> & i1, const std::shared_ptr<DownloadItem> & i2) {
-                return i1->embargo > i2->embargo;
+                /* Serve non-embargoed items in priority order, so that
+                   small metadata requests (e.g. .narinfo) are not stuck
+                   behind a queue of large NARs. */
+                if (i1->embargo != i2->embargo)
+                    return i1->embargo > i2->embargo;
+                return i1->request.priority < i2->request.priority;
             }
         };
         bool quit = false;
@@ -349,9 +430,17 @@ struct CurlDownloader : public Downloader
         #endif
         curl_multi_setopt(curlm, CURLMOPT_MAX_TOTAL_CONNECTIONS,
             settings.binaryCachesParallelConnections.get());
+        #if LIBCURL_VERSION_NUM >= 0x071e00 // CURLMOPT_MAX_HOST_CONNECTIONS
+        if (settings.httpConnectionsPerHost.get() != 0)
+            curl_multi_setopt(curlm, CURLMOPT_MAX_HOST_CONNECTIONS,
+                settings.httpConnectionsPerHost.get());
+        #endif
 
         enableHttp2 = settings.enableHttp2;
 
+        inflightLimit = std::min((size_t) 4,
+            std::max((size_t) 1, (size_t) settings.binaryCachesParallelConnections.get()));
+
         wakeupPipe.create();
         fcntl(wakeupPipe.readSide.get(), F_SETFL, O_NONBLOCK);
 
@@ -413,6 +502,35 @@ struct CurlDownloader : public Downloader
                 }
             }
 
+            /* Periodically adjust the in-flight limit by probing:
+               keep moving it in the direction that last improved
+               aggregate goodput, and turn around when goodput drops.
+               Adjustments only happen while the limit is actually
+               binding, so an idle or lightly loaded downloader is
+               left alone. */
+            auto nowAdjust = std::chrono::steady_clock::now();
+            if (lastAdjust == std::chrono::steady_clock::time_point()) {
+                lastAdjust = nowAdjust;
+                lastGoodputBytes = stats.bytesReceived;
+            } else if (nowAdjust - lastAdjust >= std::chrono::seconds(2)) {
+                uint64_t bytes = stats.bytesReceived - lastGoodputBytes;
+                double goodput = bytes /
+                    std::chrono::duration_cast<std::chrono::duration<double>>(nowAdjust - lastAdjust).count();
+                if (bytes > 0 && items.size() >= inflightLimit) {
+                    if (goodput < lastGoodput * 0.95)
+                        adjustDirection = -adjustDirection;
+                    size_t step = std::max((size_t) 1, inflightLimit / 4);
+                    size_t maxConns = std::max((size_t) 1, (size_t) settings.binaryCachesParallelConnections.get());
+                    inflightLimit = adjustDirection > 0
+                        ? std::min(maxConns, inflightLimit + step)
+                        : std::max(std::min((size_t) 2, maxConns), inflightLimit - step);
+                    vomit("download goodput %.0f bytes/s, in-flight limit now %d", goodput, inflightLimit);
+                    lastGoodput = goodput;
+                }
+                lastAdjust = nowAdjust;
+                lastGoodputBytes = stats.bytesReceived;
+            }
+
             /* Wait for activity, including wakeup events. */
             int numfds = 0;
             struct curl_waitfd extraFDs[1];
@@ -448,6 +566,13 @@ struct CurlDownloader : public Downloader
                 while (!state->incoming.empty()) {
                     auto item = state->incoming.top();
                     if (item->embargo <= now) {
+                        /* Admit no more transfers than the adaptive
+                           limit allows; the rest stay queued in
+                           priority order (narinfo before NARs), and
+                           are picked up when a transfer finishes or
+                           the limit rises. */
+                        if (items.size() + incoming.size() >= inflightLimit)
+                            break;
                         incoming.push_back(item);
                         state->incoming.pop();
                     } else {
@@ -557,11 +682,106 @@ std::future<DownloadResult> Downloader::enqueueDownload(const DownloadRequest &
     return promise->get_future();
 }
 
+void Downloader::dumpStats()
+{
+    std::cerr << "download statistics:\n";
+    auto line = [](const char * name, uint64_t value) {
+        std::cerr << format("  %1%: %2%\n") % name % value;
+    };
+    line("requests", stats.requests);
+    line("succeeded", stats.succeeded);
+    line("failed", stats.failed);
+    line("bytes received", stats.bytesReceived);
+    line("transfer time (ms)", stats.transferTimeMs);
+}
+
 DownloadResult Downloader::download(const DownloadRequest & request)
 {
     return enqueueDownload(request).get();
 }
 
+void Downloader::download(DownloadRequest && request, Sink & sink)
+{
+    /* The sink must be fed on the caller's thread, not the download
+       thread, so the two communicate through a bounded buffer. */
+    struct State
+    {
+        bool done = false;
+        std::exception_ptr exc;
+        std::string data;
+        std::condition_variable avail, request;
+    };
+
+    auto _state = std::make_shared<Sync<State>>();
+
+    request.dataCallback = [_state](char * buf, size_t len) {
+
+        auto state(_state->lock());
+
+        if (state->done) return;
+
+        /* If the buffer is full, then go to sleep until the calling
+           thread wakes us up (i.e. when it has removed data from the
+           buffer). We don't wait forever to prevent stalling the
+           download thread. (Hopefully sleeping will throttle the
+           sender.) */
+        if (state->data.size() > 1024 * 1024) {
+            vomit("download buffer is full; going to sleep");
+            state.wait_for(state->request, std::chrono::seconds(10));
+        }
+
+        /* Append data to the buffer and wake up the calling
+           thread. */
+        state->data.append(buf, len);
+        state->avail.notify_one();
+    };
+
+    enqueueDownload(request,
+        [_state](const DownloadResult & result) {
+            auto state(_state->lock());
+            state->done = true;
+            state->avail.notify_one();
+        },
+        [_state](std::exception_ptr exc) {
+            auto state(_state->lock());
+            state->done = true;
+            state->exc = exc;
+            state->avail.notify_one();
+        });
+
+    while (true) {
+        checkInterrupt();
+
+        std::string chunk;
+
+        /* Grab data if available, otherwise wait for the download
+           thread to wake us up. */
+        {
+            auto state(_state->lock());
+
+            while (state->data.empty()) {
+
+                if (state->done) {
+                    if (state->exc) std::rethrow_exception(state->exc);
+                    return;
+                }
+
+                state.wait(state->avail);
+            }
+
+            chunk = std::move(state->data);
+
+            state->request.notify_one();
+        }
+
+        /* Flush the data to the sink and wake up the download thread
+           if it's blocked on a full buffer. We don't hold the state
+           lock while doing this to prevent blocking the download
+           thread if sink() takes a long time. */
+        sink((unsigned char *) chunk.data(), chunk.size());
+    }
+}
+
 Path Downloader::downloadCached(ref<Store> store, const string & url_, bool unpack, string name, const Hash & expectedHash, string * effectiveUrl)
 {
     auto url = resolveUri(url_);
@@ -2,7 +2,9 @@
 
 #include "types.hh"
 #include "hash.hh"
+#include "serialise.hh"
 
+#include <atomic>
 #include <string>
 #include <future>
 
@@ -16,6 +18,14 @@ struct DownloadRequest
     bool head = false;
     size_t tries = 5;
     unsigned int baseRetryTimeMs = 250;
+    /* Requests with a higher priority are started before requests
+       with a lower one. */
+    unsigned int priority = 0;
+
+    /* If set, data of a successful response is passed to this
+       callback as it arrives, instead of being accumulated into
+       DownloadResult::data.  Note: called from the download thread. */
+    std::function<void(char *, size_t)> dataCallback;
 
     DownloadRequest(const std::string & uri) : uri(uri) { }
 };
@@ -32,6 +42,20 @@ class Store;
 
 struct Downloader
 {
+    struct Stats
+    {
+        std::atomic<uint64_t> requests{0};
+        std::atomic<uint64_t> succeeded{0};
+        std::atomic<uint64_t> failed{0};
+        std::atomic<uint64_t> bytesReceived{0};
+        std::atomic<uint64_t> transferTimeMs{0};
+    };
+
+    Stats stats;
+
+    /* Write the statistics counters to stderr, for NIX_SHOW_STATS. */
+    void dumpStats();
+
     /* Enqueue a download request, returning a future to the result of
        the download. The future may throw a DownloadError
        exception. */
@@ -44,6 +68,13 @@ struct Downloader
     /* Synchronously download a file. */
     DownloadResult download(const DownloadRequest & request);
 
+    /* Download a file, writing its data to a sink as it arrives. The
+       sink is called on the caller's thread and the amount of data
+       buffered between the download thread and the caller is
+       bounded, so the memory use is constant regardless of the size
+       of the file. */
+    void download(DownloadRequest && request, Sink & sink);
+
     /* Check if the specified file is already in ~/.cache/nix/tarballs
        and is more recent than ‘tarball-ttl’ seconds. Otherwise,
        use the recorded ETag to verify if the server has a more
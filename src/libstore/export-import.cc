@@ -1,8 +1,10 @@
 #include "store-api.hh"
 #include "archive.hh"
 #include "worker-protocol.hh"
+#include "sync.hh"
 
 #include <algorithm>
+#include <thread>
 
 namespace nix {
 
@@ -24,6 +26,23 @@ struct HashAndWriteSink : Sink
     }
 };
 
+struct HashAndReadSource : Source
+{
+    Source & readSource;
+    HashSink hashSink;
+    bool hashing;
+    HashAndReadSource(Source & readSource) : readSource(readSource), hashSink(htSHA256)
+    {
+        hashing = true;
+    }
+    size_t read(unsigned char * data, size_t len)
+    {
+        size_t n = readSource.read(data, len);
+        if (hashing) hashSink(data, n);
+        return n;
+    }
+};
+
 void Store::exportPaths(const Paths & paths, Sink & sink)
 {
     Paths sorted = topoSortPaths(PathSet(paths.begin(), paths.end()));
@@ -64,14 +83,70 @@ void Store::exportPath(const Path & path, Sink & sink)
 Paths Store::importPaths(Source & source, std::shared_ptr<FSAccessor> accessor, CheckSigsFlag checkSigs)
 {
     Paths res;
+
+    /* Paths are added on a separate thread, so that restoring,
+       verifying and registering one path overlaps with reading and
+       hashing the next one from the stream.  The export format
+       orders dependencies first, and the queue preserves that order,
+       so references are always registered before their referrers.
+       At most one path is queued to bound memory use. */
+    struct State
+    {
+        bool done = false;
+        std::list<std::pair<ValidPathInfo, ref<std::string>>> queue;
+        std::exception_ptr exc;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup, drained;
+
+    std::thread worker([&]() {
+        while (true) {
+            std::pair<ValidPathInfo, ref<std::string>> item{ValidPathInfo(), make_ref<std::string>()};
+            {
+                auto state(state_.lock());
+                while (state->queue.empty() && !state->done)
+                    state.wait(wakeup);
+                if (state->queue.empty()) return;
+                item = std::move(state->queue.front());
+                state->queue.pop_front();
+                drained.notify_one();
+            }
+            try {
+                addToStore(item.first, item.second, NoRepair, checkSigs, accessor);
+            } catch (...) {
+                auto state(state_.lock());
+                state->exc = std::current_exception();
+                drained.notify_one();
+                return;
+            }
+        }
+    });
+
+    auto finishWorker = [&]() {
+        {
+            auto state(state_.lock());
+            state->done = true;
+            wakeup.notify_one();
+        }
+        worker.join();
+        auto state(state_.lock());
+        if (state->exc) std::rethrow_exception(state->exc);
+    };
+
+    try {
     while (true) {
         auto n = readNum<uint64_t>(source);
         if (n == 0) break;
         if (n != 1) throw Error("input doesn't look like something created by 'nix-store --export'");
 
-        /* Extract the NAR from the source. */
-        TeeSink tee(source);
+        /* Extract the NAR from the source, hashing it while it is
+           being read instead of making a separate pass over the
+           buffered data afterwards. */
+        HashAndReadSource hashAndReadSource(source);
+        TeeSink tee(hashAndReadSource);
         parseDump(tee, tee.source);
+        hashAndReadSource.hashing = false;
 
         uint32_t magic = readInt(source);
         if (magic != exportMagic)
@@ -88,18 +163,31 @@ Paths Store::importPaths(Source & source, std::shared_ptr<FSAccessor> accessor,
         info.deriver = readString(source);
         if (info.deriver != "") assertStorePath(info.deriver);
 
-        info.narHash = hashString(htSHA256, *tee.source.data);
+        info.narHash = hashAndReadSource.hashSink.currentHash().first;
         info.narSize = tee.source.data->size();
 
         // Ignore optional legacy signature.
         if (readInt(source) == 1)
             readString(source);
 
-        addToStore(info, tee.source.data, NoRepair, checkSigs, accessor);
-
         res.push_back(info.path);
+
+        {
+            auto state(state_.lock());
+            if (state->exc) { res.pop_back(); break; }
+            while (!state->queue.empty() && !state->exc)
+                state.wait(drained);
+            state->queue.emplace_back(std::move(info), tee.source.data);
+            wakeup.notify_one();
+        }
+    }
+    } catch (...) {
+        try { finishWorker(); } catch (...) { }
+        throw;
     }
 
+    finishWorker();
+
     return res;
 }
 
@@ -16,6 +16,7 @@ public:
         Type type;
         uint64_t fileSize; // regular files only
         bool isExecutable; // regular files only
+        uint64_t narOffset; // regular files only; 0 if unknown
     };
 
     virtual Stat stat(const Path & path) = 0;
@@ -1,5 +1,6 @@
 #include "derivations.hh"
 #include "globals.hh"
+#include "thread-pool.hh"
 #include "local-store.hh"
 
 #include <functional>
@@ -14,6 +15,10 @@
 #include <unistd.h>
 #include <climits>
 
+#if __linux__
+#include <sys/syscall.h>
+#endif
+
 namespace nix {
 
 
@@ -354,10 +359,27 @@ try_again:
     return;
 }
 
-static string quoteRegexChars(const string & raw)
+/* Scan a string for store paths, i.e. occurrences of the store
+   directory followed by a plausible store path name.  This replaces a
+   std::regex search, which was by far the most expensive part of
+   scanning the environment of every process on the system. */
+static void searchForStorePaths(const string & s, const string & storeDir, StringSet & paths)
 {
-    static auto specialRegex = std::regex(R"([.^$\\*+?()\[\]{}|])");
-    return std::regex_replace(raw, specialRegex, R"(\$&)");
+    auto isNameChar = [](char c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+            || c == '+' || c == '-' || c == '.' || c == '_' || c == '?' || c == '=';
+    };
+
+    string prefix = storeDir + "/";
+
+    for (auto i = s.find(prefix); i != string::npos; i = s.find(prefix, i + 1)) {
+        auto j = i + prefix.size();
+        if (j >= s.size() || !((s[j] >= '0' && s[j] <= '9') || (s[j] >= 'a' && s[j] <= 'z')))
+            continue;
+        auto k = j;
+        while (k < s.size() && isNameChar(s[k])) ++k;
+        paths.emplace(s, i, k - i);
+    }
 }
 
 static void readFileRoots(const char * path, StringSet & paths)
@@ -376,12 +398,15 @@ void LocalStore::findRuntimeRoots(PathSet & roots)
     auto procDir = AutoCloseDir{opendir("/proc")};
     if (procDir) {
         struct dirent * ent;
-        auto digitsRegex = std::regex(R"(^\d+$)");
-        auto mapRegex = std::regex(R"(^\s*\S+\s+\S+\s+\S+\s+\S+\s+\S+\s+(/\S+)\s*$)");
-        auto storePathRegex = std::regex(quoteRegexChars(storeDir) + R"(/[0-9a-z]+[0-9a-zA-Z\+\-\._\?=]*)");
+        auto isPid = [](const char * name) {
+            if (!*name) return false;
+            for (auto p = name; *p; ++p)
+                if (*p < '0' || *p > '9') return false;
+            return true;
+        };
         while (errno = 0, ent = readdir(procDir.get())) {
             checkInterrupt();
-            if (std::regex_match(ent->d_name, digitsRegex)) {
+            if (isPid(ent->d_name)) {
                 readProcLink((format("/proc/%1%/exe") % ent->d_name).str(), paths);
                 readProcLink((format("/proc/%1%/cwd") % ent->d_name).str(), paths);
 
@@ -402,19 +427,23 @@ void LocalStore::findRuntimeRoots(PathSet & roots)
                     throw SysError(format("iterating /proc/%1%/fd") % ent->d_name);
                 fdDir.reset();
 
+                /* The mapped file name is everything from the first
+                   '/' on the line; skip entries whose name contains
+                   whitespace (e.g. "... (deleted)"), as before. */
                 auto mapLines =
                     tokenizeString<std::vector<string>>(readFile((format("/proc/%1%/maps") % ent->d_name).str(), true), "\n");
-                for (const auto& line : mapLines) {
-                    auto match = std::smatch{};
-                    if (std::regex_match(line, match, mapRegex))
-                        paths.emplace(match[1]);
+                for (const auto & line : mapLines) {
+                    auto pos = line.find('/');
+                    if (pos == string::npos) continue;
+                    auto end = line.find_last_not_of(" \t") + 1;
+                    string file(line, pos, end - pos);
+                    if (file.find_first_of(" \t") == string::npos)
+                        paths.emplace(file);
                 }
 
                 try {
                     auto envString = readFile((format("/proc/%1%/environ") % ent->d_name).str(), true);
-                    auto env_end = std::sregex_iterator{};
-                    for (auto i = std::sregex_iterator{envString.begin(), envString.end(), storePathRegex}; i != env_end; ++i)
-                        paths.emplace(i->str());
+                    searchForStorePaths(envString, storeDir, paths);
                 } catch (SysError & e) {
                     if (errno == ENOENT || errno == EACCES)
                         continue;
@@ -696,6 +725,34 @@ void LocalStore::removeUnusedLinks(const GCState & state)
 }
 
 
+/* Demotes the calling process to the kernel's idle I/O scheduling
+   class for the duration of its scope, so that GC unlink storms yield
+   the disk to concurrent builds.  A no-op on non-Linux platforms or
+   if the ioprio syscalls are unavailable. */
+struct IdleIOClass
+{
+    int prev = -1;
+
+    IdleIOClass()
+    {
+#if __linux__
+        prev = syscall(SYS_ioprio_get, 1 /* IOPRIO_WHO_PROCESS */, 0);
+        if (prev != -1 &&
+            syscall(SYS_ioprio_set, 1, 0, 3 << 13 /* IOPRIO_CLASS_IDLE */) == -1)
+            prev = -1;
+#endif
+    }
+
+    ~IdleIOClass()
+    {
+#if __linux__
+        if (prev != -1)
+            syscall(SYS_ioprio_set, 1, 0, prev);
+#endif
+    }
+};
+
+
 void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 {
     GCState state(results);
@@ -714,6 +771,13 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
     state.shouldDelete = options.action == GCOptions::gcDeleteDead || options.action == GCOptions::gcDeleteSpecific;
 
+    /* Optionally issue all deletion I/O at idle priority.  In the
+       daemon each client connection runs in a process of its own, so
+       this only demotes the collecting client. */
+    std::unique_ptr<IdleIOClass> idleIO;
+    if (state.shouldDelete && settings.gcIdleIO)
+        idleIO = std::make_unique<IdleIOClass>();
+
     if (state.shouldDelete)
         deletePath(reservedPath);
 
@@ -783,27 +847,39 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
             AutoCloseDir dir(opendir(realStoreDir.c_str()));
             if (!dir) throw SysError(format("opening directory '%1%'") % realStoreDir);
 
-            /* Read the store and immediately delete all paths that
-               aren't valid.  When using --max-freed etc., deleting
-               invalid paths is preferred over deleting unreachable
-               paths, since unreachable paths could become reachable
-               again.  We don't use readDirectory() here so that GCing
-               can start faster. */
-            Paths entries;
+            /* Read the store.  Non-store-path entries (lock files
+               and the like) are deleted right away. */
+            PathSet candidates;
             struct dirent * dirent;
             while (errno = 0, dirent = readdir(dir.get())) {
                 checkInterrupt();
                 string name = dirent->d_name;
                 if (name == "." || name == "..") continue;
                 Path path = storeDir + "/" + name;
-                if (isStorePath(path) && isValidPath(path))
-                    entries.push_back(path);
+                if (isStorePath(path))
+                    candidates.insert(path);
                 else
                     tryToDelete(state, path);
             }
 
             dir.reset();
 
+            /* Determine the validity of all store entries in one
+               batched query rather than one point query per entry,
+               and delete the invalid ones first.  When using
+               --max-freed etc., deleting invalid paths is preferred
+               over deleting unreachable paths, since unreachable
+               paths could become reachable again. */
+            PathSet valid = queryValidPaths(candidates);
+
+            Paths entries;
+            for (auto & i : candidates) {
+                if (valid.count(i))
+                    entries.push_back(i);
+                else
+                    tryToDelete(state, i);
+            }
+
             /* Now delete the unreachable valid paths.  Randomise the
                order in which we delete entries to make the collector
                less biased towards deleting paths that come
@@ -833,8 +909,24 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
     fdGCLock = -1;
     fds.clear();
 
-    /* Delete the trash directory. */
+    /* Delete the trash directory.  Every entry in it is an
+       independent tree that was moved aside while the lock was held,
+       so the trees can be deleted by a thread pool; removing a large
+       pile of build outputs is dominated by per-file syscall latency
+       that parallelises well. */
     printInfo(format("deleting '%1%'") % trashDir);
+    if (pathExists(trashDir)) {
+        std::atomic<unsigned long long> bytesFreed{0};
+        ThreadPool pool;
+        for (auto & entry : readDirectory(trashDir))
+            pool.enqueue([&, name(entry.name)]() {
+                unsigned long long freed;
+                deletePath(trashDir + "/" + name, freed);
+                bytesFreed += freed;
+            });
+        pool.process();
+        state.results.bytesFreed += bytesFreed;
+    }
     deleteGarbage(state, trashDir);
 
     /* Clean up the links directory. */
@@ -4,6 +4,7 @@
 #include "args.hh"
 
 #include <algorithm>
+#include <dlfcn.h>
 #include <map>
 #include <thread>
 
@@ -83,6 +84,21 @@ unsigned int Settings::getDefaultCores()
     return std::max(1U, std::thread::hardware_concurrency());
 }
 
+void initPlugins()
+{
+    for (auto & file : settings.pluginFiles.get()) {
+        /* Plugins are loaded once for the lifetime of the process
+           and never dlclose()d: they may have registered primops or
+           store implementations whose code must stay mapped.  Their
+           static initialisers do the actual registration (e.g. via
+           RegisterPrimOp), so there is nothing to look up here. */
+        void * handle = dlopen(file.c_str(), RTLD_LAZY | RTLD_LOCAL);
+        if (!handle)
+            throw Error(format("could not dynamically open plugin file '%1%': %2%") % file % dlerror());
+    }
+}
+
+
 const string nixVersion = PACKAGE_VERSION;
 
 template<> void BaseSetting<SandboxMode>::set(const std::string & str)
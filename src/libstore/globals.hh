@@ -102,6 +102,18 @@ public:
     MaxBuildJobsSetting maxBuildJobs{this, 1, "build-max-jobs",
         "Maximum number of parallel build jobs. \"auto\" means use number of cores."};
 
+    Setting<unsigned int> maxSubstitutionJobs{this, 16, "max-substitution-jobs",
+        "Maximum number of parallel substitutions.  Substitutions are "
+        "mostly network-bound, so they get their own limit instead of "
+        "competing with local builds for 'build-max-jobs' slots."};
+
+    Setting<unsigned int> maxLoadAverage{this, 0, "max-load-average",
+        "If set to a non-zero value, no new builds are started while the "
+        "1-minute load average of the system exceeds this value.  One "
+        "build is always allowed to run so that progress is guaranteed.  "
+        "This prevents colocated builds that each use all cores from "
+        "thrashing the machine.  0 disables the check."};
+
     Setting<unsigned int> buildCores{this, getDefaultCores(), "build-cores",
         "Number of CPU cores to utilize in parallel within a build, "
         "i.e. by passing this number to Make via '-j'. 0 means that the "
@@ -146,6 +158,10 @@ public:
     Setting<bool> useSQLiteWAL{this, true, "use-sqlite-wal",
         "Whether SQLite should use WAL mode."};
 
+    Setting<uint64_t> sqliteMmapSize{this, 0, "sqlite-mmap-size",
+        "Number of bytes of the Nix database to access through a memory "
+        "map instead of read() calls, or 0 to disable memory mapping."};
+
     Setting<bool> syncBeforeRegistering{this, false, "sync-before-registering",
         "Whether to call sync() before registering a path as valid."};
 
@@ -186,6 +202,10 @@ public:
     Setting<bool> gcKeepDerivations{this, true, "gc-keep-derivations",
         "Whether the garbage collector should keep derivers of live paths."};
 
+    Setting<bool> gcIdleIO{this, false, "gc-idle-io",
+        "Whether the garbage collector should delete paths in the kernel's "
+        "idle I/O scheduling class, yielding the disk to concurrent builds."};
+
     Setting<bool> autoOptimiseStore{this, false, "auto-optimise-store",
         "Whether to automatically replace files with identical contents with hard links."};
 
@@ -218,6 +238,17 @@ public:
         "Whether to restrict file system access to paths in $NIX_PATH, "
         "and to disallow fetching files from the network."};
 
+    Setting<size_t> maxEvalHeapSize{this, 0, "max-eval-heap-size",
+        "Maximum size in bytes of the heap used by the Nix expression "
+        "evaluator, or 0 for no limit.  If garbage collection cannot "
+        "get the heap back under this limit, evaluation fails."};
+
+    Setting<bool> evalSubstituterPrefetch{this, false, "eval-substituter-prefetch",
+        "Whether to probe the substituters for the outputs of every "
+        "derivation instantiated during evaluation.  This warms the "
+        "narinfo caches in the background, so substitution can start "
+        "as soon as evaluation finishes."};
+
     Setting<size_t> buildRepeat{this, 0, "build-repeat",
         "The number of times to repeat a build in order to verify determinism."};
 
@@ -261,12 +292,22 @@ public:
         "Number of parallel HTTP connections.",
         {"binary-caches-parallel-connections"}};
 
+    Setting<size_t> httpConnectionsPerHost{this, 0, "http-connections-per-host",
+        "Maximum number of parallel HTTP connections per host (0 means "
+        "limited only by 'http-connections')."};
+
     Setting<bool> enableHttp2{this, true, "enable-http2",
         "Whether to enable HTTP/2 support."};
 
     Setting<unsigned int> tarballTtl{this, 60 * 60, "tarball-ttl",
         "How soon to expire files fetched by builtins.fetchTarball and builtins.fetchurl."};
 
+    Setting<unsigned int> ttlNegativeNarInfoCache{this, 3600, "narinfo-cache-negative-ttl",
+        "The TTL in seconds for negative lookups in the in-memory store path metadata cache."};
+
+    Setting<unsigned int> ttlPositiveNarInfoCache{this, 30 * 24 * 3600, "narinfo-cache-positive-ttl",
+        "The TTL in seconds for positive lookups in the in-memory store path metadata cache."};
+
     Setting<std::string> signedBinaryCaches{this, "*", "signed-binary-caches",
         "Obsolete."};
 
@@ -319,6 +360,17 @@ public:
     Setting<unsigned long> connectTimeout{this, 0, "connect-timeout",
         "Timeout for connecting to servers during downloads. 0 means use curl's builtin default."};
 
+    Setting<unsigned long> stalledDownloadTimeout{this, 300, "stalled-download-timeout",
+        "Timeout (in seconds) for receiving data from servers during "
+        "download.  Nix cancels idle downloads after this timeout's "
+        "duration."};
+
+    Setting<unsigned int> copyAttempts{this, 3, "copy-attempts",
+        "How many times to attempt copying a store path to a "
+        "destination store before giving up.  A retry restarts the "
+        "path's transfer from scratch; paths that were already copied "
+        "are never transferred again."};
+
     Setting<std::string> userAgentSuffix{this, "", "user-agent-suffix",
         "String appended to the user agent in HTTP requests."};
 
@@ -330,12 +382,21 @@ public:
 
     Setting<Strings> hashedMirrors{this, {"http://tarballs.nixos.org/"}, "hashed-mirrors",
         "A list of servers used by builtins.fetchurl to fetch files by hash."};
+
+    Setting<Paths> pluginFiles{this, {}, "plugin-files",
+        "Plugins (shared objects) to dlopen() at startup.  Plugins "
+        "typically register additional primops or store types via "
+        "static initialisers."};
 };
 
 
 // FIXME: don't use a global variable.
 extern Settings settings;
 
+/* dlopen() the plugins specified by the 'plugin-files' setting.
+   Must be called after settings.loadConfFile(). */
+void initPlugins();
+
 
 extern const string nixVersion;
 
@@ -77,6 +77,11 @@ protected:
         DownloadRequest request(cacheUri + "/" + path);
         request.tries = 8;
 
+        /* Answer .narinfo lookups before fetching NARs, so that
+           substitutability queries don't wait for bulk transfers. */
+        if (hasSuffix(path, ".narinfo"))
+            request.priority = 1;
+
         getDownloader()->enqueueDownload(request,
             [success](const DownloadResult & result) {
                 success(result.data);
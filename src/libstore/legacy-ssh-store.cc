@@ -40,7 +40,12 @@ struct LegacySSHStore : public Store
         , connections(make_ref<Pool<Connection>>(
             std::max(1, (int) maxConnections),
             [this]() { return openConnection(); },
-            [](const ref<Connection> & r) { return true; }
+            [](const ref<Connection> & r) {
+                return r->to.good() && r->from.good()
+                    /* Drop connections whose ssh process has died,
+                       instead of failing the next command on them. */
+                    && ::kill(r->sshConn->sshPid, 0) == 0;
+            }
             ))
         , master(
             host,
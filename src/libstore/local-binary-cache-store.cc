@@ -48,6 +48,8 @@ protected:
         });
     }
 
+    void deleteFile(const std::string & path) override;
+
     PathSet queryAllValidPaths() override
     {
         PathSet paths;
@@ -92,6 +94,14 @@ void LocalBinaryCacheStore::upsertFile(const std::string & path,
     atomicWrite(binaryCacheDir + "/" + path, data);
 }
 
+void LocalBinaryCacheStore::deleteFile(const std::string & path)
+{
+    /* ENOENT is fine: an earlier interrupted GC may already have
+       removed the file. */
+    if (unlink((binaryCacheDir + "/" + path).c_str()) == -1 && errno != ENOENT)
+        throw SysError(format("deleting '%1%/%2%'") % binaryCacheDir % path);
+}
+
 static RegisterStoreImplementation regStore([](
     const std::string & uri, const Store::Params & params)
     -> std::shared_ptr<Store>
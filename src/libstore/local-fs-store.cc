@@ -1,5 +1,6 @@
 #include "archive.hh"
 #include "fs-accessor.hh"
+#include "sync.hh"
 #include "store-api.hh"
 #include "globals.hh"
 #include "compression.hh"
@@ -16,13 +17,29 @@ struct LocalStoreAccessor : public FSAccessor
 {
     ref<LocalFSStore> store;
 
+    /* Store paths whose validity has already been established.
+       Without this, every stat() or readFile() pays a database query
+       even when walking a single store path.  Bounded by the number
+       of distinct store paths visited through this accessor.  Note
+       that validity is as stale as it always was: a concurrent GC
+       can remove a path between the check and the actual I/O. */
+    Sync<PathSet> validated_;
+
     LocalStoreAccessor(ref<LocalFSStore> store) : store(store) { }
 
     Path toRealPath(const Path & path)
     {
         Path storePath = store->toStorePath(path);
-        if (!store->isValidPath(storePath))
-            throw InvalidPath(format("path '%1%' is not a valid store path") % storePath);
+
+        {
+            auto validated(validated_.lock());
+            if (!validated->count(storePath)) {
+                if (!store->isValidPath(storePath))
+                    throw InvalidPath(format("path '%1%' is not a valid store path") % storePath);
+                validated->insert(storePath);
+            }
+        }
+
         return store->getRealStoreDir() + std::string(path, store->storeDir.size());
     }
 
@@ -73,8 +90,11 @@ struct LocalStoreAccessor : public FSAccessor
 
 ref<FSAccessor> LocalFSStore::getFSAccessor()
 {
-    return make_ref<LocalStoreAccessor>(ref<LocalFSStore>(
-            std::dynamic_pointer_cast<LocalFSStore>(shared_from_this())));
+    auto fsAccessor(fsAccessor_.lock());
+    if (!*fsAccessor)
+        *fsAccessor = std::make_shared<LocalStoreAccessor>(ref<LocalFSStore>(
+                std::dynamic_pointer_cast<LocalFSStore>(shared_from_this())));
+    return ref<FSAccessor>(*fsAccessor);
 }
 
 void LocalFSStore::narFromPath(const Path & path, Sink & sink)
@@ -114,15 +134,19 @@ std::shared_ptr<std::string> LocalFSStore::getBuildLog(const Path & path_)
             : fmt("%s/%s/%s", logDir, drvsLogDir, baseName);
         Path logBz2Path = logPath + ".bz2";
 
-        if (pathExists(logPath))
+        /* Try to read each candidate directly rather than stat'ing
+           it first; that's one syscall instead of two per candidate
+           and not racy against log rotation. */
+        try {
             return std::make_shared<std::string>(readFile(logPath));
-
-        else if (pathExists(logBz2Path)) {
-            try {
-                return decompress("bzip2", readFile(logBz2Path));
-            } catch (Error &) { }
+        } catch (SysError & e) {
+            if (e.errNo != ENOENT) throw;
         }
 
+        try {
+            return decompress("bzip2", readFile(logBz2Path));
+        } catch (Error &) { }
+
     }
 
     return nullptr;
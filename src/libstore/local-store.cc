@@ -5,8 +5,10 @@
 #include "worker-protocol.hh"
 #include "derivations.hh"
 #include "nar-info.hh"
+#include "thread-pool.hh"
 
 #include <iostream>
+#include <thread>
 #include <algorithm>
 #include <cstring>
 
@@ -204,6 +206,44 @@ LocalStore::LocalStore(const Params & params)
             txn.commit();
         }
 
+        if (curSchema < 11) {
+            /* Existing rows keep a null closureSize and are
+               backfilled lazily by getClosureSizes(). */
+            SQLiteTxn txn(state->db);
+            state->db.exec("alter table ValidPaths add column closureSize integer");
+            state->db.exec("alter table ValidPaths add column closureCount integer");
+            txn.commit();
+        }
+
+        if (curSchema < 12) {
+            SQLiteTxn txn(state->db);
+            state->db.exec(
+                "create table if not exists BuildMetrics ("
+                "  drv        text not null,"
+                "  startTime  integer not null,"
+                "  duration   integer not null,"
+                "  cpuUser    integer,"
+                "  cpuSystem  integer,"
+                "  peakRSS    integer,"
+                "  outputSize integer,"
+                "  primary key (drv, startTime)"
+                ")");
+            txn.commit();
+        }
+
+        if (curSchema < 13) {
+            SQLiteTxn txn(state->db);
+            state->db.exec(
+                "create table if not exists DeterminismChecks ("
+                "  drv           text not null,"
+                "  checkTime     integer not null,"
+                "  deterministic integer not null,"
+                "  diff          text,"
+                "  primary key (drv, checkTime)"
+                ")");
+            txn.commit();
+        }
+
         writeFile(schemaPath, (format("%1%") % nixSchemaVersion).str());
 
         lockFile(globalLock.get(), ltRead, true);
@@ -237,11 +277,47 @@ LocalStore::LocalStore(const Params & params)
     state->stmtQueryPathFromHashPart.create(state->db,
         "select path from ValidPaths where path >= ? limit 1;");
     state->stmtQueryValidPaths.create(state->db, "select path from ValidPaths");
+    state->stmtQueryClosureSize.create(state->db,
+        "select closureSize, closureCount from ValidPaths where id = ?;");
+    state->stmtComputeClosureSize.create(state->db,
+        "with recursive closure(p) as (select ? union select reference from Refs, closure where referrer = p) "
+        "select sum(narSize), count(*) from ValidPaths join closure on id = p;");
+    state->stmtUpdateClosureSize.create(state->db,
+        "update ValidPaths set closureSize = ?, closureCount = ? where id = ?;");
+    state->stmtAddBuildMetrics.create(state->db,
+        "insert or replace into BuildMetrics (drv, startTime, duration, cpuUser, cpuSystem, peakRSS, outputSize) values (?, ?, ?, ?, ?, ?, ?);");
+    state->stmtQueryBuildMetrics.create(state->db,
+        "select startTime, duration, cpuUser, cpuSystem, peakRSS, outputSize from BuildMetrics where drv = ? order by startTime;");
+    state->stmtAddDeterminismCheck.create(state->db,
+        "insert or replace into DeterminismChecks (drv, checkTime, deterministic, diff) values (?, ?, ?, ?);");
+    state->stmtQueryDeterminismChecks.create(state->db,
+        "select checkTime, deterministic, diff from DeterminismChecks where drv = ? order by checkTime;");
+
+    /* In WAL mode, path info queries can run on separate read-only
+       connections, in parallel with each other and with writes on
+       the main connection.  The connections are opened lazily by the
+       pool, so this costs nothing if only one thread ever queries. */
+    if (settings.useSQLiteWAL)
+        readConns = std::make_shared<Pool<ReadConn>>(
+            std::max(1U, std::thread::hardware_concurrency()),
+            [this]() { return openReadConn(); });
+
+    /* Checkpoint the WAL from a thread of our own so that writers
+       don't have to do it in-line when the log crosses the
+       auto-checkpoint threshold. */
+    if (settings.useSQLiteWAL)
+        checkpointThread = std::thread([this]() { runCheckpointThread(); });
 }
 
 
 LocalStore::~LocalStore()
 {
+    if (checkpointThread.joinable()) {
+        checkpointState_.lock()->quit = true;
+        checkpointWakeup.notify_one();
+        checkpointThread.join();
+    }
+
     auto state(_state.lock());
 
     try {
@@ -327,10 +403,18 @@ void LocalStore::openDB(State & state, bool create)
 
     /* Increase the auto-checkpoint interval to 40000 pages.  This
        seems enough to ensure that instantiating the NixOS system
-       derivation is done in a single fsync(). */
+       derivation is done in a single fsync().  It's only a backstop:
+       the checkpoint thread started by the constructor normally
+       truncates the log long before it gets that big. */
     if (mode == "wal" && sqlite3_exec(db, "pragma wal_autocheckpoint = 40000;", 0, 0, 0) != SQLITE_OK)
         throwSQLiteError(db, "setting autocheckpoint interval");
 
+    /* Optionally access the database through a memory map, which
+       saves a read() per page miss and shares hot pages with other
+       processes using the store. */
+    if (settings.sqliteMmapSize)
+        db.exec("pragma mmap_size = " + std::to_string(settings.sqliteMmapSize.get()));
+
     /* Initialise the database schema, if necessary. */
     if (create) {
         const char * schema =
@@ -341,6 +425,90 @@ void LocalStore::openDB(State & state, bool create)
 }
 
 
+ref<LocalStore::ReadConn> LocalStore::openReadConn()
+{
+    auto conn = make_ref<ReadConn>();
+
+    string dbPath = dbDir + "/db.sqlite";
+    if (sqlite3_open_v2(dbPath.c_str(), &conn->db.db, SQLITE_OPEN_READONLY, 0) != SQLITE_OK)
+        throw Error(format("cannot open Nix database '%1%'") % dbPath);
+
+    if (sqlite3_busy_timeout(conn->db, 60 * 60 * 1000) != SQLITE_OK)
+        throwSQLiteError(conn->db, "setting timeout");
+
+    conn->stmtQueryPathInfo.create(conn->db,
+        "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths where path = ?;");
+    conn->stmtQueryReferences.create(conn->db,
+        "select path from Refs join ValidPaths on reference = id where referrer = ?;");
+
+    return conn;
+}
+
+
+void LocalStore::runCheckpointThread()
+{
+    try {
+        /* Use a connection of our own so that a checkpoint never
+           holds up statements on the main connection. */
+        SQLite db;
+        string dbPath = dbDir + "/db.sqlite";
+        if (sqlite3_open_v2(dbPath.c_str(), &db.db, SQLITE_OPEN_READWRITE, 0) != SQLITE_OK)
+            throw Error(format("cannot open Nix database '%1%'") % dbPath);
+
+        /* Don't wait on a busy database.  If a writer is in the way,
+           the next round will simply checkpoint a bigger log. */
+        if (sqlite3_busy_timeout(db, 0) != SQLITE_OK)
+            throwSQLiteError(db, "setting timeout");
+
+        while (true) {
+            {
+                auto state(checkpointState_.lock());
+                if (!state->quit)
+                    state.wait_for(checkpointWakeup, std::chrono::seconds(15));
+                if (state->quit) return;
+            }
+
+            /* Truncate mode resets the log file to zero length, so a
+               burst of registrations doesn't leave a huge WAL around
+               for the rest of the process's lifetime. */
+            int res = sqlite3_wal_checkpoint_v2(db, "main",
+                SQLITE_CHECKPOINT_TRUNCATE, nullptr, nullptr);
+            if (res != SQLITE_OK && res != SQLITE_BUSY && res != SQLITE_LOCKED)
+                debug(format("WAL checkpoint failed: %1%") % sqlite3_errmsg(db));
+        }
+    } catch (...) {
+        ignoreException();
+    }
+}
+
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+
+/* Try to make 'dst' a reflink clone of the regular file 'src', so
+   that the two share extents (btrfs, XFS).  Returns false if the
+   filesystem doesn't support cloning, leaving no trace of 'dst'; the
+   caller should then fall back to an ordinary copy. */
+static bool cloneFile(const Path & src, const Path & dst)
+{
+#if __linux__
+    AutoCloseFD fdSrc = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fdSrc) return false;
+    AutoCloseFD fdDst = open(dst.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (!fdDst) return false;
+    if (ioctl(fdDst.get(), FICLONE, fdSrc.get()) == -1) {
+        unlink(dst.c_str());
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+
 /* To improve purity, users may want to make the Nix store a read-only
    bind mount.  So make the Nix store writable for this process. */
 void LocalStore::makeStoreWritable()
@@ -410,7 +578,18 @@ void canonicaliseTimestampAndPermissions(const Path & path)
 }
 
 
-static void canonicalisePathMetaData_(const Path & path, uid_t fromUid, InodesSeen & inodesSeen)
+/* Shared state for a (possibly parallel) canonicalisation run.  The
+   mutex only guards inodesSeen; the filesystem operations themselves
+   touch disjoint subtrees. */
+struct CanonicaliseState
+{
+    std::mutex lock;
+    InodesSeen & inodesSeen;
+    CanonicaliseState(InodesSeen & inodesSeen) : inodesSeen(inodesSeen) { }
+};
+
+static void canonicalisePathMetaData_(const Path & path, uid_t fromUid,
+    CanonicaliseState & state, bool atTop)
 {
     checkInterrupt();
 
@@ -463,14 +642,28 @@ static void canonicalisePathMetaData_(const Path & path, uid_t fromUid, InodesSe
        (i.e. "touch $out/foo; ln $out/foo $out/bar"). */
     if (fromUid != (uid_t) -1 && st.st_uid != fromUid) {
         assert(!S_ISDIR(st.st_mode));
-        if (inodesSeen.find(Inode(st.st_dev, st.st_ino)) == inodesSeen.end())
+        /* If another worker got here first, it inserted the inode
+           before chowning it (see below), so seeing the post-chown
+           uid implies the insertion is visible once we hold the
+           lock. */
+        bool seen;
+        {
+            std::lock_guard<std::mutex> guard(state.lock);
+            seen = state.inodesSeen.find(Inode(st.st_dev, st.st_ino)) != state.inodesSeen.end();
+        }
+        if (!seen)
             throw BuildError(format("invalid ownership on file '%1%'") % path);
         mode_t mode = st.st_mode & ~S_IFMT;
         assert(S_ISLNK(st.st_mode) || (st.st_uid == geteuid() && (mode == 0444 || mode == 0555) && st.st_mtime == mtimeStore));
         return;
     }
 
-    inodesSeen.insert(Inode(st.st_dev, st.st_ino));
+    /* Note: the insertion must precede the chmod/chown below for the
+       hard-link check above to stay sound under parallelism. */
+    {
+        std::lock_guard<std::mutex> guard(state.lock);
+        state.inodesSeen.insert(Inode(st.st_dev, st.st_ino));
+    }
 
     canonicaliseTimestampAndPermissions(path, st);
 
@@ -494,15 +687,29 @@ static void canonicalisePathMetaData_(const Path & path, uid_t fromUid, InodesSe
 
     if (S_ISDIR(st.st_mode)) {
         DirEntries entries = readDirectory(path);
-        for (auto & i : entries)
-            canonicalisePathMetaData_(path + "/" + i.name, fromUid, inodesSeen);
+
+        /* At the top level, spread the subtrees over a thread pool;
+           builds with very large outputs otherwise spend minutes in
+           this single-threaded metadata pass.  Below the top level
+           the walk stays sequential to keep the pool shallow. */
+        if (atTop && entries.size() > 1) {
+            ThreadPool pool;
+            for (auto & i : entries)
+                pool.enqueue([&, name(i.name)]() {
+                    canonicalisePathMetaData_(path + "/" + name, fromUid, state, false);
+                });
+            pool.process();
+        } else
+            for (auto & i : entries)
+                canonicalisePathMetaData_(path + "/" + i.name, fromUid, state, false);
     }
 }
 
 
 void canonicalisePathMetaData(const Path & path, uid_t fromUid, InodesSeen & inodesSeen)
 {
-    canonicalisePathMetaData_(path, fromUid, inodesSeen);
+    CanonicaliseState state(inodesSeen);
+    canonicalisePathMetaData_(path, fromUid, state, true);
 
     /* On platforms that don't have lchown(), the top-level path can't
        be a symlink, since we can't change its ownership. */
@@ -625,11 +832,11 @@ void LocalStore::queryPathInfoUncached(const Path & path,
 
         assertStorePath(path);
 
-        return retrySQLite<std::shared_ptr<ValidPathInfo>>([&]() {
-            auto state(_state.lock());
-
+        auto doQuery = [&](SQLiteStmt & stmtQueryPathInfo, SQLiteStmt & stmtQueryReferences)
+            -> std::shared_ptr<ValidPathInfo>
+        {
             /* Get the path info. */
-            auto useQueryPathInfo(state->stmtQueryPathInfo.use()(path));
+            auto useQueryPathInfo(stmtQueryPathInfo.use()(path));
 
             if (!useQueryPathInfo.next())
                 return std::shared_ptr<ValidPathInfo>();
@@ -644,7 +851,7 @@ void LocalStore::queryPathInfoUncached(const Path & path,
 
             info->registrationTime = useQueryPathInfo.getInt(2);
 
-            auto s = (const char *) sqlite3_column_text(state->stmtQueryPathInfo, 3);
+            auto s = (const char *) sqlite3_column_text(stmtQueryPathInfo, 3);
             if (s) info->deriver = s;
 
             /* Note that narSize = NULL yields 0. */
@@ -652,19 +859,32 @@ void LocalStore::queryPathInfoUncached(const Path & path,
 
             info->ultimate = useQueryPathInfo.getInt(5) == 1;
 
-            s = (const char *) sqlite3_column_text(state->stmtQueryPathInfo, 6);
+            s = (const char *) sqlite3_column_text(stmtQueryPathInfo, 6);
             if (s) info->sigs = tokenizeString<StringSet>(s, " ");
 
-            s = (const char *) sqlite3_column_text(state->stmtQueryPathInfo, 7);
+            s = (const char *) sqlite3_column_text(stmtQueryPathInfo, 7);
             if (s) info->ca = s;
 
             /* Get the references. */
-            auto useQueryReferences(state->stmtQueryReferences.use()(info->id));
+            auto useQueryReferences(stmtQueryReferences.use()(info->id));
 
             while (useQueryReferences.next())
                 info->references.insert(useQueryReferences.getStr(0));
 
             return info;
+        };
+
+        return retrySQLite<std::shared_ptr<ValidPathInfo>>([&]() {
+            /* Use a pooled read-only connection if we have them (WAL
+               mode), so concurrent queries don't serialize on the
+               main connection. */
+            if (readConns) {
+                auto conn(readConns->get());
+                return doQuery(conn->stmtQueryPathInfo, conn->stmtQueryReferences);
+            }
+
+            auto state(_state.lock());
+            return doQuery(state->stmtQueryPathInfo, state->stmtQueryReferences);
         });
     });
 }
@@ -711,8 +931,54 @@ bool LocalStore::isValidPathUncached(const Path & path)
 PathSet LocalStore::queryValidPaths(const PathSet & paths, SubstituteFlag maybeSubstitute)
 {
     PathSet res;
-    for (auto & i : paths)
-        if (isValidPath(i)) res.insert(i);
+
+    /* Serve paths whose validity is already cached in memory, and
+       collect the rest for a batched database query. */
+    Paths left;
+    {
+        auto state_(Store::state.lock());
+        for (auto & i : paths) {
+            auto cached = state_->pathInfoCache.get(storePathToHash(i));
+            if (cached && cached->isKnownNow()) {
+                stats.narInfoReadAverted++;
+                if (cached->didExist()) res.insert(i);
+            } else
+                left.push_back(i);
+        }
+    }
+
+    if (left.empty()) return res;
+
+    /* Check the remaining paths a few hundred per statement instead
+       of one statement execution per path.  The 'in' list is matched
+       against the index on ValidPaths.path, so each chunk is a single
+       indexed query; this matters when checking a 40k-path closure. */
+    auto valid = retrySQLite<PathSet>([&]() {
+        auto state(_state.lock());
+
+        PathSet valid;
+
+        const size_t chunkSize = 500;
+
+        for (auto i = left.begin(); i != left.end(); ) {
+            size_t n = std::min(chunkSize, (size_t) std::distance(i, left.end()));
+
+            string sql = "select path from ValidPaths where path in (";
+            for (size_t j = 0; j < n; ++j) sql += j ? ",?" : "?";
+            sql += ");";
+
+            SQLiteStmt stmt(state->db, sql);
+            auto use(stmt.use());
+            for (size_t j = 0; j < n; ++j, ++i) use(*i);
+
+            while (use.next()) valid.insert(use.getStr(0));
+        }
+
+        return valid;
+    });
+
+    res.insert(valid.begin(), valid.end());
+
     return res;
 }
 
@@ -748,6 +1014,54 @@ void LocalStore::queryReferrers(const Path & path, PathSet & referrers)
 }
 
 
+void LocalStore::computeFSClosure(const PathSet & startPaths, PathSet & paths,
+    bool flipDirection, bool includeOutputs, bool includeDerivers)
+{
+    /* Fast path for plain referrer closures ('nix-store --query
+       --referrers-closure', GC liveness walks): breadth-first over
+       the Refs table under a single state lock, instead of one
+       queryPathInfo round trip through the async machinery per node.
+       Everything the Refs table yields is valid by construction, so
+       only the start paths need checking. */
+    if (!flipDirection || includeOutputs || includeDerivers) {
+        Store::computeFSClosure(startPaths, paths,
+            flipDirection, includeOutputs, includeDerivers);
+        return;
+    }
+
+    for (auto & i : startPaths) assertStorePath(i);
+
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+
+        /* Accumulate into a local set so that a SQLITE_BUSY retry
+           starts from scratch rather than from a half-expanded
+           closure. */
+        PathSet res;
+
+        std::vector<Path> queue(startPaths.begin(), startPaths.end());
+
+        for (auto & i : startPaths)
+            if (!isValidPath_(*state, i))
+                throw InvalidPath(format("path '%1%' is not valid") % i);
+
+        while (!queue.empty()) {
+            Path path = std::move(queue.back());
+            queue.pop_back();
+            if (!res.insert(path).second) continue;
+
+            PathSet referrers;
+            queryReferrers(*state, path, referrers);
+            for (auto & ref : referrers)
+                if (ref != path)
+                    queue.push_back(ref);
+        }
+
+        paths.insert(res.begin(), res.end());
+    });
+}
+
+
 PathSet LocalStore::queryValidDerivers(const Path & path)
 {
     assertStorePath(path);
@@ -851,28 +1165,198 @@ void LocalStore::querySubstitutablePathInfos(const PathSet & paths,
     SubstitutablePathInfos & infos)
 {
     if (!settings.useSubstitutes) return;
+
     for (auto & sub : getDefaultSubstituters()) {
         if (sub->storeDir != storeDir) continue;
-        for (auto & path : paths) {
-            if (infos.count(path)) continue;
-            debug(format("checking substituter '%s' for path '%s'")
-                % sub->getUri() % path);
-            try {
-                auto info = sub->queryPathInfo(path);
-                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
-                    std::shared_ptr<const ValidPathInfo>(info));
-                infos[path] = SubstitutablePathInfo{
-                    info->deriver,
-                    info->references,
-                    narInfo ? narInfo->fileSize : 0,
-                    info->narSize};
-            } catch (InvalidPath) {
+
+        PathSet missing;
+        for (auto & path : paths)
+            if (!infos.count(path)) missing.insert(path);
+        if (missing.empty()) break;
+
+        debug(format("checking substituter '%s' for %d paths")
+            % sub->getUri() % missing.size());
+
+        /* Issue all lookups against this substituter at once, so
+           that .narinfo fetches are multiplexed over the connection
+           instead of paying a full round-trip per path. */
+        struct State
+        {
+            size_t left;
+            SubstitutablePathInfos infos;
+            std::exception_ptr exc;
+        };
+
+        Sync<State> state_(State{missing.size(), {}, nullptr});
+        std::condition_variable wakeup;
+
+        for (auto & path : missing) {
+            sub->queryPathInfo(path,
+                [&, path](ref<const ValidPathInfo> info) {
+                    auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
+                        std::shared_ptr<const ValidPathInfo>(info));
+                    auto state(state_.lock());
+                    state->infos[path] = SubstitutablePathInfo{
+                        info->deriver,
+                        info->references,
+                        narInfo ? narInfo->fileSize : 0,
+                        info->narSize};
+                    if (!--state->left) wakeup.notify_one();
+                },
+                [&, path](std::exception_ptr exc) {
+                    auto state(state_.lock());
+                    try {
+                        std::rethrow_exception(exc);
+                    } catch (InvalidPath &) {
+                    } catch (...) {
+                        if (!state->exc) state->exc = exc;
+                    }
+                    if (!--state->left) wakeup.notify_one();
+                });
+        }
+
+        while (true) {
+            auto state(state_.lock());
+            if (!state->left) {
+                if (state->exc) std::rethrow_exception(state->exc);
+                for (auto & i : state->infos)
+                    infos.insert(i);
+                break;
             }
+            state.wait(wakeup);
         }
     }
 }
 
 
+/* Recompute and store the closure columns of the path with the given
+   id.  Expects all of the path's (transitive) references to be
+   present in the database. */
+void LocalStore::updateClosureSize(State & state, uint64_t id)
+{
+    auto use(state.stmtComputeClosureSize.use()((int64_t) id));
+    if (!use.next()) return;
+    state.stmtUpdateClosureSize.use()
+        (use.getInt(0))
+        (use.getInt(1))
+        ((int64_t) id).exec();
+}
+
+
+std::map<Path, std::pair<uint64_t, uint64_t>> LocalStore::getClosureSizes(const PathSet & storePaths)
+{
+    return retrySQLite<std::map<Path, std::pair<uint64_t, uint64_t>>>([&]() {
+        auto state(_state.lock());
+
+        std::map<Path, std::pair<uint64_t, uint64_t>> res;
+
+        for (auto & path : storePaths) {
+            assertStorePath(path);
+            auto id = queryValidPathId(*state, path);
+
+            auto use(state->stmtQueryClosureSize.use()((int64_t) id));
+            if (use.next() && !use.isNull(0)) {
+                res[path] = {(uint64_t) use.getInt(0), 0};
+                continue;
+            }
+
+            /* Row predates the closureSize column: compute it now
+               and try to backfill, so the walk happens at most once
+               per path.  The update may fail if the database is not
+               writable by us; the computed value is still used. */
+            auto use2(state->stmtComputeClosureSize.use()((int64_t) id));
+            if (!use2.next()) continue;
+            res[path] = {(uint64_t) use2.getInt(0), 0};
+            try {
+                state->stmtUpdateClosureSize.use()
+                    (use2.getInt(0))
+                    (use2.getInt(1))
+                    ((int64_t) id).exec();
+            } catch (SQLiteError &) {
+            }
+        }
+
+        return res;
+    });
+}
+
+
+void LocalStore::addBuildMetrics(const Path & drvPath, const BuildMetrics & metrics)
+{
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        state->stmtAddBuildMetrics.use()
+            (drvPath)
+            ((int64_t) metrics.startTime)
+            ((int64_t) metrics.duration)
+            ((int64_t) metrics.cpuUser)
+            ((int64_t) metrics.cpuSystem)
+            ((int64_t) metrics.peakRSS)
+            ((int64_t) metrics.outputSize)
+            .exec();
+    });
+}
+
+
+std::vector<LocalStore::BuildMetrics> LocalStore::queryBuildMetrics(const Path & drvPath)
+{
+    return retrySQLite<std::vector<BuildMetrics>>([&]() {
+        auto state(_state.lock());
+
+        std::vector<BuildMetrics> res;
+
+        auto use(state->stmtQueryBuildMetrics.use()(drvPath));
+        while (use.next()) {
+            BuildMetrics metrics;
+            metrics.startTime = use.getInt(0);
+            metrics.duration = use.getInt(1);
+            metrics.cpuUser = use.isNull(2) ? 0 : use.getInt(2);
+            metrics.cpuSystem = use.isNull(3) ? 0 : use.getInt(3);
+            metrics.peakRSS = use.isNull(4) ? 0 : use.getInt(4);
+            metrics.outputSize = use.isNull(5) ? 0 : use.getInt(5);
+            res.push_back(metrics);
+        }
+
+        return res;
+    });
+}
+
+
+void LocalStore::addDeterminismCheck(const Path & drvPath, const DeterminismCheck & check)
+{
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        state->stmtAddDeterminismCheck.use()
+            (drvPath)
+            ((int64_t) check.checkTime)
+            (check.deterministic ? 1 : 0)
+            (check.diff, !check.diff.empty())
+            .exec();
+    });
+}
+
+
+std::vector<LocalStore::DeterminismCheck> LocalStore::queryDeterminismChecks(const Path & drvPath)
+{
+    return retrySQLite<std::vector<DeterminismCheck>>([&]() {
+        auto state(_state.lock());
+
+        std::vector<DeterminismCheck> res;
+
+        auto use(state->stmtQueryDeterminismChecks.use()(drvPath));
+        while (use.next()) {
+            DeterminismCheck check;
+            check.checkTime = use.getInt(0);
+            check.deterministic = use.getInt(1) != 0;
+            check.diff = use.isNull(2) ? "" : use.getStr(2);
+            res.push_back(check);
+        }
+
+        return res;
+    });
+}
+
+
 void LocalStore::registerValidPath(const ValidPathInfo & info)
 {
     ValidPathInfos infos;
@@ -895,19 +1379,30 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
         SQLiteTxn txn(state->db);
         PathSet paths;
 
+        /* Remember the id of each path in the batch, so that the
+           reference insertion below doesn't have to look them all up
+           again. */
+        std::map<Path, uint64_t> pathToId;
+
         for (auto & i : infos) {
             assert(i.narHash.type == htSHA256);
-            if (isValidPath_(*state, i.path))
+            if (isValidPath_(*state, i.path)) {
                 updatePathInfo(*state, i);
-            else
-                addValidPath(*state, i, false);
+                pathToId[i.path] = queryValidPathId(*state, i.path);
+            } else
+                pathToId[i.path] = addValidPath(*state, i, false);
             paths.insert(i.path);
         }
 
+        auto lookupId = [&](const Path & path) {
+            auto j = pathToId.find(path);
+            return j != pathToId.end() ? j->second : queryValidPathId(*state, path);
+        };
+
         for (auto & i : infos) {
-            auto referrer = queryValidPathId(*state, i.path);
+            auto referrer = pathToId[i.path];
             for (auto & j : i.references)
-                state->stmtAddReference.use()(referrer)(queryValidPathId(*state, j)).exec();
+                state->stmtAddReference.use()(referrer)(lookupId(j)).exec();
         }
 
         /* Check that the derivation outputs are correct.  We can't do
@@ -921,6 +1416,13 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
                 checkDerivationOutputs(i.path, drv);
             }
 
+        /* Maintain the materialized closure columns.  This has to
+           run after all references in the batch are in place.  Since
+           a path's references never change once registered, the
+           stored values stay correct for the lifetime of the row. */
+        for (auto & i : infos)
+            updateClosureSize(*state, pathToId[i.path]);
+
         /* Do a topological sort of the paths.  This will throw an
            error if a cycle is detected and roll back the
            transaction.  Cycles can only occur when a derivation
@@ -1001,8 +1503,81 @@ void LocalStore::addToStore(const ValidPathInfo & info, const ref<std::string> &
 }
 
 
+void LocalStore::addToStore(const ValidPathInfo & info, Source & narSource,
+    RepairFlag repair, CheckSigsFlag checkSigs, std::shared_ptr<FSAccessor> accessor)
+{
+    assert(info.narHash);
+
+    if (requireSigs && checkSigs && !info.checkSignatures(*this, publicKeys))
+        throw Error("cannot add path '%s' because it lacks a valid signature", info.path);
+
+    addTempRoot(info.path);
+
+    if (repair || !isValidPath(info.path)) {
+
+        PathLocks outputLock;
+
+        Path realPath = realStoreDir + "/" + baseNameOf(info.path);
+
+        /* Lock the output path.  But don't lock if we're being called
+           from a build hook (whose parent process already acquired a
+           lock on this path). */
+        Strings locksHeld = tokenizeString<Strings>(getEnv("NIX_HELD_LOCKS"));
+        if (find(locksHeld.begin(), locksHeld.end(), info.path) == locksHeld.end())
+            outputLock.lockPaths({realPath});
+
+        if (repair || !isValidPath(info.path)) {
+
+            deletePath(realPath);
+
+            /* Restore the path while computing the NAR hash on the
+               fly, so that the NAR never has to be held in memory.
+               The path is not registered until the hash has been
+               verified. */
+            struct HashingSource : Source
+            {
+                Source & inner;
+                HashSink hashSink;
+                HashingSource(Source & inner) : inner(inner), hashSink(htSHA256) { }
+                size_t read(unsigned char * data, size_t len) override
+                {
+                    size_t n = inner.read(data, len);
+                    hashSink(data, n);
+                    return n;
+                }
+            };
+
+            HashingSource source(narSource);
+            restorePath(realPath, source);
+
+            auto hashResult = source.hashSink.finish();
+
+            if (hashResult.first != info.narHash) {
+                deletePath(realPath);
+                throw Error("hash mismatch importing path '%s'; expected hash '%s', got '%s'",
+                    info.path, info.narHash.to_string(), hashResult.first.to_string());
+            }
+
+            if (hashResult.second != info.narSize) {
+                deletePath(realPath);
+                throw Error("size mismatch importing path '%s'; expected %s, got %s",
+                    info.path, info.narSize, hashResult.second);
+            }
+
+            canonicalisePathMetaData(realPath, -1);
+
+            optimisePath(realPath); // FIXME: combine with hashPath()
+
+            registerValidPath(info);
+        }
+
+        outputLock.setDeletion(true);
+    }
+}
+
+
 Path LocalStore::addToStoreFromDump(const string & dump, const string & name,
-    bool recursive, HashType hashAlgo, RepairFlag repair)
+    bool recursive, HashType hashAlgo, RepairFlag repair, const Path & srcPath)
 {
     Hash h = hashString(hashAlgo, dump);
 
@@ -1026,8 +1601,24 @@ Path LocalStore::addToStoreFromDump(const string & dump, const string & name,
             if (recursive) {
                 StringSource source(dump);
                 restorePath(realPath, source);
-            } else
-                writeFile(realPath, dump);
+            } else {
+                /* If the data came from a local file, try to reflink
+                   it into the store so the copy shares extents with
+                   the original.  Cloning snapshots the contents, so
+                   re-hashing the clone suffices to detect a source
+                   that was modified after being read above; in that
+                   case (or on filesystems that can't clone) we fall
+                   back to an ordinary write. */
+                bool cloned = false;
+                if (srcPath != "" && cloneFile(srcPath, realPath)) {
+                    if (hashFile(hashAlgo, realPath) == h)
+                        cloned = true;
+                    else
+                        deletePath(realPath);
+                }
+                if (!cloned)
+                    writeFile(realPath, dump);
+            }
 
             canonicalisePathMetaData(realPath, -1);
 
@@ -1073,7 +1664,8 @@ Path LocalStore::addToStore(const string & name, const Path & _srcPath,
     else
         sink.s = make_ref<std::string>(readFile(srcPath));
 
-    return addToStoreFromDump(*sink.s, name, recursive, hashAlgo, repair);
+    return addToStoreFromDump(*sink.s, name, recursive, hashAlgo, repair,
+        recursive ? "" : srcPath);
 }
 
 
@@ -1184,13 +1776,42 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
        take ages) doesn't block the GC or builds. */
     fdGCLock = -1;
 
-    /* Optionally, check the content hashes (slow). */
+    /* Optionally, check the content hashes (slow).  Hashing is
+       independent per path, so it runs on a thread pool; repairs are
+       collected and done serially afterwards, since repairPath()
+       drives the whole build/substitution machinery. */
     if (checkContents) {
         printInfo("checking hashes...");
 
         Hash nullHash(htSHA256);
 
+        std::atomic<bool> errors2{false};
+        Sync<PathSet> toRepair;
+        Sync<std::vector<ValidPathInfo>> updates_;
+
+        /* Hash the biggest paths first.  The pool hands out work in
+           queue order, so this keeps a multi-gigabyte path from being
+           started last and leaving a single worker grinding away long
+           after the others have finished. */
+        std::vector<std::pair<uint64_t, Path>> order;
+        order.reserve(validPaths.size());
         for (auto & i : validPaths) {
+            uint64_t narSize = 0;
+            try {
+                narSize = queryPathInfo(i)->narSize;
+            } catch (Error &) { }
+            order.emplace_back(narSize, i);
+        }
+        std::sort(order.begin(), order.end(),
+            [](const std::pair<uint64_t, Path> & a, const std::pair<uint64_t, Path> & b) {
+                return a.first > b.first;
+            });
+
+        ThreadPool pool;
+
+        for (auto & o : order) {
+            auto & i = o.second;
+            pool.enqueue([&, i]() {
             try {
                 auto info = std::const_pointer_cast<ValidPathInfo>(std::shared_ptr<const ValidPathInfo>(queryPathInfo(i)));
 
@@ -1202,7 +1823,7 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
                     printError(format("path '%1%' was modified! "
                             "expected hash '%2%', got '%3%'")
                         % i % info->narHash.to_string() % current.first.to_string());
-                    if (repair) repairPath(i); else errors = true;
+                    if (repair) toRepair.lock()->insert(i); else errors2 = true;
                 } else {
 
                     bool update = false;
@@ -1221,10 +1842,8 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
                         update = true;
                     }
 
-                    if (update) {
-                        auto state(_state.lock());
-                        updatePathInfo(*state, *info);
-                    }
+                    if (update)
+                        updates_.lock()->push_back(*info);
 
                 }
 
@@ -1235,9 +1854,31 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
                     printError(format("error: %1%") % e.msg());
                 else
                     printError(format("warning: %1%") % e.msg());
-                errors = true;
+                errors2 = true;
             }
+            });
+        }
+
+        pool.process();
+
+        /* Apply the collected metadata fixes in a single transaction,
+           rather than paying for one commit (and fsync) per path. */
+        {
+            auto updates(updates_.lock());
+            if (!updates->empty())
+                retrySQLite<void>([&]() {
+                    auto state(_state.lock());
+                    SQLiteTxn txn(state->db);
+                    for (auto & info : *updates)
+                        updatePathInfo(*state, info);
+                    txn.commit();
+                });
         }
+
+        for (auto & i : *toRepair.lock())
+            repairPath(i);
+
+        if (errors2) errors = true;
     }
 
     return errors;
@@ -1371,6 +2012,30 @@ void LocalStore::addSignatures(const Path & storePath, const StringSet & sigs)
 }
 
 
+void LocalStore::addSignatures(const std::map<Path, StringSet> & pathSigs)
+{
+    /* Assemble the updated infos before taking the state lock, since
+       queryPathInfo() may have to hit the database itself. */
+    std::vector<ValidPathInfo> infos;
+    for (auto & i : pathSigs) {
+        auto info(*queryPathInfo(i.first));
+        info.sigs.insert(i.second.begin(), i.second.end());
+        infos.push_back(std::move(info));
+    }
+
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+
+        SQLiteTxn txn(state->db);
+
+        for (auto & info : infos)
+            updatePathInfo(*state, info);
+
+        txn.commit();
+    });
+}
+
+
 void LocalStore::signPathInfo(ValidPathInfo & info)
 {
     // FIXME: keep secret keys in memory.
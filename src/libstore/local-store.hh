@@ -3,11 +3,15 @@
 #include "sqlite.hh"
 
 #include "pathlocks.hh"
+#include "pool.hh"
 #include "store-api.hh"
 #include "sync.hh"
 #include "util.hh"
 
+#include <atomic>
+#include <condition_variable>
 #include <string>
+#include <thread>
 #include <unordered_set>
 
 
@@ -18,7 +22,7 @@ namespace nix {
    0.7.  Version 2 was Nix 0.8 and 0.9.  Version 3 is Nix 0.10.
    Version 4 is Nix 0.11.  Version 5 is Nix 0.12-0.16.  Version 6 is
    Nix 1.0.  Version 7 is Nix 1.3. Version 10 is 1.12. */
-const int nixSchemaVersion = 10;
+const int nixSchemaVersion = 13;
 
 
 struct Derivation;
@@ -26,9 +30,9 @@ struct Derivation;
 
 struct OptimiseStats
 {
-    unsigned long filesLinked = 0;
-    unsigned long long bytesFreed = 0;
-    unsigned long long blocksFreed = 0;
+    std::atomic<unsigned long> filesLinked{0};
+    std::atomic<unsigned long long> bytesFreed{0};
+    std::atomic<unsigned long long> blocksFreed{0};
 };
 
 
@@ -57,6 +61,13 @@ private:
         SQLiteStmt stmtQueryDerivationOutputs;
         SQLiteStmt stmtQueryPathFromHashPart;
         SQLiteStmt stmtQueryValidPaths;
+        SQLiteStmt stmtQueryClosureSize;
+        SQLiteStmt stmtComputeClosureSize;
+        SQLiteStmt stmtUpdateClosureSize;
+        SQLiteStmt stmtAddBuildMetrics;
+        SQLiteStmt stmtQueryBuildMetrics;
+        SQLiteStmt stmtAddDeterminismCheck;
+        SQLiteStmt stmtQueryDeterminismChecks;
 
         /* The file to which we write our temporary roots. */
         Path fnTempRoots;
@@ -65,6 +76,34 @@ private:
 
     Sync<State, std::recursive_mutex> _state;
 
+    /* A read-only connection with its own prepared statements.  In
+       WAL mode readers don't block the writer, so path info queries
+       can be answered from a pool of these instead of convoying on
+       the _state lock of the main connection. */
+    struct ReadConn
+    {
+        SQLite db;
+        SQLiteStmt stmtQueryPathInfo;
+        SQLiteStmt stmtQueryReferences;
+    };
+
+    std::shared_ptr<Pool<ReadConn>> readConns;
+
+    /* Background WAL checkpointer.  It runs on a connection of its
+       own, so checkpoints happen during idle moments instead of in
+       the context of whichever writer happens to push the log over
+       the auto-checkpoint threshold. */
+    struct CheckpointState
+    {
+        bool quit = false;
+    };
+
+    Sync<CheckpointState> checkpointState_;
+
+    std::condition_variable checkpointWakeup;
+
+    std::thread checkpointThread;
+
 public:
 
     PathSetting realStoreDir_;
@@ -109,6 +148,13 @@ public:
 
     void queryReferrers(const Path & path, PathSet & referrers) override;
 
+    /* Overridden to walk the Refs table directly for plain referrer
+       closures. */
+    using Store::computeFSClosure;
+    void computeFSClosure(const PathSet & paths, PathSet & out,
+        bool flipDirection = false, bool includeOutputs = false,
+        bool includeDerivers = false) override;
+
     PathSet queryValidDerivers(const Path & path) override;
 
     PathSet queryDerivationOutputs(const Path & path) override;
@@ -126,6 +172,10 @@ public:
         RepairFlag repair, CheckSigsFlag checkSigs,
         std::shared_ptr<FSAccessor> accessor) override;
 
+    void addToStore(const ValidPathInfo & info, Source & narSource,
+        RepairFlag repair, CheckSigsFlag checkSigs,
+        std::shared_ptr<FSAccessor> accessor) override;
+
     Path addToStore(const string & name, const Path & srcPath,
         bool recursive, HashType hashAlgo,
         PathFilter & filter, RepairFlag repair) override;
@@ -135,7 +185,8 @@ public:
        true) or simply the contents of a regular file (if recursive ==
        false). */
     Path addToStoreFromDump(const string & dump, const string & name,
-        bool recursive = true, HashType hashAlgo = htSHA256, RepairFlag repair = NoRepair);
+        bool recursive = true, HashType hashAlgo = htSHA256, RepairFlag repair = NoRepair,
+        const Path & srcPath = "");
 
     Path addTextToStore(const string & name, const string & s,
         const PathSet & references, RepairFlag repair) override;
@@ -195,12 +246,49 @@ public:
 
     void addSignatures(const Path & storePath, const StringSet & sigs) override;
 
+    void addSignatures(const std::map<Path, StringSet> & pathSigs) override;
+
+    std::map<Path, std::pair<uint64_t, uint64_t>> getClosureSizes(
+        const PathSet & storePaths) override;
+
+    /* A per-build performance record, as stored in the BuildMetrics
+       table. */
+    struct BuildMetrics
+    {
+        time_t startTime;
+        uint64_t duration; /* seconds */
+        uint64_t cpuUser, cpuSystem; /* milliseconds */
+        uint64_t peakRSS; /* KiB */
+        uint64_t outputSize; /* bytes */
+    };
+
+    void addBuildMetrics(const Path & drvPath, const BuildMetrics & metrics);
+
+    std::vector<BuildMetrics> queryBuildMetrics(const Path & drvPath);
+
+    /* Outcome of a determinism check build, as stored in the
+       DeterminismChecks table. */
+    struct DeterminismCheck
+    {
+        time_t checkTime;
+        bool deterministic;
+        std::string diff; /* file-level differences, one per line */
+    };
+
+    void addDeterminismCheck(const Path & drvPath, const DeterminismCheck & check);
+
+    std::vector<DeterminismCheck> queryDeterminismChecks(const Path & drvPath);
+
 private:
 
     int getSchema();
 
     void openDB(State & state, bool create);
 
+    ref<ReadConn> openReadConn();
+
+    void runCheckpointThread();
+
     void makeStoreWritable();
 
     uint64_t queryValidPathId(State & state, const Path & path);
@@ -217,6 +305,8 @@ private:
 
     void updatePathInfo(State & state, const ValidPathInfo & info);
 
+    void updateClosureSize(State & state, uint64_t id);
+
     void upgradeStore6();
     void upgradeStore7();
     PathSet queryValidPathsOld();
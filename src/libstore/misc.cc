@@ -238,6 +238,34 @@ void Store::queryMissing(const PathSet & targets,
 
 Paths Store::topoSortPaths(const PathSet & paths)
 {
+    /* Warm the path info cache for the whole set in parallel, so
+       that the depth-first search below works from memory instead of
+       issuing a synchronous reference query per path.  Errors are
+       ignored here; the search deals with invalid paths itself. */
+    {
+        struct State
+        {
+            size_t left;
+            std::exception_ptr exc;
+        };
+        Sync<State> state_(State{paths.size(), nullptr});
+        std::condition_variable done;
+
+        for (auto & path : paths)
+            queryPathInfo(path,
+                [&](ref<ValidPathInfo> info) {
+                    auto state(state_.lock());
+                    if (!--state->left) done.notify_one();
+                },
+                [&](std::exception_ptr exc) {
+                    auto state(state_.lock());
+                    if (!--state->left) done.notify_one();
+                });
+
+        auto state(state_.lock());
+        while (state->left) state.wait(done);
+    }
+
     Paths sorted;
     PathSet visited, parents;
 
@@ -1,5 +1,6 @@
 #include "nar-accessor.hh"
 #include "archive.hh"
+#include "json.hh"
 
 #include <map>
 #include <stack>
@@ -140,8 +141,8 @@ struct NarAccessor : public FSAccessor
     {
         auto i = indexer.find(path);
         if (i == nullptr)
-            return {FSAccessor::Type::tMissing, 0, false};
-        return {i->type, i->size, i->isExecutable};
+            return {FSAccessor::Type::tMissing, 0, false, 0};
+        return {i->type, i->size, i->isExecutable, i->start};
     }
 
     StringSet readDirectory(const Path & path) override
@@ -181,4 +182,46 @@ ref<FSAccessor> makeNarAccessor(ref<const std::string> nar)
     return make_ref<NarAccessor>(nar);
 }
 
+static void listNar(JSONPlaceholder & res, NarMember & member)
+{
+    auto obj = res.object();
+
+    switch (member.type) {
+    case FSAccessor::Type::tRegular:
+        obj.attr("type", "regular");
+        obj.attr("size", member.size);
+        if (member.isExecutable)
+            obj.attr("executable", true);
+        /* Position of the file's contents within the (uncompressed)
+           NAR, so that clients can fetch it with a single range
+           request. */
+        if (member.start)
+            obj.attr("narOffset", member.start);
+        break;
+    case FSAccessor::Type::tDirectory:
+        obj.attr("type", "directory");
+        {
+            auto res2 = obj.object("entries");
+            for (auto & child : member.children) {
+                auto res3 = res2.placeholder(child.first);
+                listNar(res3, child.second);
+            }
+        }
+        break;
+    case FSAccessor::Type::tSymlink:
+        obj.attr("type", "symlink");
+        obj.attr("target", member.target);
+        break;
+    default:
+        abort();
+    }
+}
+
+void listNar(JSONPlaceholder & res, ref<FSAccessor> accessor)
+{
+    auto narAccessor = accessor.dynamic_pointer_cast<NarAccessor>();
+    assert(narAccessor);
+    listNar(res, narAccessor->indexer.root);
+}
+
 }
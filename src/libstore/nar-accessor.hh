@@ -4,8 +4,15 @@
 
 namespace nix {
 
+class JSONPlaceholder;
+
 /* Return an object that provides access to the contents of a NAR
    file. */
 ref<FSAccessor> makeNarAccessor(ref<const std::string> nar);
 
+/* Write a JSON representation of the contents of a NAR (as produced
+   by makeNarAccessor()) to 'res'.  The in-memory index is walked
+   directly, so no per-entry path resolution takes place. */
+void listNar(JSONPlaceholder & res, ref<FSAccessor> accessor);
+
 }
@@ -54,6 +54,11 @@ public:
     /* How often to purge expired entries from the cache. */
     const int purgeInterval = 24 * 3600;
 
+    /* Write-back tuning: flush pending upserts to SQLite once this
+       many have accumulated, or once the batch is this old. */
+    const size_t maxPending = 1024;
+    const int flushInterval = 60;
+
     struct Cache
     {
         int id;
@@ -62,11 +67,24 @@ public:
         int priority;
     };
 
+    /* A not-yet-flushed upsert; a null info is a negative entry. */
+    struct PendingNAR
+    {
+        std::shared_ptr<ValidPathInfo> info;
+        time_t timestamp;
+    };
+
     struct State
     {
         SQLite db;
         SQLiteStmt insertCache, queryCache, insertNAR, insertMissingNAR, queryNAR, purgeCache;
         std::map<std::string, Cache> caches;
+
+        /* Write-back tier, keyed by (cache id, hash part).  Lookups
+           consult this before the database; entries are written out
+           in one transaction per batch instead of one per narinfo. */
+        std::map<std::pair<int, std::string>, PendingNAR> pending;
+        time_t lastFlush = time(0);
     };
 
     Sync<State> _state;
@@ -129,6 +147,64 @@ public:
         });
     }
 
+    ~NarInfoDiskCacheImpl()
+    {
+        try {
+            auto state(_state.lock());
+            flushPending(*state);
+        } catch (...) {
+            ignoreException();
+        }
+    }
+
+    /* Write all pending upserts in a single transaction.  Must be
+       called with the state lock held. */
+    void flushPending(State & state)
+    {
+        if (state.pending.empty()) return;
+
+        SQLiteTxn txn(state.db);
+
+        for (auto & i : state.pending) {
+            auto cacheId = i.first.first;
+            auto & hashPart = i.first.second;
+            auto & p = i.second;
+
+            if (p.info) {
+
+                auto narInfo = std::dynamic_pointer_cast<NarInfo>(p.info);
+
+                state.insertNAR.use()
+                    (cacheId)
+                    (hashPart)
+                    (storePathToName(p.info->path))
+                    (narInfo ? narInfo->url : "", narInfo != 0)
+                    (narInfo ? narInfo->compression : "", narInfo != 0)
+                    (narInfo && narInfo->fileHash ? narInfo->fileHash.to_string() : "", narInfo && narInfo->fileHash)
+                    (narInfo ? narInfo->fileSize : 0, narInfo != 0 && narInfo->fileSize)
+                    (p.info->narHash.to_string())
+                    (p.info->narSize)
+                    (concatStringsSep(" ", p.info->shortRefs()))
+                    (p.info->deriver != "" ? baseNameOf(p.info->deriver) : "", p.info->deriver != "")
+                    (concatStringsSep(" ", p.info->sigs))
+                    (p.timestamp).exec();
+
+            } else {
+                state.insertMissingNAR.use()
+                    (cacheId)
+                    (hashPart)
+                    (p.timestamp).exec();
+            }
+        }
+
+        txn.commit();
+
+        debug("flushed %d narinfo entries to the disk cache", state.pending.size());
+
+        state.pending.clear();
+        state.lastFlush = time(0);
+    }
+
     Cache & getCache(State & state, const std::string & uri)
     {
         auto i = state.caches.find(uri);
@@ -173,25 +249,53 @@ public:
     }
 
     std::pair<Outcome, std::shared_ptr<NarInfo>> lookupNarInfo(
-        const std::string & uri, const std::string & hashPart) override
+        const std::string & uri, const std::string & hashPart,
+        bool * refreshAhead) override
     {
+        if (refreshAhead) *refreshAhead = false;
+
         return retrySQLite<std::pair<Outcome, std::shared_ptr<NarInfo>>>(
             [&]() -> std::pair<Outcome, std::shared_ptr<NarInfo>> {
             auto state(_state.lock());
 
             auto & cache(getCache(*state, uri));
 
+            /* Serve upserts that haven't hit the database yet. */
+            auto p = state->pending.find({cache.id, hashPart});
+            if (p != state->pending.end()) {
+                if (!p->second.info) return {oInvalid, 0};
+                auto narInfo = std::dynamic_pointer_cast<NarInfo>(p->second.info);
+                if (!narInfo)
+                    narInfo = std::make_shared<NarInfo>(*p->second.info);
+                return {oValid, narInfo};
+            }
+
             auto now = time(0);
 
+            /* Shorten the TTLs by a deterministic per-entry jitter of
+               up to 10%, so that entries inserted together (e.g. a
+               whole closure) don't all expire in the same instant
+               across a fleet of machines with identical caches. */
+            unsigned int h = 0;
+            for (char c : hashPart) h = h * 31 + c;
+            int ttlNeg = ttlNegative - h % (ttlNegative / 10);
+            int ttlPos = ttlPositive - h % (ttlPositive / 10);
+
             auto queryNAR(state->queryNAR.use()
                 (cache.id)
                 (hashPart)
-                (now - ttlNegative)
-                (now - ttlPositive));
+                (now - ttlNeg)
+                (now - ttlPos));
 
             if (!queryNAR.next())
                 return {oUnknown, 0};
 
+            /* Flag entries in the last tenth of their TTL, so the
+               caller can revalidate them before they fall off the
+               cliff. */
+            if (refreshAhead && queryNAR.getInt(12) < now - (ttlPos - ttlPos / 10))
+                *refreshAhead = true;
+
             if (!queryNAR.getInt(13))
                 return {oInvalid, 0};
 
@@ -227,33 +331,14 @@ public:
 
             auto & cache(getCache(*state, uri));
 
-            if (info) {
-
-                auto narInfo = std::dynamic_pointer_cast<NarInfo>(info);
-
+            if (info)
                 assert(hashPart == storePathToHash(info->path));
 
-                state->insertNAR.use()
-                    (cache.id)
-                    (hashPart)
-                    (storePathToName(info->path))
-                    (narInfo ? narInfo->url : "", narInfo != 0)
-                    (narInfo ? narInfo->compression : "", narInfo != 0)
-                    (narInfo && narInfo->fileHash ? narInfo->fileHash.to_string() : "", narInfo && narInfo->fileHash)
-                    (narInfo ? narInfo->fileSize : 0, narInfo != 0 && narInfo->fileSize)
-                    (info->narHash.to_string())
-                    (info->narSize)
-                    (concatStringsSep(" ", info->shortRefs()))
-                    (info->deriver != "" ? baseNameOf(info->deriver) : "", info->deriver != "")
-                    (concatStringsSep(" ", info->sigs))
-                    (time(0)).exec();
+            state->pending[{cache.id, hashPart}] = PendingNAR{info, time(0)};
 
-            } else {
-                state->insertMissingNAR.use()
-                    (cache.id)
-                    (hashPart)
-                    (time(0)).exec();
-            }
+            if (state->pending.size() >= maxPending
+                || time(0) - state->lastFlush > flushInterval)
+                flushPending(*state);
         });
     }
 };
@@ -16,8 +16,13 @@ public:
     virtual bool cacheExists(const std::string & uri,
         bool & wantMassQuery, int & priority) = 0;
 
+    /* If 'refreshAhead' is non-null, it is set to true when the
+       returned entry is valid but nearing the end of its TTL; the
+       caller may then revalidate it in the background while
+       continuing to serve the cached value. */
     virtual std::pair<Outcome, std::shared_ptr<NarInfo>> lookupNarInfo(
-        const std::string & uri, const std::string & hashPart) = 0;
+        const std::string & uri, const std::string & hashPart,
+        bool * refreshAhead = nullptr) = 0;
 
     virtual void upsertNarInfo(
         const std::string & uri, const std::string & hashPart,
@@ -1,6 +1,7 @@
 #include "util.hh"
 #include "local-store.hh"
 #include "globals.hh"
+#include "thread-pool.hh"
 
 #include <cstdlib>
 #include <cstring>
@@ -9,12 +10,18 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
+#include <mutex>
 #include <regex>
 
 
 namespace nix {
 
 
+/* The inode hash is shared between the worker threads of
+   optimiseStore(), so accesses to it must be serialised. */
+static std::mutex inodeHashMutex;
+
+
 static void makeWritable(const Path & path)
 {
     struct stat st;
@@ -74,9 +81,12 @@ Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, const InodeHa
     while (errno = 0, dirent = readdir(dir.get())) { /* sic */
         checkInterrupt();
 
-        if (inodeHash.count(dirent->d_ino)) {
-            debug(format("'%1%' is already linked") % dirent->d_name);
-            continue;
+        {
+            std::lock_guard<std::mutex> lock(inodeHashMutex);
+            if (inodeHash.count(dirent->d_ino)) {
+                debug(format("'%1%' is already linked") % dirent->d_name);
+                continue;
+            }
         }
 
         string name = dirent->d_name;
@@ -136,9 +146,12 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
     }
 
     /* This can still happen on top-level files. */
-    if (st.st_nlink > 1 && inodeHash.count(st.st_ino)) {
-        debug(format("'%1%' is already linked, with %2% other file(s)") % path % (st.st_nlink - 2));
-        return;
+    if (st.st_nlink > 1) {
+        std::lock_guard<std::mutex> lock(inodeHashMutex);
+        if (inodeHash.count(st.st_ino)) {
+            debug(format("'%1%' is already linked, with %2% other file(s)") % path % (st.st_nlink - 2));
+            return;
+        }
     }
 
     /* Hash the file.  Note that hashPath() returns the hash over the
@@ -160,6 +173,7 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
     if (!pathExists(linkPath)) {
         /* Nope, create a hard link in the links directory. */
         if (link(path.c_str(), linkPath.c_str()) == 0) {
+            std::lock_guard<std::mutex> lock(inodeHashMutex);
             inodeHash.insert(st.st_ino);
             return;
         }
@@ -260,18 +274,27 @@ void LocalStore::optimiseStore(OptimiseStats & stats)
 
     act.progress(0, paths.size());
 
-    uint64_t done = 0;
+    std::atomic<uint64_t> done{0};
+
+    /* Hashing the files dominates the run time, so spread the paths
+       over a thread pool.  The link(2) dance below already copes with
+       concurrent optimisers (the EEXIST fall-through and the
+       corrupted-link retry exist because several processes may
+       optimise the same store), so worker threads need no further
+       coordination beyond the inode hash. */
+    ThreadPool pool;
 
     for (auto & i : paths) {
         addTempRoot(i);
         if (!isValidPath(i)) continue; /* path was GC'ed, probably */
-        {
-            Activity act(*logger, actUnknown, fmt("optimising path '%s'", i));
-            optimisePath_(&act, stats, realStoreDir + "/" + baseNameOf(i), inodeHash);
-        }
-        done++;
-        act.progress(done, paths.size());
+        pool.enqueue([&, i]() {
+            Activity act2(*logger, actUnknown, fmt("optimising path '%s'", i));
+            optimisePath_(&act2, stats, realStoreDir + "/" + baseNameOf(i), inodeHash);
+            act.progress(++done, paths.size());
+        });
     }
+
+    pool.process();
 }
 
 static string showBytes(unsigned long long bytes)
@@ -288,7 +311,7 @@ void LocalStore::optimiseStore()
     printInfo(
         format("%1% freed by hard-linking %2% files")
         % showBytes(stats.bytesFreed)
-        % stats.filesLinked);
+        % stats.filesLinked.load());
 }
 
 void LocalStore::optimisePath(const Path & path)
@@ -0,0 +1,253 @@
+#include "store-api.hh"
+#include "fs-accessor.hh"
+
+namespace nix {
+
+static std::string uriScheme = "overlay://";
+
+/* A store that composes a writable 'upper' store with a read-only
+   'lower' store sharing the same logical store directory.  Queries
+   are answered from the upper layer first and fall through to the
+   lower one; everything that writes, builds or collects garbage goes
+   to the upper layer only.  The intended use is a fleet of ephemeral
+   workers that mount one shared, page-cache-warm store read-only and
+   keep their own small writable store next to it.
+
+   Note that this class only composes the store *metadata*.  Making
+   the files of both layers visible under a single /nix/store — which
+   builders require — remains the job of whatever mounts the layers
+   (e.g. overlayfs); an OverlayStore neither needs nor checks such a
+   mount for pure query/copy workloads. */
+struct OverlayStore : public Store
+{
+    ref<Store> lower, upper;
+
+    OverlayStore(ref<Store> lower, ref<Store> upper, const Params & params)
+        : Store(params)
+        , lower(lower)
+        , upper(upper)
+    {
+        if (lower->storeDir != storeDir || upper->storeDir != storeDir)
+            throw Error("the layers of an overlay store must share its store directory");
+    }
+
+    std::string getUri() override
+    {
+        return uriScheme + "?lower=" + lower->getUri() + "&upper=" + upper->getUri();
+    }
+
+    /* True iff the path should be handled by the upper layer.  Paths
+       valid in neither layer belong to the upper one too, since
+       that's where they would be created. */
+    bool isUpper(const Path & path)
+    {
+        return upper->isValidPath(path) || !lower->isValidPath(path);
+    }
+
+    bool isValidPathUncached(const Path & path) override
+    {
+        return upper->isValidPath(path) || lower->isValidPath(path);
+    }
+
+    PathSet queryValidPaths(const PathSet & paths,
+        SubstituteFlag maybeSubstitute = NoSubstitute) override
+    {
+        auto res = lower->queryValidPaths(paths);
+        auto rest = upper->queryValidPaths(paths, maybeSubstitute);
+        res.insert(rest.begin(), rest.end());
+        return res;
+    }
+
+    PathSet queryAllValidPaths() override
+    {
+        auto res = lower->queryAllValidPaths();
+        auto rest = upper->queryAllValidPaths();
+        res.insert(rest.begin(), rest.end());
+        return res;
+    }
+
+    void queryPathInfoUncached(const Path & path,
+        std::function<void(std::shared_ptr<ValidPathInfo>)> success,
+        std::function<void(std::exception_ptr exc)> failure) override
+    {
+        sync2async<std::shared_ptr<ValidPathInfo>>(success, failure, [&]() -> std::shared_ptr<ValidPathInfo> {
+            try {
+                return std::make_shared<ValidPathInfo>(*upper->queryPathInfo(path));
+            } catch (InvalidPath &) {
+                return std::make_shared<ValidPathInfo>(*lower->queryPathInfo(path));
+            }
+        });
+    }
+
+    void queryReferrers(const Path & path, PathSet & referrers) override
+    {
+        lower->queryReferrers(path, referrers);
+        upper->queryReferrers(path, referrers);
+    }
+
+    PathSet queryValidDerivers(const Path & path) override
+    {
+        auto res = lower->queryValidDerivers(path);
+        auto rest = upper->queryValidDerivers(path);
+        res.insert(rest.begin(), rest.end());
+        return res;
+    }
+
+    PathSet queryDerivationOutputs(const Path & path) override
+    {
+        return isUpper(path)
+            ? upper->queryDerivationOutputs(path)
+            : lower->queryDerivationOutputs(path);
+    }
+
+    StringSet queryDerivationOutputNames(const Path & path) override
+    {
+        return isUpper(path)
+            ? upper->queryDerivationOutputNames(path)
+            : lower->queryDerivationOutputNames(path);
+    }
+
+    Path queryPathFromHashPart(const string & hashPart) override
+    {
+        auto res = upper->queryPathFromHashPart(hashPart);
+        return res != "" ? res : lower->queryPathFromHashPart(hashPart);
+    }
+
+    void addToStore(const ValidPathInfo & info, const ref<std::string> & nar,
+        RepairFlag repair, CheckSigsFlag checkSigs,
+        std::shared_ptr<FSAccessor> accessor) override
+    {
+        /* Paths already provided by the shared layer need not be
+           duplicated into the worker-local one. */
+        if (repair == NoRepair && lower->isValidPath(info.path)) return;
+        upper->addToStore(info, nar, repair, checkSigs, accessor);
+    }
+
+    Path addToStore(const string & name, const Path & srcPath,
+        bool recursive, HashType hashAlgo,
+        PathFilter & filter, RepairFlag repair) override
+    {
+        return upper->addToStore(name, srcPath, recursive, hashAlgo, filter, repair);
+    }
+
+    Path addTextToStore(const string & name, const string & s,
+        const PathSet & references, RepairFlag repair) override
+    {
+        return upper->addTextToStore(name, s, references, repair);
+    }
+
+    void narFromPath(const Path & path, Sink & sink) override
+    {
+        isUpper(path) ? upper->narFromPath(path, sink) : lower->narFromPath(path, sink);
+    }
+
+    void buildPaths(const PathSet & paths, BuildMode buildMode) override
+    {
+        upper->buildPaths(paths, buildMode);
+    }
+
+    BuildResult buildDerivation(const Path & drvPath, const BasicDerivation & drv,
+        BuildMode buildMode) override
+    {
+        return upper->buildDerivation(drvPath, drv, buildMode);
+    }
+
+    void ensurePath(const Path & path) override
+    {
+        if (lower->isValidPath(path)) return;
+        upper->ensurePath(path);
+    }
+
+    /* The shared layer is not garbage-collected by the workers, so
+       roots only matter for the upper one. */
+    void addTempRoot(const Path & path) override
+    {
+        if (upper->isValidPath(path)) upper->addTempRoot(path);
+    }
+
+    void addIndirectRoot(const Path & path) override
+    {
+        upper->addIndirectRoot(path);
+    }
+
+    Roots findRoots() override
+    {
+        return upper->findRoots();
+    }
+
+    void collectGarbage(const GCOptions & options, GCResults & results) override
+    {
+        upper->collectGarbage(options, results);
+    }
+
+    void addSignatures(const Path & storePath, const StringSet & sigs) override
+    {
+        if (!isUpper(storePath))
+            throw Error(format("cannot add signatures to path '%1%' in the read-only layer") % storePath);
+        upper->addSignatures(storePath, sigs);
+    }
+
+    ref<FSAccessor> getFSAccessor() override
+    {
+        struct OverlayAccessor : FSAccessor
+        {
+            OverlayStore & store;
+            ref<FSAccessor> lower, upper;
+
+            OverlayAccessor(OverlayStore & store)
+                : store(store)
+                , lower(store.lower->getFSAccessor())
+                , upper(store.upper->getFSAccessor())
+            { }
+
+            ref<FSAccessor> pick(const Path & path)
+            {
+                return store.isUpper(store.toStorePath(path)) ? upper : lower;
+            }
+
+            Stat stat(const Path & path) override
+            {
+                return pick(path)->stat(path);
+            }
+
+            StringSet readDirectory(const Path & path) override
+            {
+                return pick(path)->readDirectory(path);
+            }
+
+            std::string readFile(const Path & path) override
+            {
+                return pick(path)->readFile(path);
+            }
+
+            std::string readLink(const Path & path) override
+            {
+                return pick(path)->readLink(path);
+            }
+        };
+
+        return make_ref<OverlayAccessor>(*this);
+    }
+
+    void connect() override
+    {
+        lower->connect();
+        upper->connect();
+    }
+};
+
+
+static RegisterStoreImplementation regStore([](
+    const std::string & uri, const Store::Params & params)
+    -> std::shared_ptr<Store>
+{
+    if (std::string(uri, 0, uriScheme.size()) != uriScheme) return 0;
+    auto lowerUri = get(params, "lower", "");
+    auto upperUri = get(params, "upper", "");
+    if (lowerUri.empty() || upperUri.empty())
+        throw Error("an overlay store requires 'lower' and 'upper' parameters, e.g. 'overlay://?lower=/shared&upper=local'");
+    return std::make_shared<OverlayStore>(
+        openStore(lowerUri), openStore(upperUri), params);
+});
+
+}
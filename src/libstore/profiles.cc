@@ -35,7 +35,11 @@ static int parseName(const string & profileName, const string & name)
 
 
 
-Generations findGenerations(Path profile, int & curGen)
+/* Enumerate the generations of a profile.  The per-generation
+   lstat() is only done when the caller needs creation times; busy
+   profiles accumulate thousands of generations and most operations
+   only care about the numbers. */
+static Generations scanGenerations(const Path & profile, int & curGen, bool withTimes)
 {
     Generations gens;
 
@@ -48,10 +52,13 @@ Generations findGenerations(Path profile, int & curGen)
             Generation gen;
             gen.path = profileDir + "/" + i.name;
             gen.number = n;
-            struct stat st;
-            if (lstat(gen.path.c_str(), &st) != 0)
-                throw SysError(format("statting '%1%'") % gen.path);
-            gen.creationTime = st.st_mtime;
+            gen.creationTime = 0;
+            if (withTimes) {
+                struct stat st;
+                if (lstat(gen.path.c_str(), &st) != 0)
+                    throw SysError(format("statting '%1%'") % gen.path);
+                gen.creationTime = st.st_mtime;
+            }
             gens.push_back(gen);
         }
     }
@@ -66,6 +73,12 @@ Generations findGenerations(Path profile, int & curGen)
 }
 
 
+Generations findGenerations(Path profile, int & curGen)
+{
+    return scanGenerations(profile, curGen, true);
+}
+
+
 static void makeName(const Path & profile, unsigned int num,
     Path & outLink)
 {
@@ -77,29 +90,34 @@ static void makeName(const Path & profile, unsigned int num,
 Path createGeneration(ref<LocalFSStore> store, Path profile, Path outPath)
 {
     /* The new generation number should be higher than old the
-       previous ones. */
-    int dummy;
-    Generations gens = findGenerations(profile, dummy);
-
-    unsigned int num;
-    if (gens.size() > 0) {
-        Generation last = gens.back();
-
-        if (readLink(last.path) == outPath) {
-            /* We only create a new generation symlink if it differs
-               from the last one.
-
-               This helps keeping gratuitous installs/rebuilds from piling
-               up uncontrolled numbers of generations, cluttering up the
-               UI like grub. */
-            return last.path;
+       previous ones.  Only the highest existing number and its link
+       target are needed, so scan the directory names directly
+       instead of building the full generation list. */
+    Path profileDir = dirOf(profile);
+    string profileName = baseNameOf(profile);
+
+    int last = -1;
+    Path lastPath;
+    for (auto & i : readDirectory(profileDir)) {
+        int n = parseName(profileName, i.name);
+        if (n > last) {
+            last = n;
+            lastPath = profileDir + "/" + i.name;
         }
+    }
+
+    if (last != -1 && readLink(lastPath) == outPath) {
+        /* We only create a new generation symlink if it differs
+           from the last one.
 
-        num = gens.back().number;
-    } else {
-        num = 0;
+           This helps keeping gratuitous installs/rebuilds from piling
+           up uncontrolled numbers of generations, cluttering up the
+           UI like grub. */
+        return lastPath;
     }
 
+    unsigned int num = last == -1 ? 0 : last;
+
     /* Create the new generation.  Note that addPermRoot() blocks if
        the garbage collector is running to prevent the stuff we've
        built from moving from the temporary roots (which the GC knows)
@@ -146,7 +164,7 @@ void deleteGenerations(const Path & profile, const std::set<unsigned int> & gens
     lockProfile(lock, profile);
 
     int curGen;
-    Generations gens = findGenerations(profile, curGen);
+    Generations gens = scanGenerations(profile, curGen, false);
 
     if (gensToDelete.find(curGen) != gensToDelete.end())
         throw Error(format("cannot delete current generation of profile %1%'") % profile);
@@ -164,7 +182,7 @@ void deleteOldGenerations(const Path & profile, bool dryRun)
     lockProfile(lock, profile);
 
     int curGen;
-    Generations gens = findGenerations(profile, curGen);
+    Generations gens = scanGenerations(profile, curGen, false);
 
     for (auto & i : gens)
         if (i.number != curGen)
@@ -41,6 +41,7 @@ static void search(const unsigned char * s, unsigned int len,
                   % ref % i);
             seen.insert(ref);
             hashes.erase(ref);
+            if (hashes.empty()) return;
         }
         ++i;
     }
@@ -65,6 +66,10 @@ void RefScanSink::operator () (const unsigned char * data, size_t len)
 {
     hashSink(data, len);
 
+    /* Once all hashes have been found, the rest of the dump still
+       needs to be hashed, but no longer searched. */
+    if (hashes.empty()) return;
+
     /* It's possible that a reference spans the previous and current
        fragment, so search in the concatenation of the tail of the
        previous fragment and the start of the current fragment. */
@@ -4,9 +4,33 @@
 namespace nix {
 
 
-RemoteFSAccessor::RemoteFSAccessor(ref<Store> store)
+RemoteFSAccessor::RemoteFSAccessor(ref<Store> store, const Path & cacheDir)
     : store(store)
+    , cacheDir(cacheDir)
 {
+    if (cacheDir != "")
+        createDirs(cacheDir);
+}
+
+Path RemoteFSAccessor::makeCacheFile(const Path & storePath)
+{
+    assert(cacheDir != "");
+    return fmt("%s/%s.nar", cacheDir, storePathToHash(storePath));
+}
+
+void RemoteFSAccessor::addToCache(const Path & storePath, const std::string & nar,
+    ref<FSAccessor> narAccessor)
+{
+    nars.emplace(storePath, narAccessor);
+
+    if (cacheDir != "") {
+        try {
+            /* FIXME: do this asynchronously. */
+            writeFile(makeCacheFile(storePath), nar);
+        } catch (...) {
+            ignoreException();
+        }
+    }
 }
 
 std::pair<ref<FSAccessor>, Path> RemoteFSAccessor::fetch(const Path & path_)
@@ -22,11 +46,22 @@ std::pair<ref<FSAccessor>, Path> RemoteFSAccessor::fetch(const Path & path_)
     auto i = nars.find(storePath);
     if (i != nars.end()) return {i->second, restPath};
 
+    /* Try the on-disk NAR cache first, so that repeated inspection
+       of the same closure doesn't re-download the NAR every time. */
+    if (cacheDir != "") {
+        try {
+            auto nar = make_ref<std::string>(nix::readFile(makeCacheFile(storePath)));
+            auto accessor = makeNarAccessor(nar);
+            nars.emplace(storePath, accessor);
+            return {accessor, restPath};
+        } catch (SysError &) { }
+    }
+
     StringSink sink;
     store->narFromPath(storePath, sink);
 
     auto accessor = makeNarAccessor(sink.s);
-    nars.emplace(storePath, accessor);
+    addToCache(storePath, *sink.s, accessor);
     return {accessor, restPath};
 }
 
@@ -12,10 +12,20 @@ class RemoteFSAccessor : public FSAccessor
 
     std::map<Path, ref<FSAccessor>> nars;
 
+    Path cacheDir;
+
     std::pair<ref<FSAccessor>, Path> fetch(const Path & path_);
+
+    Path makeCacheFile(const Path & storePath);
+
 public:
 
-    RemoteFSAccessor(ref<Store> store);
+    RemoteFSAccessor(ref<Store> store, const Path & cacheDir = "");
+
+    /* Register a NAR (and an accessor for it) in the in-memory map
+       and, if a cache directory was given, on disk. */
+    void addToCache(const Path & storePath, const std::string & nar,
+        ref<FSAccessor> narAccessor);
 
     Stat stat(const Path & path) override;
 
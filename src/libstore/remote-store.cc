@@ -10,6 +10,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <errno.h>
@@ -39,6 +40,32 @@ template<class T> T readStorePaths(Store & store, Source & from)
 template PathSet readStorePaths(Store & store, Source & from);
 template Paths readStorePaths(Store & store, Source & from);
 
+#if defined(__linux__) && defined(__NR_memfd_create)
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+/* Copy a NAR into an anonymous memory-backed file that can be handed
+   to the daemon over the socket.  Returns an invalid fd if the kernel
+   does not support memfds. */
+static AutoCloseFD makeNarFd(const std::string & nar)
+{
+    AutoCloseFD fd((int) syscall(__NR_memfd_create, "nix-nar", MFD_CLOEXEC));
+    if (!fd) return fd;
+    writeFull(fd.get(), nar);
+#ifdef F_ADD_SEALS
+    /* Seal the file against resizing.  The contents are still
+       verified against the NAR hash on the daemon side, so a
+       malicious writer gains nothing. */
+    fcntl(fd.get(), F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE);
+#endif
+    return fd;
+}
+
+#endif
+
+
 /* TODO: Separate these store impls into different files, give them better names */
 RemoteStore::RemoteStore(const Params & params)
     : Store(params)
@@ -139,13 +166,19 @@ void RemoteStore::initConnection(Connection & conn)
         if (GET_PROTOCOL_MINOR(conn.daemonVersion) >= 11)
             conn.to << false;
 
+        /* Pipeline the initial option upload behind the rest of the
+           greeting.  The daemon consumes the two messages in order
+           from its buffered source, so one flush followed by reading
+           both acknowledgements costs a single round trip where the
+           greeting and wopSetOptions used to take one each. */
+        setOptions(conn);
+
+        conn.processStderr();
         conn.processStderr();
     }
     catch (Error & e) {
         throw Error("cannot open connection to remote store '%s': %s", getUri(), e.what());
     }
-
-    setOptions(conn);
 }
 
 
@@ -172,7 +205,8 @@ void RemoteStore::setOptions(Connection & conn)
             conn.to << i.first << i.second;
     }
 
-    conn.processStderr();
+    /* Note: the acknowledgement is read by initConnection(), after
+       the one for the greeting. */
 }
 
 
@@ -275,35 +309,46 @@ void RemoteStore::queryPathInfoUncached(const Path & path,
     std::function<void(std::shared_ptr<ValidPathInfo>)> success,
     std::function<void(std::exception_ptr exc)> failure)
 {
-    sync2async<std::shared_ptr<ValidPathInfo>>(success, failure, [&]() {
-        auto conn(connections->get());
-        conn->to << wopQueryPathInfo << path;
-        try {
-            conn->processStderr();
-        } catch (Error & e) {
-            // Ugly backwards compatibility hack.
-            if (e.msg().find("is not valid") != std::string::npos)
-                throw InvalidPath(e.what());
-            throw;
-        }
-        if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 17) {
-            bool valid; conn->from >> valid;
-            if (!valid) throw InvalidPath(format("path '%s' is not valid") % path);
-        }
-        auto info = std::make_shared<ValidPathInfo>();
-        info->path = path;
-        info->deriver = readString(conn->from);
-        if (info->deriver != "") assertStorePath(info->deriver);
-        info->narHash = Hash(readString(conn->from), htSHA256);
-        info->references = readStorePaths<PathSet>(*this, conn->from);
-        conn->from >> info->registrationTime >> info->narSize;
-        if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 16) {
-            conn->from >> info->ultimate;
-            info->sigs = readStrings<StringSet>(conn->from);
-            conn->from >> info->ca;
-        }
-        return info;
-    });
+    auto doQuery = [this, path, success, failure]() {
+        sync2async<std::shared_ptr<ValidPathInfo>>(success, failure, [&]() {
+            auto conn(connections->get());
+            conn->to << wopQueryPathInfo << path;
+            try {
+                conn->processStderr();
+            } catch (Error & e) {
+                // Ugly backwards compatibility hack.
+                if (e.msg().find("is not valid") != std::string::npos)
+                    throw InvalidPath(e.what());
+                throw;
+            }
+            if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 17) {
+                bool valid; conn->from >> valid;
+                if (!valid) throw InvalidPath(format("path '%s' is not valid") % path);
+            }
+            auto info = std::make_shared<ValidPathInfo>();
+            info->path = path;
+            info->deriver = readString(conn->from);
+            if (info->deriver != "") assertStorePath(info->deriver);
+            info->narHash = Hash(readString(conn->from), htSHA256);
+            info->references = readStorePaths<PathSet>(*this, conn->from);
+            conn->from >> info->registrationTime >> info->narSize;
+            if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 16) {
+                conn->from >> info->ultimate;
+                info->sigs = readStrings<StringSet>(conn->from);
+                conn->from >> info->ca;
+            }
+            return info;
+        });
+    };
+
+    /* With more than one daemon connection, run the request on a
+       background thread so that concurrent queries (e.g. from
+       computeFSClosure()) overlap over all connections instead of
+       being serialised into strict request/reply round trips. */
+    if (maxConnections.get() > 1)
+        queryPathInfoPool.enqueue(doQuery);
+    else
+        doQuery();
 }
 
 
@@ -386,6 +431,28 @@ void RemoteStore::addToStore(const ValidPathInfo & info, const ref<std::string>
     }
 
     else {
+
+#if defined(__linux__) && defined(__NR_memfd_create)
+        /* Same-host fast path: pass the NAR to the daemon as a memfd
+           instead of pumping it through the socket, saving two
+           copies of the entire NAR. */
+        if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 20 && conn->getFd() != -1) {
+            auto narFd = makeNarFd(*nar);
+            if (narFd) {
+                conn->to << wopAddToStoreNarFd
+                         << info.path << info.deriver << info.narHash.to_string(Base16, false)
+                         << info.references << info.registrationTime << info.narSize
+                         << info.ultimate << info.sigs << info.ca
+                         << repair << !checkSigs;
+                conn->to.flush();
+                readInt(conn->from); // daemon is ready for the fd
+                sendFd(conn->getFd(), narFd.get());
+                conn->processStderr();
+                return;
+            }
+        }
+#endif
+
         conn->to << wopAddToStoreNar
                  << info.path << info.deriver << info.narHash.to_string(Base16, false)
                  << info.references << info.registrationTime << info.narSize
@@ -397,6 +464,42 @@ void RemoteStore::addToStore(const ValidPathInfo & info, const ref<std::string>
 }
 
 
+void RemoteStore::addToStore(const ValidPathInfo & info, Source & narSource,
+    RepairFlag repair, CheckSigsFlag checkSigs, std::shared_ptr<FSAccessor> accessor)
+{
+    {
+        auto conn(connections->get());
+
+        if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 18) {
+            conn->to << wopAddToStoreNar
+                     << info.path << info.deriver << info.narHash.to_string(Base16, false)
+                     << info.references << info.registrationTime << info.narSize
+                     << info.ultimate << info.sigs << info.ca
+                     << repair << !checkSigs;
+            /* The daemon parses the NAR from the connection, so we
+               can just pump it through without buffering it whole. */
+            std::vector<unsigned char> buf(64 * 1024);
+            while (true) {
+                size_t n;
+                try {
+                    n = narSource.read(buf.data(), buf.size());
+                } catch (EndOfFile &) {
+                    break;
+                }
+                conn->to(buf.data(), n);
+            }
+            conn->processStderr();
+            return;
+        }
+    }
+
+    /* Old daemons expect the import format, which needs the whole
+       NAR in memory anyway.  (The connection handle must be released
+       first, or the fallback would deadlock on a pool of size 1.) */
+    Store::addToStore(info, narSource, repair, checkSigs, accessor);
+}
+
+
 Path RemoteStore::addToStore(const string & name, const Path & _srcPath,
     bool recursive, HashType hashAlgo, PathFilter & filter, RepairFlag repair)
 {
@@ -433,6 +536,54 @@ Path RemoteStore::addToStore(const string & name, const Path & _srcPath,
 }
 
 
+Paths RemoteStore::addMultipleToStore(
+    const std::vector<std::pair<std::string, Path>> & srcPaths,
+    bool recursive, HashType hashAlgo, PathFilter & filter, RepairFlag repair)
+{
+    if (repair) throw Error("repairing is not supported when building through the Nix daemon");
+
+    {
+        auto conn(connections->get());
+
+        if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 21)
+            // Don't hold the connection handle in the fallback case
+            // to prevent a deadlock.
+            goto fallback;
+
+        conn->to << wopAddMultipleToStore << srcPaths.size();
+
+        try {
+            conn->to.written = 0;
+            conn->to.warn = true;
+            connections->incCapacity();
+            for (auto & i : srcPaths) {
+                /* Same per-entry framing as wopAddToStore. */
+                conn->to << i.first
+                    << ((hashAlgo == htSHA256 && recursive) ? 0 : 1) /* backwards compatibility hack */
+                    << (recursive ? 1 : 0)
+                    << printHashType(hashAlgo);
+                dumpPath(absPath(i.second), conn->to, filter);
+            }
+            connections->decCapacity();
+            conn->to.warn = false;
+            conn->processStderr();
+        } catch (SysError & e) {
+            /* Daemon closed while we were sending the paths. */
+            if (e.errNo == EPIPE)
+                try {
+                    conn->processStderr();
+                } catch (EndOfFile & e) { }
+            throw;
+        }
+
+        return readStorePaths<Paths>(*this, conn->from);
+    }
+
+ fallback:
+    return Store::addMultipleToStore(srcPaths, recursive, hashAlgo, filter, repair);
+}
+
+
 Path RemoteStore::addTextToStore(const string & name, const string & s,
     const PathSet & references, RepairFlag repair)
 {
@@ -588,6 +739,29 @@ void RemoteStore::addSignatures(const Path & storePath, const StringSet & sigs)
 }
 
 
+void RemoteStore::computeFSClosure(const PathSet & paths,
+    PathSet & out, bool flipDirection, bool includeOutputs, bool includeDerivers)
+{
+    {
+        auto conn(connections->get());
+        if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 20)
+            // Don't hold the connection handle in the fallback case
+            // to prevent a deadlock.
+            goto fallback;
+        conn->to << wopComputeFSClosure << paths
+                 << flipDirection << includeOutputs << includeDerivers;
+        conn->processStderr();
+        auto res = readStorePaths<PathSet>(*this, conn->from);
+        out.insert(res.begin(), res.end());
+        return;
+    }
+
+ fallback:
+    return Store::computeFSClosure(paths, out, flipDirection,
+        includeOutputs, includeDerivers);
+}
+
+
 void RemoteStore::queryMissing(const PathSet & targets,
     PathSet & willBuild, PathSet & willSubstitute, PathSet & unknown,
     unsigned long long & downloadSize, unsigned long long & narSize)
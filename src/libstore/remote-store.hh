@@ -4,6 +4,7 @@
 #include <string>
 
 #include "store-api.hh"
+#include "thread-pool.hh"
 
 
 namespace nix {
@@ -59,10 +60,19 @@ public:
         RepairFlag repair, CheckSigsFlag checkSigs,
         std::shared_ptr<FSAccessor> accessor) override;
 
+    void addToStore(const ValidPathInfo & info, Source & narSource,
+        RepairFlag repair, CheckSigsFlag checkSigs,
+        std::shared_ptr<FSAccessor> accessor) override;
+
     Path addToStore(const string & name, const Path & srcPath,
         bool recursive = true, HashType hashAlgo = htSHA256,
         PathFilter & filter = defaultPathFilter, RepairFlag repair = NoRepair) override;
 
+    Paths addMultipleToStore(
+        const std::vector<std::pair<std::string, Path>> & srcPaths,
+        bool recursive = true, HashType hashAlgo = htSHA256,
+        PathFilter & filter = defaultPathFilter, RepairFlag repair = NoRepair) override;
+
     Path addTextToStore(const string & name, const string & s,
         const PathSet & references, RepairFlag repair) override;
 
@@ -89,6 +99,10 @@ public:
 
     void addSignatures(const Path & storePath, const StringSet & sigs) override;
 
+    void computeFSClosure(const PathSet & paths,
+        PathSet & out, bool flipDirection = false,
+        bool includeOutputs = false, bool includeDerivers = false) override;
+
     void queryMissing(const PathSet & targets,
         PathSet & willBuild, PathSet & willSubstitute, PathSet & unknown,
         unsigned long long & downloadSize, unsigned long long & narSize) override;
@@ -105,6 +119,10 @@ protected:
 
         virtual ~Connection();
 
+        /* The socket underlying this connection, or -1 if the
+           transport does not support passing file descriptors. */
+        virtual int getFd() { return -1; }
+
         void processStderr(Sink * sink = 0, Source * source = 0);
     };
 
@@ -116,6 +134,11 @@ protected:
 
     ref<Pool<Connection>> connections;
 
+    /* Background threads used to overlap queryPathInfo() requests
+       over multiple daemon connections.  Must be declared after
+       'connections' so that it is torn down (i.e. joined) first. */
+    ThreadPool queryPathInfoPool{(size_t) std::max(1, maxConnections.get())};
+
 private:
 
     std::atomic_bool failed{false};
@@ -136,6 +159,7 @@ private:
     struct Connection : RemoteStore::Connection
     {
         AutoCloseFD fd;
+        int getFd() override { return fd.get(); }
     };
 
     ref<RemoteStore::Connection> openConnection() override;
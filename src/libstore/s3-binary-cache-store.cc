@@ -8,6 +8,10 @@
 #include "compression.hh"
 #include "download.hh"
 #include "istringstream_nocopy.hh"
+#include "sync.hh"
+
+#include <map>
+#include <thread>
 
 #include <aws/core/Aws.h>
 #include <aws/core/client/ClientConfiguration.h>
@@ -19,8 +23,13 @@
 #include <aws/s3/model/GetBucketLocationRequest.h>
 #include <aws/s3/model/GetObjectRequest.h>
 #include <aws/s3/model/HeadObjectRequest.h>
+#include <aws/s3/model/DeleteObjectRequest.h>
 #include <aws/s3/model/ListObjectsRequest.h>
 #include <aws/s3/model/PutObjectRequest.h>
+#include <aws/core/utils/threading/Executor.h>
+#include <aws/transfer/TransferManager.h>
+
+using namespace Aws::Transfer;
 
 namespace nix {
 
@@ -77,9 +86,28 @@ static void initAWS()
     });
 }
 
+/* S3 clients are expensive to construct: each one resolves a
+   credential provider chain, which may involve reading configuration
+   files or a round trip to the EC2 instance metadata service.  Since
+   a client is region-scoped but otherwise stateless from our point
+   of view, keep one per region for the lifetime of the process and
+   share it between all S3Helper instances.  This also shares the
+   client's cached credentials and its pool of kept-alive HTTP
+   connections. */
+static ref<Aws::S3::S3Client> makeClient(
+    const Aws::Client::ClientConfiguration & config, const std::string & region)
+{
+    static Sync<std::map<std::string, std::shared_ptr<Aws::S3::S3Client>>> clients_;
+    auto clients(clients_.lock());
+    auto & client = (*clients)[region];
+    if (!client)
+        client = std::make_shared<Aws::S3::S3Client>(config, true, false);
+    return ref<Aws::S3::S3Client>(client);
+}
+
 S3Helper::S3Helper(const string & region)
     : config(makeConfig(region))
-    , client(make_ref<Aws::S3::S3Client>(*config, true, false))
+    , client(makeClient(*config, region))
 {
 }
 
@@ -152,6 +180,10 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
     const Setting<std::string> narinfoCompression{this, "", "narinfo-compression", "compression method for .narinfo files"};
     const Setting<std::string> lsCompression{this, "", "ls-compression", "compression method for .ls files"};
     const Setting<std::string> logCompression{this, "", "log-compression", "compression method for log/* files"};
+    const Setting<bool> multipartUpload{
+        this, false, "multipart-upload", "whether to use multi-part uploads"};
+    const Setting<uint64_t> bufferSize{
+        this, 5 * 1024 * 1024, "buffer-size", "size (in bytes) of each part in multi-part uploads"};
 
     std::string bucketName;
 
@@ -254,27 +286,74 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
         const std::string & mimeType,
         const std::string & contentEncoding)
     {
-        auto request =
-            Aws::S3::Model::PutObjectRequest()
-            .WithBucket(bucketName)
-            .WithKey(path);
+        auto stream = std::make_shared<istringstream_nocopy>(data);
 
-        request.SetContentType(mimeType);
+        auto now1 = std::chrono::steady_clock::now();
 
-        if (contentEncoding != "")
-            request.SetContentEncoding(contentEncoding);
+        if (multipartUpload && data.size() > bufferSize) {
 
-        auto stream = std::make_shared<istringstream_nocopy>(data);
+            /* Upload the parts in parallel through the
+               TransferManager.  The executor is shared between
+               uploads so that concurrency is bounded globally, not
+               per file. */
+            auto maxThreads = std::thread::hardware_concurrency();
 
-        request.SetBody(stream);
+            static std::shared_ptr<Aws::Utils::Threading::PooledThreadExecutor>
+                executor = std::make_shared<Aws::Utils::Threading::PooledThreadExecutor>(maxThreads);
 
-        stats.put++;
-        stats.putBytes += data.size();
+            TransferManagerConfiguration transferConfig(executor.get());
 
-        auto now1 = std::chrono::steady_clock::now();
+            transferConfig.s3Client = s3Helper.client;
+            transferConfig.bufferSize = bufferSize;
+
+            transferConfig.uploadProgressCallback =
+                [&](const TransferManager * transferManager,
+                    const std::shared_ptr<const TransferHandle> & transferHandle)
+                {
+                    checkInterrupt();
+                    debug("upload progress ('%s'): '%d' of '%d' bytes",
+                        path,
+                        transferHandle->GetBytesTransferred(),
+                        transferHandle->GetBytesTotalSize());
+                };
+
+            auto transferManager = TransferManager::Create(transferConfig);
+
+            std::shared_ptr<TransferHandle> transferHandle =
+                transferManager->UploadFile(
+                    stream, bucketName, path, mimeType,
+                    Aws::Map<Aws::String, Aws::String>());
 
-        auto result = checkAws(format("AWS error uploading '%s'") % path,
-            s3Helper.client->PutObject(request));
+            transferHandle->WaitUntilFinished();
+
+            if (transferHandle->GetStatus() == TransferStatus::FAILED)
+                throw Error("AWS error: failed to upload 's3://%s/%s': %s",
+                    bucketName, path, transferHandle->GetLastError().GetMessage());
+
+            if (transferHandle->GetStatus() != TransferStatus::COMPLETED)
+                throw Error("AWS error: transfer status of 's3://%s/%s' in unexpected state",
+                    bucketName, path);
+
+        } else {
+
+            auto request =
+                Aws::S3::Model::PutObjectRequest()
+                .WithBucket(bucketName)
+                .WithKey(path);
+
+            request.SetContentType(mimeType);
+
+            if (contentEncoding != "")
+                request.SetContentEncoding(contentEncoding);
+
+            request.SetBody(stream);
+
+            auto result = checkAws(format("AWS error uploading '%s'") % path,
+                s3Helper.client->PutObject(request));
+        }
+
+        stats.put++;
+        stats.putBytes += data.size();
 
         auto now2 = std::chrono::steady_clock::now();
 
@@ -299,6 +378,17 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
             uploadFile(path, data, mimeType, "");
     }
 
+    void deleteFile(const std::string & path) override
+    {
+        /* DeleteObject succeeds on missing keys, which is what we
+           want for restartable GC runs. */
+        checkAws(format("AWS error deleting '%s'") % path,
+            s3Helper.client->DeleteObject(
+                Aws::S3::Model::DeleteObjectRequest()
+                .WithBucket(bucketName)
+                .WithKey(path)));
+    }
+
     void getFile(const std::string & path,
         std::function<void(std::shared_ptr<std::string>)> success,
         std::function<void(std::exception_ptr exc)> failure) override
@@ -7,7 +7,9 @@ create table if not exists ValidPaths (
     narSize          integer,
     ultimate         integer, -- null implies "false"
     sigs             text, -- space-separated
-    ca               text -- if not null, an assertion that the path is content-addressed; see ValidPathInfo
+    ca               text, -- if not null, an assertion that the path is content-addressed; see ValidPathInfo
+    closureSize      integer, -- materialized sum of narSize over the path's closure
+    closureCount     integer  -- materialized number of paths in the closure
 );
 
 create table if not exists Refs (
@@ -40,3 +42,29 @@ create table if not exists DerivationOutputs (
 );
 
 create index if not exists IndexDerivationOutputs on DerivationOutputs(path);
+
+-- Per-build performance records, for spotting build-time
+-- regressions.  Rows are keyed by derivation path rather than by
+-- ValidPaths id, so they survive garbage collection of the
+-- derivation.
+create table if not exists BuildMetrics (
+    drv        text not null,
+    startTime  integer not null,
+    duration   integer not null, -- seconds
+    cpuUser    integer, -- milliseconds
+    cpuSystem  integer, -- milliseconds
+    peakRSS    integer, -- KiB
+    outputSize integer, -- sum of output narSizes, in bytes
+    primary key (drv, startTime)
+);
+
+-- Outcome of determinism check builds ('nix-store --check' and
+-- --repeat), keyed by derivation path so the history survives
+-- garbage collection of the outputs.
+create table if not exists DeterminismChecks (
+    drv           text not null,
+    checkTime     integer not null,
+    deterministic integer not null,
+    diff          text, -- file-level differences, one per line
+    primary key (drv, checkTime)
+);
@@ -1,5 +1,7 @@
 #include "ssh.hh"
 
+#include <sys/wait.h>
+
 namespace nix {
 
 SSHMaster::SSHMaster(const std::string & host, const std::string & keyFile, bool useMaster, bool compress, int logFD)
@@ -71,43 +73,67 @@ Path SSHMaster::startMaster()
 
     auto state(state_.lock());
 
-    if (state->sshMaster != -1) return state->socketPath;
+    if (state->sshMaster != -1) {
+        /* Check that the master hasn't died (e.g. because the remote
+           side went away).  If it has, reap it and start a fresh one
+           instead of handing out a socket nobody is listening on. */
+        if (waitpid(state->sshMaster, nullptr, WNOHANG) == 0)
+            return state->socketPath;
+        state->sshMaster.release();
+        printError("SSH master connection to '%s' died, restarting", host);
+    }
 
-    state->tmpDir = std::make_unique<AutoDelete>(createTempDir("", "nix", true, true, 0700));
+    if (!state->tmpDir) {
+        state->tmpDir = std::make_unique<AutoDelete>(createTempDir("", "nix", true, true, 0700));
+        state->socketPath = (Path) *state->tmpDir + "/ssh.sock";
+    }
 
-    state->socketPath = (Path) *state->tmpDir + "/ssh.sock";
+    for (unsigned int attempt = 0; ; attempt++) {
 
-    Pipe out;
-    out.create();
+        /* A dead master may have left its socket behind, which would
+           make the new one fail to bind. */
+        ::unlink(state->socketPath.c_str());
 
-    state->sshMaster = startProcess([&]() {
-        restoreSignals();
+        Pipe out;
+        out.create();
 
-        close(out.readSide.get());
+        state->sshMaster = startProcess([&]() {
+            restoreSignals();
 
-        if (dup2(out.writeSide.get(), STDOUT_FILENO) == -1)
-            throw SysError("duping over stdout");
+            close(out.readSide.get());
 
-        Strings args =
-            { "ssh", host.c_str(), "-M", "-N", "-S", state->socketPath
-            , "-o", "LocalCommand=echo started"
-            , "-o", "PermitLocalCommand=yes"
-            };
-        addCommonSSHOpts(args);
-        execvp(args.begin()->c_str(), stringsToCharPtrs(args).data());
+            if (dup2(out.writeSide.get(), STDOUT_FILENO) == -1)
+                throw SysError("duping over stdout");
 
-        throw SysError("starting SSH master");
-    });
+            Strings args =
+                { "ssh", host.c_str(), "-M", "-N", "-S", state->socketPath
+                , "-o", "LocalCommand=echo started"
+                , "-o", "PermitLocalCommand=yes"
+                };
+            addCommonSSHOpts(args);
+            execvp(args.begin()->c_str(), stringsToCharPtrs(args).data());
 
-    out.writeSide = -1;
+            throw SysError("starting SSH master");
+        });
+
+        out.writeSide = -1;
+
+        std::string reply;
+        try {
+            reply = readLine(out.readSide.get());
+        } catch (EndOfFile & e) { }
+
+        if (reply == "started") break;
+
+        state->sshMaster.kill();
 
-    std::string reply;
-    try {
-        reply = readLine(out.readSide.get());
-    } catch (EndOfFile & e) { }
+        if (attempt >= 2)
+            throw Error("failed to start SSH master connection to '%s'", host);
 
-    if (reply != "started")
-        throw Error("failed to start SSH master connection to '%s'", host);
+        unsigned int delay = 1 << attempt;
+        printError("failed to start SSH master connection to '%s', retrying in %d s", host, delay);
+        sleep(delay);
+    }
 
     return state->socketPath;
 }
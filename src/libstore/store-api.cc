@@ -7,7 +7,10 @@
 #include "json.hh"
 #include "derivations.hh"
 
+#include <cstring>
 #include <future>
+#include <iostream>
+#include <thread>
 
 
 namespace nix {
@@ -252,6 +255,16 @@ std::string Store::getUri()
 }
 
 
+bool Store::PathInfoCacheValue::isKnownNow()
+{
+    std::chrono::duration<double> ttl = didExist()
+        ? std::chrono::seconds(settings.ttlPositiveNarInfoCache)
+        : std::chrono::seconds(settings.ttlNegativeNarInfoCache);
+
+    return std::chrono::steady_clock::now() < time_point + ttl;
+}
+
+
 bool Store::isValidPath(const Path & storePath)
 {
     auto hashPart = storePathToHash(storePath);
@@ -259,19 +272,22 @@ bool Store::isValidPath(const Path & storePath)
     {
         auto state_(state.lock());
         auto res = state_->pathInfoCache.get(hashPart);
-        if (res) {
+        if (res && res->isKnownNow()) {
             stats.narInfoReadAverted++;
-            return *res != 0;
+            stats.pathInfoCacheHits++;
+            return res->didExist();
         }
     }
 
+    stats.pathInfoCacheMisses++;
+
     if (diskCache) {
         auto res = diskCache->lookupNarInfo(getUri(), hashPart);
         if (res.first != NarInfoDiskCache::oUnknown) {
             stats.narInfoReadAverted++;
             auto state_(state.lock());
             state_->pathInfoCache.upsert(hashPart,
-                res.first == NarInfoDiskCache::oInvalid ? 0 : res.second);
+                res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue() : PathInfoCacheValue(res.second));
             return res.first == NarInfoDiskCache::oValid;
         }
     }
@@ -325,26 +341,36 @@ void Store::queryPathInfo(const Path & storePath,
 
         {
             auto res = state.lock()->pathInfoCache.get(hashPart);
-            if (res) {
+            if (res && res->isKnownNow()) {
                 stats.narInfoReadAverted++;
-                if (!*res)
+                stats.pathInfoCacheHits++;
+                if (!res->didExist())
                     throw InvalidPath(format("path '%s' is not valid") % storePath);
-                return success(ref<ValidPathInfo>(*res));
+                return success(ref<ValidPathInfo>(res->value));
             }
         }
 
+        stats.pathInfoCacheMisses++;
+
         if (diskCache) {
-            auto res = diskCache->lookupNarInfo(getUri(), hashPart);
+            bool refreshAhead = false;
+            auto res = diskCache->lookupNarInfo(getUri(), hashPart, &refreshAhead);
             if (res.first != NarInfoDiskCache::oUnknown) {
                 stats.narInfoReadAverted++;
                 {
                     auto state_(state.lock());
                     state_->pathInfoCache.upsert(hashPart,
-                        res.first == NarInfoDiskCache::oInvalid ? 0 : res.second);
+                        res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue() : PathInfoCacheValue(res.second));
                     if (res.first == NarInfoDiskCache::oInvalid ||
                         (res.second->path != storePath && storePathToName(storePath) != ""))
                         throw InvalidPath(format("path '%s' is not valid") % storePath);
                 }
+                /* Entry is nearing expiry: revalidate it in the
+                   background while the cached value keeps serving, so
+                   the TTL boundary doesn't turn into a synchronous
+                   fetch on the critical path. */
+                if (refreshAhead)
+                    refreshPathInfo(storePath, hashPart);
                 return success(ref<ValidPathInfo>(res.second));
             }
         }
@@ -377,6 +403,30 @@ void Store::queryPathInfo(const Path & storePath,
 }
 
 
+void Store::refreshPathInfo(const Path & storePath, const std::string & hashPart)
+{
+    /* At most one revalidation in flight per path. */
+    {
+        auto state_(state.lock());
+        if (!state_->pendingRefresh.insert(hashPart).second) return;
+    }
+
+    queryPathInfoUncached(storePath,
+        [this, hashPart](std::shared_ptr<ValidPathInfo> info) {
+            if (diskCache)
+                diskCache->upsertNarInfo(getUri(), hashPart, info);
+            auto state_(state.lock());
+            state_->pathInfoCache.upsert(hashPart, info);
+            state_->pendingRefresh.erase(hashPart);
+        },
+        [this, hashPart](std::exception_ptr) {
+            /* Keep serving the cached value; the entry will be
+               re-fetched for real when its TTL runs out. */
+            state.lock()->pendingRefresh.erase(hashPart);
+        });
+}
+
+
 PathSet Store::queryValidPaths(const PathSet & paths, SubstituteFlag maybeSubstitute)
 {
     struct State
@@ -459,12 +509,50 @@ void Store::pathInfoToJSON(JSONPlaceholder & jsonOut, const PathSet & storePaths
 {
     auto jsonList = jsonOut.list();
 
-    for (auto storePath : storePaths) {
-        auto jsonPath = jsonList.object();
-        jsonPath.attr("path", storePath);
+    /* Hydrate path infos a bounded chunk at a time on a thread pool,
+       then serialise the chunk in order.  The output stream stays
+       incremental and memory use is constant in the number of paths,
+       which matters for whole-store exports. */
+    std::vector<Path> paths(storePaths.begin(), storePaths.end());
+
+    const size_t chunkSize = 1024;
+
+    for (size_t chunkStart = 0; chunkStart < paths.size(); chunkStart += chunkSize) {
+        auto chunkEnd = std::min(paths.size(), chunkStart + chunkSize);
+
+        std::vector<std::shared_ptr<const ValidPathInfo>> infos(chunkEnd - chunkStart);
+
+        ThreadPool pool;
+        for (size_t n = chunkStart; n < chunkEnd; ++n)
+            pool.enqueue([&, n]() {
+                try {
+                    infos[n - chunkStart] = queryPathInfo(paths[n]);
+                } catch (InvalidPath &) {
+                    /* Reported as valid = false below. */
+                }
+            });
+        pool.process();
+
+        std::map<Path, std::pair<uint64_t, uint64_t>> chunkClosureSizes;
+
+        if (showClosureSize) {
+            PathSet validPaths;
+            for (auto & info : infos)
+                if (info) validPaths.insert(info->path);
+            chunkClosureSizes = getClosureSizes(validPaths);
+        }
+
+        for (size_t n = chunkStart; n < chunkEnd; ++n) {
+            auto storePath = paths[n];
+            auto info = infos[n - chunkStart];
+            auto jsonPath = jsonList.object();
+            jsonPath.attr("path", storePath);
+
+            if (!info) {
+                jsonPath.attr("valid", false);
+                continue;
+            }
 
-        try {
-            auto info = queryPathInfo(storePath);
             storePath = info->path;
 
             jsonPath
@@ -483,7 +571,7 @@ void Store::pathInfoToJSON(JSONPlaceholder & jsonOut, const PathSet & storePaths
             std::pair<uint64_t, uint64_t> closureSizes;
 
             if (showClosureSize) {
-                closureSizes = getClosureSize(storePath);
+                closureSizes = chunkClosureSizes[storePath];
                 jsonPath.attr("closureSize", closureSizes.first);
             }
 
@@ -516,9 +604,6 @@ void Store::pathInfoToJSON(JSONPlaceholder & jsonOut, const PathSet & storePaths
                         jsonPath.attr("closureDownloadSize", closureSizes.second);
                 }
             }
-
-        } catch (InvalidPath &) {
-            jsonPath.attr("valid", false);
         }
     }
 }
@@ -526,18 +611,71 @@ void Store::pathInfoToJSON(JSONPlaceholder & jsonOut, const PathSet & storePaths
 
 std::pair<uint64_t, uint64_t> Store::getClosureSize(const Path & storePath)
 {
-    uint64_t totalNarSize = 0, totalDownloadSize = 0;
+    return getClosureSizes({storePath})[storePath];
+}
+
+
+std::map<Path, std::pair<uint64_t, uint64_t>> Store::getClosureSizes(
+    const PathSet & storePaths)
+{
+    /* Overlapping closures are the common case (e.g. 'nix path-info
+       -rS' over the roots of a profile), so compute the union
+       closure and fetch each member's info only once, then take the
+       per-root sums over the in-memory reference graph. */
     PathSet closure;
-    computeFSClosure(storePath, closure, false, false);
-    for (auto & p : closure) {
-        auto info = queryPathInfo(p);
-        totalNarSize += info->narSize;
-        auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
-            std::shared_ptr<const ValidPathInfo>(info));
-        if (narInfo)
-            totalDownloadSize += narInfo->fileSize;
+    computeFSClosure(storePaths, closure, false, false);
+
+    std::map<Path, std::shared_ptr<const ValidPathInfo>> infos;
+    for (auto & p : closure)
+        infos[p] = nullptr;
+
+    ThreadPool pool;
+    for (auto i = infos.begin(); i != infos.end(); ++i)
+        pool.enqueue([this, i]() { i->second = queryPathInfo(i->first); });
+    pool.process();
+
+    std::map<Path, std::pair<uint64_t, uint64_t>> res;
+
+    for (auto & root : storePaths) {
+        uint64_t totalNarSize = 0, totalDownloadSize = 0;
+        PathSet seen;
+        std::vector<const Path *> queue{&root};
+        while (!queue.empty()) {
+            auto p = queue.back();
+            queue.pop_back();
+            if (!seen.insert(*p).second) continue;
+            auto j = infos.find(*p);
+            if (j == infos.end()) continue;
+            auto & info = j->second;
+            totalNarSize += info->narSize;
+            auto narInfo = std::dynamic_pointer_cast<const NarInfo>(info);
+            if (narInfo)
+                totalDownloadSize += narInfo->fileSize;
+            for (auto & ref : info->references)
+                if (!seen.count(ref)) queue.push_back(&ref);
+        }
+        res[root] = {totalNarSize, totalDownloadSize};
     }
-    return {totalNarSize, totalDownloadSize};
+
+    return res;
+}
+
+
+Paths Store::addMultipleToStore(
+    const std::vector<std::pair<std::string, Path>> & srcPaths,
+    bool recursive, HashType hashAlgo, PathFilter & filter, RepairFlag repair)
+{
+    Paths res;
+    for (auto & i : srcPaths)
+        res.push_back(addToStore(i.first, i.second, recursive, hashAlgo, filter, repair));
+    return res;
+}
+
+
+void Store::addSignatures(const std::map<Path, StringSet> & pathSigs)
+{
+    for (auto & i : pathSigs)
+        addSignatures(i.first, i.second);
 }
 
 
@@ -551,6 +689,31 @@ const Store::Stats & Store::getStats()
 }
 
 
+void Store::dumpStats()
+{
+    auto & s = getStats();
+    std::cerr << "store statistics for '" << getUri() << "':\n";
+    auto line = [](const char * name, uint64_t value) {
+        std::cerr << format("  %1%: %2%\n") % name % value;
+    };
+    line("path-info cache size", s.pathInfoCacheSize);
+    line("path-info cache hits", s.pathInfoCacheHits);
+    line("path-info cache misses", s.pathInfoCacheMisses);
+    line("nar-info reads", s.narInfoRead);
+    line("nar-info reads averted", s.narInfoReadAverted);
+    line("nar-info missing", s.narInfoMissing);
+    line("nar-info writes", s.narInfoWrite);
+    line("nars read", s.narRead);
+    line("nar bytes read", s.narReadBytes);
+    line("nar compressed bytes read", s.narReadCompressedBytes);
+    line("nars written", s.narWrite);
+    line("nar writes averted", s.narWriteAverted);
+    line("nar bytes written", s.narWriteBytes);
+    line("nar compressed bytes written", s.narWriteCompressedBytes);
+    line("nar compression time (ms)", s.narWriteCompressionTimeMs);
+}
+
+
 void Store::buildPaths(const PathSet & paths, BuildMode buildMode)
 {
     for (auto & path : paths)
@@ -562,6 +725,24 @@ void Store::buildPaths(const PathSet & paths, BuildMode buildMode)
 }
 
 
+void Store::addToStore(const ValidPathInfo & info, Source & narSource,
+    RepairFlag repair, CheckSigsFlag checkSigs, std::shared_ptr<FSAccessor> accessor)
+{
+    StringSink sink;
+    std::vector<unsigned char> buf(64 * 1024);
+    while (true) {
+        size_t n;
+        try {
+            n = narSource.read(buf.data(), buf.size());
+        } catch (EndOfFile &) {
+            break;
+        }
+        sink(buf.data(), n);
+    }
+    addToStore(info, sink.s, repair, checkSigs, accessor);
+}
+
+
 void copyStorePath(ref<Store> srcStore, ref<Store> dstStore,
     const Path & storePath, RepairFlag repair, CheckSigsFlag checkSigs)
 {
@@ -569,33 +750,18 @@ void copyStorePath(ref<Store> srcStore, ref<Store> dstStore,
 
     auto info = srcStore->queryPathInfo(storePath);
 
-    uint64_t total = 0;
-
-    auto progress = [&](size_t len) {
-        total += len;
-        act.progress(total, info->narSize);
-    };
-
-    struct MyStringSink : StringSink
-    {
-        typedef std::function<void(size_t)> Callback;
-        Callback callback;
-        MyStringSink(Callback callback) : callback(callback) { }
-        void operator () (const unsigned char * data, size_t len) override
-        {
-            StringSink::operator ()(data, len);
-            callback(len);
-        };
-    };
-
-    MyStringSink sink(progress);
-    srcStore->narFromPath({storePath}, sink);
-
+    /* If the NAR hash is unknown, we have no choice but to buffer
+       the entire NAR to compute it. */
     if (!info->narHash && !checkSigs) {
+        StringSink sink;
+        srcStore->narFromPath({storePath}, sink);
         auto info2 = make_ref<ValidPathInfo>(*info);
         info2->narHash = hashString(htSHA256, *sink.s);
         if (!info->narSize) info2->narSize = sink.s->size();
-        info = info2;
+        info2->ultimate = false;
+        act.progress(sink.s->size(), info2->narSize);
+        dstStore->addToStore(*info2, sink.s, repair, checkSigs);
+        return;
     }
 
     assert(info->narHash);
@@ -606,9 +772,117 @@ void copyStorePath(ref<Store> srcStore, ref<Store> dstStore,
         info = info2;
     }
 
-    assert(info->narHash);
+    /* Stream the NAR from the source store into the destination
+       with a bounded amount of buffering, so that copying a very
+       large path needs O(buffer) memory and the read and write sides
+       overlap. */
+    struct State
+    {
+        bool quit = false, eof = false;
+        std::string buf;
+        std::exception_ptr exc;
+    };
+
+    Sync<State> state_;
+    std::condition_variable avail, room;
+
+    uint64_t total = 0;
+
+    struct FeedSink : Sink
+    {
+        std::function<void(const unsigned char *, size_t)> fun;
+        void operator () (const unsigned char * data, size_t len) override
+        {
+            fun(data, len);
+        }
+    };
+
+    std::thread thread([&]() {
+        try {
+            FeedSink sink;
+            sink.fun = [&](const unsigned char * data, size_t len) {
+                auto state(state_.lock());
+                while (state->buf.size() > 1024 * 1024 && !state->quit)
+                    state.wait(room);
+                if (state->quit)
+                    throw Error("NAR consumer is gone");
+                state->buf.append((const char *) data, len);
+                total += len;
+                act.progress(total, info->narSize);
+                avail.notify_one();
+            };
+            srcStore->narFromPath({storePath}, sink);
+        } catch (...) {
+            auto state(state_.lock());
+            /* An abort provoked by the consumer going away is not a
+               real error. */
+            if (!state->quit) state->exc = std::current_exception();
+            avail.notify_one();
+            return;
+        }
+        auto state(state_.lock());
+        state->eof = true;
+        avail.notify_one();
+    });
+
+    struct BufSource : Source
+    {
+        Sync<State> & state_;
+        std::condition_variable & avail, & room;
+        std::string chunk;
+        size_t pos = 0;
+        BufSource(Sync<State> & state_, std::condition_variable & avail, std::condition_variable & room)
+            : state_(state_), avail(avail), room(room) { }
+        size_t read(unsigned char * data, size_t len) override
+        {
+            if (pos == chunk.size()) {
+                auto state(state_.lock());
+                while (state->buf.empty() && !state->eof && !state->exc)
+                    state.wait(avail);
+                if (state->exc && state->buf.empty())
+                    std::rethrow_exception(state->exc);
+                if (state->buf.empty())
+                    throw EndOfFile("end of NAR reached");
+                chunk = std::move(state->buf);
+                state->buf.clear();
+                pos = 0;
+                room.notify_one();
+            }
+            size_t n = std::min(len, chunk.size() - pos);
+            memcpy(data, chunk.data() + pos, n);
+            pos += n;
+            return n;
+        }
+    };
 
-    dstStore->addToStore(*info, sink.s, repair, checkSigs);
+    try {
+        BufSource source(state_, avail, room);
+        dstStore->addToStore(*info, source, repair, checkSigs);
+    } catch (...) {
+        {
+            auto state(state_.lock());
+            state->quit = true;
+            room.notify_one();
+        }
+        thread.join();
+        throw;
+    }
+
+    /* The destination may return without draining the source (e.g.
+       if the path turned out to be valid already), so tell the
+       producer to stop before joining it. */
+    {
+        auto state(state_.lock());
+        state->quit = true;
+        room.notify_one();
+    }
+
+    thread.join();
+
+    {
+        auto state(state_.lock());
+        if (state->exc) std::rethrow_exception(state->exc);
+    }
 }
 
 
@@ -637,12 +911,12 @@ void copyPaths(ref<Store> srcStore, ref<Store> dstStore, const PathSet & storePa
         PathSet(missing.begin(), missing.end()),
 
         [&](const Path & storePath) {
-            if (dstStore->isValidPath(storePath)) {
-                nrDone++;
-                showProgress();
-                return PathSet();
-            }
-
+            /* No isValidPath() check here: every node in the graph
+               is known to be missing from the batched
+               queryValidPaths() call above, so a per-path round trip
+               to the destination would be redundant.  The check in
+               the process function below still catches paths that
+               appear concurrently. */
             auto info = srcStore->queryPathInfo(storePath);
 
             bytesExpected += info->narSize;
@@ -657,7 +931,25 @@ void copyPaths(ref<Store> srcStore, ref<Store> dstStore, const PathSet & storePa
             if (!dstStore->isValidPath(storePath)) {
                 MaintainCount<decltype(nrRunning)> mc(nrRunning);
                 showProgress();
-                copyStorePath(srcStore, dstStore, storePath, repair, checkSigs);
+
+                /* Since addToStore() is atomic, a failed transfer
+                   leaves nothing behind and a retry restarts the
+                   path from scratch.  Paths copied by earlier
+                   attempts (or earlier runs) are valid at the
+                   destination and never sent again, so rerunning an
+                   interrupted copy only pays for what is missing. */
+                for (unsigned int attempt = 1; ; attempt++) {
+                    try {
+                        copyStorePath(srcStore, dstStore, storePath, repair, checkSigs);
+                        break;
+                    } catch (Error & e) {
+                        if (attempt >= settings.copyAttempts) throw;
+                        printError("error copying path '%s' (attempt %d of %d): %s",
+                            storePath, attempt, settings.copyAttempts.get(), e.msg());
+                        checkInterrupt();
+                        std::this_thread::sleep_for(std::chrono::milliseconds(attempt * 500));
+                    }
+                }
             }
 
             nrDone++;
@@ -9,6 +9,7 @@
 #include "config.hh"
 
 #include <atomic>
+#include <chrono>
 #include <limits>
 #include <map>
 #include <memory>
@@ -250,9 +251,33 @@ public:
 
 protected:
 
+    struct PathInfoCacheValue
+    {
+        /* Time this cache entry was created. */
+        std::chrono::time_point<std::chrono::steady_clock> time_point = std::chrono::steady_clock::now();
+
+        /* Null if the path is known to be invalid. */
+        std::shared_ptr<ValidPathInfo> value;
+
+        PathInfoCacheValue(std::shared_ptr<ValidPathInfo> value = nullptr)
+            : value(value) { }
+
+        /* Whether the entry is still usable, i.e. its TTL has not
+           expired.  Negative entries expire much sooner than positive
+           ones, since a path that is invalid now may well be added
+           later. */
+        bool isKnownNow();
+
+        bool didExist() { return value != nullptr; }
+    };
+
     struct State
     {
-        LRUCache<std::string, std::shared_ptr<ValidPathInfo>> pathInfoCache;
+        LRUCache<std::string, PathInfoCacheValue> pathInfoCache;
+
+        /* Hash parts for which a refresh-ahead revalidation is in
+           flight; see refreshPathInfo(). */
+        StringSet pendingRefresh;
     };
 
     Sync<State> state;
@@ -362,6 +387,12 @@ protected:
         std::function<void(std::shared_ptr<ValidPathInfo>)> success,
         std::function<void(std::exception_ptr exc)> failure) = 0;
 
+    /* Revalidate a disk-cached path info that is close to expiry,
+       without blocking the caller on stores with an asynchronous
+       queryPathInfoUncached().  Failures are ignored; the cached
+       value remains in use until its TTL actually runs out. */
+    void refreshPathInfo(const Path & storePath, const std::string & hashPart);
+
 public:
 
     /* Queries the set of incoming FS references for a store path.
@@ -401,6 +432,13 @@ public:
         RepairFlag repair = NoRepair, CheckSigsFlag checkSigs = CheckSigs,
         std::shared_ptr<FSAccessor> accessor = 0) = 0;
 
+    /* Like above, but the NAR is read from 'narSource' and need not
+       fit in memory.  The default implementation buffers the whole
+       NAR; stores that can ingest incrementally override this. */
+    virtual void addToStore(const ValidPathInfo & info, Source & narSource,
+        RepairFlag repair = NoRepair, CheckSigsFlag checkSigs = CheckSigs,
+        std::shared_ptr<FSAccessor> accessor = 0);
+
     /* Copy the contents of a path to the store and register the
        validity the resulting path.  The resulting path is returned.
        The function object `filter' can be used to exclude files (see
@@ -409,6 +447,16 @@ public:
         bool recursive = true, HashType hashAlgo = htSHA256,
         PathFilter & filter = defaultPathFilter, RepairFlag repair = NoRepair) = 0;
 
+    /* Add several paths in one go.  Each element is a (name, source
+       path) pair; the resulting store paths are returned in the same
+       order.  The default implementation calls addToStore() once per
+       path; RemoteStore batches the whole set into a single daemon
+       exchange. */
+    virtual Paths addMultipleToStore(
+        const std::vector<std::pair<std::string, Path>> & srcPaths,
+        bool recursive = true, HashType hashAlgo = htSHA256,
+        PathFilter & filter = defaultPathFilter, RepairFlag repair = NoRepair);
+
     /* Like addToStore, but the contents written to the output path is
        a regular file containing the given string. */
     virtual Path addTextToStore(const string & name, const string & s,
@@ -497,6 +545,13 @@ public:
        the closure. */
     std::pair<uint64_t, uint64_t> getClosureSize(const Path & storePath);
 
+    /* Batched version of getClosureSize().  The union closure of the
+       given paths is computed and hydrated only once, so shared
+       subgraphs are not queried again for every root that reaches
+       them. */
+    virtual std::map<Path, std::pair<uint64_t, uint64_t>> getClosureSizes(
+        const PathSet & storePaths);
+
     /* Optimise the disk space usage of the Nix store by hard-linking files
        with the same contents. */
     virtual void optimiseStore() { };
@@ -512,6 +567,12 @@ public:
        not verified. */
     virtual void addSignatures(const Path & storePath, const StringSet & sigs) = 0;
 
+    /* Add signatures to several store paths at once.  The default
+       implementation simply calls addSignatures() once per path;
+       stores with transactional backends can override this to commit
+       the whole batch in one go. */
+    virtual void addSignatures(const std::map<Path, StringSet> & pathSigs);
+
     /* Utility functions. */
 
     /* Read a derivation, after ensuring its existence through
@@ -564,6 +625,8 @@ public:
         std::atomic<uint64_t> narInfoMissing{0};
         std::atomic<uint64_t> narInfoWrite{0};
         std::atomic<uint64_t> pathInfoCacheSize{0};
+        std::atomic<uint64_t> pathInfoCacheHits{0};
+        std::atomic<uint64_t> pathInfoCacheMisses{0};
         std::atomic<uint64_t> narRead{0};
         std::atomic<uint64_t> narReadBytes{0};
         std::atomic<uint64_t> narReadCompressedBytes{0};
@@ -576,6 +639,9 @@ public:
 
     const Stats & getStats();
 
+    /* Write the statistics counters to stderr, for NIX_SHOW_STATS. */
+    void dumpStats();
+
     /* Return the build log of the specified store path, if available,
        or null otherwise. */
     virtual std::shared_ptr<std::string> getBuildLog(const Path & path)
@@ -628,6 +694,14 @@ public:
 
     const static string drvsLogDir;
 
+private:
+
+    /* Cached by getFSAccessor() so that repeated calls share one
+       accessor (and hence its path-validity cache). */
+    Sync<std::shared_ptr<FSAccessor>> fsAccessor_;
+
+public:
+
     LocalFSStore(const Params & params);
 
     void narFromPath(const Path & path, Sink & sink) override;
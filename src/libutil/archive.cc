@@ -40,6 +40,12 @@ static void dumpContents(const Path & path, size_t size,
     AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
     if (!fd) throw SysError(format("opening file '%1%'") % path);
 
+#ifdef POSIX_FADV_SEQUENTIAL
+    /* We read the file exactly once, front to back, so tell the
+       kernel to read ahead aggressively and drop blocks early. */
+    posix_fadvise(fd.get(), 0, size, POSIX_FADV_SEQUENTIAL);
+#endif
+
     unsigned char buf[65536];
     size_t left = size;
 
@@ -74,11 +80,13 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
     else if (S_ISDIR(st.st_mode)) {
         sink << "type" << "directory";
 
-        /* If we're on a case-insensitive system like macOS, undo
-           the case hack applied by restorePath(). */
-        std::map<string, string> unhacked;
-        for (auto & i : readDirectory(path))
-            if (useCaseHack) {
+        auto entries = readDirectory(path);
+
+        if (useCaseHack) {
+            /* If we're on a case-insensitive system like macOS, undo
+               the case hack applied by restorePath(). */
+            std::map<string, string> unhacked;
+            for (auto & i : entries) {
                 string name(i.name);
                 size_t pos = i.name.find(caseHackSuffix);
                 if (pos != string::npos) {
@@ -89,15 +97,29 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
                     throw Error(format("file name collision in between '%1%' and '%2%'")
                         % (path + "/" + unhacked[name]) % (path + "/" + i.name));
                 unhacked[name] = i.name;
-            } else
-                unhacked[i.name] = i.name;
-
-        for (auto & i : unhacked)
-            if (filter(path + "/" + i.first)) {
-                sink << "entry" << "(" << "name" << i.first << "node";
-                dump(path + "/" + i.second, sink, filter);
-                sink << ")";
             }
+
+            for (auto & i : unhacked)
+                if (filter(path + "/" + i.first)) {
+                    sink << "entry" << "(" << "name" << i.first << "node";
+                    dump(path + "/" + i.second, sink, filter);
+                    sink << ")";
+                }
+        } else {
+            /* The common case doesn't need the rename map; sorting
+               the entries in place gives the canonical NAR order
+               without a tree node allocation and two string copies
+               per entry. */
+            std::sort(entries.begin(), entries.end(),
+                [](const DirEntry & a, const DirEntry & b) { return a.name < b.name; });
+
+            for (auto & i : entries)
+                if (filter(path + "/" + i.name)) {
+                    sink << "entry" << "(" << "name" << i.name << "node";
+                    dump(path + "/" + i.name, sink, filter);
+                    sink << ")";
+                }
+        }
     }
 
     else if (S_ISLNK(st.st_mode))
@@ -145,15 +167,18 @@ static void parseContents(ParseSink & sink, Source & source, const Path & path)
 
     sink.preallocateContents(size);
 
+    /* Move the contents in 1 MiB chunks; the file has already been
+       preallocated above, so bigger chunks just mean fewer write
+       syscalls for the large files that dominate restore time. */
     unsigned long long left = size;
-    unsigned char buf[65536];
+    std::vector<unsigned char> buf(std::min((unsigned long long) 1024 * 1024, size));
 
     while (left) {
         checkInterrupt();
-        unsigned int n = sizeof(buf);
-        if ((unsigned long long) n > left) n = left;
-        source(buf, n);
-        sink.receiveContents(buf, n);
+        unsigned long long n = buf.size();
+        if (n > left) n = left;
+        source(buf.data(), n);
+        sink.receiveContents(buf.data(), n);
         left -= n;
     }
 
@@ -11,124 +11,196 @@
 
 namespace nix {
 
-static ref<std::string> decompressXZ(const std::string & in)
+ref<std::string> compress(const std::string & method, const std::string & in, const bool parallel)
 {
-    lzma_stream strm(LZMA_STREAM_INIT);
+    StringSink ssink;
+    auto sink = makeCompressionSink(method, ssink, parallel);
+    (*sink)(in);
+    sink->finish();
+    return ssink.s;
+}
 
-    lzma_ret ret = lzma_stream_decoder(
-        &strm, UINT64_MAX, LZMA_CONCATENATED);
-    if (ret != LZMA_OK)
-        throw CompressionError("unable to initialise lzma decoder");
+ref<std::string> decompress(const std::string & method, const std::string & in)
+{
+    StringSink ssink;
+    auto sink = makeDecompressionSink(method, ssink);
+    (*sink)(in);
+    sink->finish();
+    return ssink.s;
+}
 
-    Finally free([&]() { lzma_end(&strm); });
+struct NoneSink : CompressionSink
+{
+    Sink & nextSink;
+    NoneSink(Sink & nextSink) : nextSink(nextSink) { }
+    void finish() override { flush(); }
+    void write(const unsigned char * data, size_t len) override { nextSink(data, len); }
+};
 
-    lzma_action action = LZMA_RUN;
+struct XzDecompressionSink : CompressionSink
+{
+    Sink & nextSink;
     uint8_t outbuf[BUFSIZ];
-    ref<std::string> res = make_ref<std::string>();
-    strm.next_in = (uint8_t *) in.c_str();
-    strm.avail_in = in.size();
-    strm.next_out = outbuf;
-    strm.avail_out = sizeof(outbuf);
+    lzma_stream strm = LZMA_STREAM_INIT;
+    bool finished = false;
 
-    while (true) {
-        checkInterrupt();
+    XzDecompressionSink(Sink & nextSink) : nextSink(nextSink)
+    {
+        lzma_ret ret = lzma_stream_decoder(
+            &strm, UINT64_MAX, LZMA_CONCATENATED);
+        if (ret != LZMA_OK)
+            throw CompressionError("unable to initialise lzma decoder");
+
+        strm.next_out = outbuf;
+        strm.avail_out = sizeof(outbuf);
+    }
 
-        if (strm.avail_in == 0)
-            action = LZMA_FINISH;
+    ~XzDecompressionSink()
+    {
+        lzma_end(&strm);
+    }
 
-        lzma_ret ret = lzma_code(&strm, action);
+    void finish() override
+    {
+        CompressionSink::flush();
 
-        if (strm.avail_out == 0 || ret == LZMA_STREAM_END) {
-            res->append((char *) outbuf, sizeof(outbuf) - strm.avail_out);
-            strm.next_out = outbuf;
-            strm.avail_out = sizeof(outbuf);
+        assert(!finished);
+        finished = true;
+
+        strm.next_in = nullptr;
+        strm.avail_in = 0;
+
+        while (true) {
+            checkInterrupt();
+
+            lzma_ret ret = lzma_code(&strm, LZMA_FINISH);
+            if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+                throw CompressionError("error %d while decompressing xz file", ret);
+
+            if (strm.avail_out == 0 || ret == LZMA_STREAM_END) {
+                nextSink(outbuf, sizeof(outbuf) - strm.avail_out);
+                strm.next_out = outbuf;
+                strm.avail_out = sizeof(outbuf);
+            }
+
+            if (ret == LZMA_STREAM_END) break;
         }
+    }
+
+    void write(const unsigned char * data, size_t len) override
+    {
+        strm.next_in = data;
+        strm.avail_in = len;
 
-        if (ret == LZMA_STREAM_END)
-            return res;
+        while (strm.avail_in) {
+            checkInterrupt();
 
-        if (ret != LZMA_OK)
-            throw CompressionError("error %d while decompressing xz file", ret);
+            lzma_ret ret = lzma_code(&strm, LZMA_RUN);
+            if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+                throw CompressionError("error %d while decompressing xz file", ret);
+
+            if (strm.avail_out == 0 || ret == LZMA_STREAM_END) {
+                nextSink(outbuf, sizeof(outbuf) - strm.avail_out);
+                strm.next_out = outbuf;
+                strm.avail_out = sizeof(outbuf);
+            }
+        }
     }
-}
+};
 
-static ref<std::string> decompressBzip2(const std::string & in)
+struct BzipDecompressionSink : CompressionSink
 {
+    Sink & nextSink;
+    char outbuf[BUFSIZ];
     bz_stream strm;
-    memset(&strm, 0, sizeof(strm));
+    bool finished = false;
 
-    int ret = BZ2_bzDecompressInit(&strm, 0, 0);
-    if (ret != BZ_OK)
-        throw CompressionError("unable to initialise bzip2 decoder");
+    BzipDecompressionSink(Sink & nextSink) : nextSink(nextSink)
+    {
+        memset(&strm, 0, sizeof(strm));
+        int ret = BZ2_bzDecompressInit(&strm, 0, 0);
+        if (ret != BZ_OK)
+            throw CompressionError("unable to initialise bzip2 decoder");
 
-    Finally free([&]() { BZ2_bzDecompressEnd(&strm); });
+        strm.next_out = outbuf;
+        strm.avail_out = sizeof(outbuf);
+    }
 
-    char outbuf[BUFSIZ];
-    ref<std::string> res = make_ref<std::string>();
-    strm.next_in = (char *) in.c_str();
-    strm.avail_in = in.size();
-    strm.next_out = outbuf;
-    strm.avail_out = sizeof(outbuf);
+    ~BzipDecompressionSink()
+    {
+        BZ2_bzDecompressEnd(&strm);
+    }
 
-    while (true) {
-        checkInterrupt();
+    void finish() override
+    {
+        CompressionSink::flush();
+        if (!finished)
+            throw CompressionError("bzip2 data ends prematurely");
+    }
 
-        int ret = BZ2_bzDecompress(&strm);
+    void write(const unsigned char * data, size_t len) override
+    {
+        assert(!finished);
 
-        if (strm.avail_out == 0 || ret == BZ_STREAM_END) {
-            res->append(outbuf, sizeof(outbuf) - strm.avail_out);
-            strm.next_out = outbuf;
-            strm.avail_out = sizeof(outbuf);
-        }
+        strm.next_in = (char *) data;
+        strm.avail_in = len;
 
-        if (ret == BZ_STREAM_END)
-            return res;
+        while (strm.avail_in) {
+            checkInterrupt();
 
-        if (ret != BZ_OK)
-            throw CompressionError("error while decompressing bzip2 file");
+            int ret = BZ2_bzDecompress(&strm);
+            if (ret != BZ_OK && ret != BZ_STREAM_END)
+                throw CompressionError("error while decompressing bzip2 file");
 
-        if (strm.avail_in == 0)
-            throw CompressionError("bzip2 data ends prematurely");
+            if (strm.avail_out == 0 || ret == BZ_STREAM_END) {
+                nextSink((unsigned char *) outbuf, sizeof(outbuf) - strm.avail_out);
+                strm.next_out = outbuf;
+                strm.avail_out = sizeof(outbuf);
+            }
+
+            if (ret == BZ_STREAM_END) {
+                finished = true;
+                break;
+            }
+        }
     }
-}
+};
 
-static ref<std::string> decompressBrotli(const std::string & in)
+struct BrotliDecompressionSink : CompressionSink
 {
-    // FIXME: use libbrotli
-    return make_ref<std::string>(runProgram(BRO, true, {"-d"}, {in}));
-}
+    Sink & nextSink;
+    std::string data;
 
-ref<std::string> compress(const std::string & method, const std::string & in)
-{
-    StringSink ssink;
-    auto sink = makeCompressionSink(method, ssink);
-    (*sink)(in);
-    sink->finish();
-    return ssink.s;
-}
+    BrotliDecompressionSink(Sink & nextSink) : nextSink(nextSink) { }
 
-ref<std::string> decompress(const std::string & method, const std::string & in)
+    void finish() override
+    {
+        flush();
+        /* FIXME: use libbrotli instead of buffering and shelling
+           out. */
+        nextSink(runProgram(BRO, true, {"-d"}, {data}));
+    }
+
+    void write(const unsigned char * data, size_t len) override
+    {
+        this->data.append((const char *) data, len);
+    }
+};
+
+ref<CompressionSink> makeDecompressionSink(const std::string & method, Sink & nextSink)
 {
     if (method == "none")
-        return make_ref<std::string>(in);
+        return make_ref<NoneSink>(nextSink);
     else if (method == "xz")
-        return decompressXZ(in);
+        return make_ref<XzDecompressionSink>(nextSink);
     else if (method == "bzip2")
-        return decompressBzip2(in);
+        return make_ref<BzipDecompressionSink>(nextSink);
     else if (method == "br")
-        return decompressBrotli(in);
+        return make_ref<BrotliDecompressionSink>(nextSink);
     else
         throw UnknownCompressionMethod(format("unknown compression method '%s'") % method);
 }
 
-struct NoneSink : CompressionSink
-{
-    Sink & nextSink;
-    NoneSink(Sink & nextSink) : nextSink(nextSink) { }
-    void finish() override { flush(); }
-    void write(const unsigned char * data, size_t len) override { nextSink(data, len); }
-};
-
 struct XzSink : CompressionSink
 {
     Sink & nextSink;
@@ -136,10 +208,34 @@ struct XzSink : CompressionSink
     lzma_stream strm = LZMA_STREAM_INIT;
     bool finished = false;
 
-    XzSink(Sink & nextSink) : nextSink(nextSink)
+    XzSink(Sink & nextSink, const bool parallel = false) : nextSink(nextSink)
     {
-        lzma_ret ret = lzma_easy_encoder(
-            &strm, 6, LZMA_CHECK_CRC64);
+        lzma_ret ret;
+        bool done = false;
+
+        if (parallel) {
+#ifdef HAVE_LZMA_MT
+            lzma_mt mt_options = {};
+            mt_options.flags = 0;
+            mt_options.timeout = 300; // Using the same setting as the xz cmd line
+            mt_options.preset = LZMA_PRESET_DEFAULT;
+            mt_options.filters = NULL;
+            mt_options.check = LZMA_CHECK_CRC64;
+            mt_options.threads = lzma_cputhreads();
+            mt_options.block_size = 0;
+            if (mt_options.threads == 0)
+                mt_options.threads = 1;
+            // FIXME: maybe use lzma_stream_buffer_encode here?
+            ret = lzma_stream_encoder_mt(&strm, &mt_options);
+            done = true;
+#else
+            printMsg(lvlError, "warning: parallel compression requested but not supported for method '%1%', falling back to single-threaded compression", "xz");
+#endif
+        }
+
+        if (!done)
+            ret = lzma_easy_encoder(&strm, 6, LZMA_CHECK_CRC64);
+
         if (ret != LZMA_OK)
             throw CompressionError("unable to initialise lzma encoder");
         // FIXME: apply the x86 BCJ filter?
@@ -298,12 +394,12 @@ struct BrotliSink : CompressionSink
     }
 };
 
-ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink)
+ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel)
 {
     if (method == "none")
         return make_ref<NoneSink>(nextSink);
     else if (method == "xz")
-        return make_ref<XzSink>(nextSink);
+        return make_ref<XzSink>(nextSink, parallel);
     else if (method == "bzip2")
         return make_ref<BzipSink>(nextSink);
     else if (method == "br")
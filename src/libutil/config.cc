@@ -65,13 +65,13 @@ void Config::applyConfigFile(const Path & path, bool fatal)
     try {
         string contents = readFile(path);
 
-        unsigned int pos = 0;
+        string::size_type pos = 0;
 
         while (pos < contents.size()) {
-            string line;
-            while (pos < contents.size() && contents[pos] != '\n')
-                line += contents[pos++];
-            pos++;
+            auto eol = contents.find('\n', pos);
+            if (eol == string::npos) eol = contents.size();
+            string line(contents, pos, eol - pos);
+            pos = eol + 1;
 
             string::size_type hash = line.find('#');
             if (hash != string::npos)
@@ -89,7 +89,7 @@ void Config::applyConfigFile(const Path & path, bool fatal)
             advance(i, 2);
 
             try {
-                set(name, concatStringsSep(" ", Strings(i, tokens.end()))); // FIXME: slow
+                set(name, concatStringsSep(" ", Strings(i, tokens.end())));
             } catch (UsageError & e) {
                 if (fatal) throw;
                 warn("in configuration file '%s': %s", path, e.what());
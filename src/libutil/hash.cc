@@ -72,6 +72,14 @@ static string printHash16(const Hash & hash)
 // omitted: E O U T
 const string base32Chars = "0123456789abcdfghijklmnpqrsvwxyz";
 
+/* Reverse mapping of base32Chars; invalid characters map to 0xff. */
+static const std::vector<unsigned char> base32CharsReverse = []() {
+    std::vector<unsigned char> t(256, 0xff);
+    for (unsigned int i = 0; i < base32Chars.size(); i++)
+        t[(unsigned char) base32Chars[i]] = i;
+    return t;
+}();
+
 
 static string printHash32(const Hash & hash)
 {
@@ -79,8 +87,7 @@ static string printHash32(const Hash & hash)
     size_t len = hash.base32Len();
     assert(len);
 
-    string s;
-    s.reserve(len);
+    string s(len, '0');
 
     for (int n = len - 1; n >= 0; n--) {
         unsigned int b = n * 5;
@@ -89,7 +96,7 @@ static string printHash32(const Hash & hash)
         unsigned char c =
             (hash.hash[i] >> j)
             | (i >= hash.hashSize - 1 ? 0 : hash.hash[i + 1] << (8 - j));
-        s.push_back(base32Chars[c & 0x1f]);
+        s[len - 1 - n] = base32Chars[c & 0x1f];
     }
 
     return s;
@@ -168,9 +175,7 @@ Hash::Hash(const std::string & s, HashType type)
 
         for (unsigned int n = 0; n < size; ++n) {
             char c = s[pos + size - n - 1];
-            unsigned char digit;
-            for (digit = 0; digit < base32Chars.size(); ++digit) /* !!! slow */
-                if (base32Chars[digit] == c) break;
+            unsigned char digit = base32CharsReverse[(unsigned char) c];
             if (digit >= 32)
                 throw BadHash("invalid base-32 hash '%s'", s);
             unsigned int b = n * 5;
@@ -8,14 +8,26 @@ namespace nix {
 void toJSON(std::ostream & str, const char * start, const char * end)
 {
     str << '"';
-    for (auto i = start; i != end; i++)
+    auto i = start;
+    while (i != end) {
+        /* Write the longest run that needs no escaping in one go
+           instead of pushing bytes through the stream one at a
+           time. */
+        auto j = i;
+        while (j != end && *j != '"' && *j != '\\' && !(*j >= 0 && *j < 32)) j++;
+        if (j != i) {
+            str.write(i, j - i);
+            i = j;
+            continue;
+        }
         if (*i == '\"' || *i == '\\') str << '\\' << *i;
         else if (*i == '\n') str << "\\n";
         else if (*i == '\r') str << "\\r";
         else if (*i == '\t') str << "\\t";
-        else if (*i >= 0 && *i < 32)
+        else
             str << "\\u" << std::setfill('0') << std::setw(4) << std::hex << (uint16_t) *i << std::dec;
-        else str << *i;
+        i++;
+    }
     str << '"';
 }
 
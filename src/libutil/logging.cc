@@ -1,7 +1,10 @@
 #include "logging.hh"
 #include "util.hh"
+#include "sync.hh"
 
 #include <atomic>
+#include <deque>
+#include <thread>
 
 namespace nix {
 
@@ -41,7 +44,123 @@ public:
             prefix = std::string("<") + c + ">";
         }
 
-        writeToStderr(prefix + (tty ? fs.s : filterANSIEscapes(fs.s)) + "\n");
+        /* Filtering escape codes rewrites the string character by
+           character, so skip it when there are none. */
+        bool filter = !tty && fs.s.find('\e') != std::string::npos;
+
+        writeToStderr(prefix + (filter ? filterANSIEscapes(fs.s) : fs.s) + "\n");
+    }
+};
+
+/* A logger that hands messages to a background thread, so that the
+   thread doing the actual work doesn't block on formatting or
+   stderr. Used for chatty verbosity levels where synchronous logging
+   measurably slows down the builder loop. */
+class AsyncLogger : public Logger
+{
+    Logger * inner;
+    size_t maxQueued;
+
+    struct Item
+    {
+        Verbosity lvl;
+        std::string s;
+    };
+
+    struct State
+    {
+        std::deque<Item> queue;
+        uint64_t dropped = 0;
+        bool quit = false;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup, drained;
+    std::thread writer;
+
+public:
+
+    AsyncLogger(Logger * inner, size_t maxQueued)
+        : inner(inner), maxQueued(maxQueued)
+    {
+        writer = std::thread([this]() { run(); });
+    }
+
+    ~AsyncLogger()
+    {
+        {
+            auto state(state_.lock());
+            state->quit = true;
+            wakeup.notify_one();
+        }
+        writer.join();
+        delete inner;
+    }
+
+    void log(Verbosity lvl, const FormatOrString & fs) override
+    {
+        if (lvl > verbosity) return;
+
+        {
+            auto state(state_.lock());
+            if (state->queue.size() >= maxQueued) {
+                /* The writer can't keep up; shed low-priority
+                   messages rather than stall the caller. */
+                if (lvl > lvlError) {
+                    state->dropped++;
+                    return;
+                }
+            }
+            state->queue.push_back(Item{lvl, fs.s});
+            wakeup.notify_one();
+
+            /* Errors are usually the last thing printed before an
+               abnormal exit, so don't let them linger in the queue. */
+            if (lvl == lvlError)
+                while (!state->queue.empty())
+                    state.wait(drained);
+        }
+    }
+
+    void startActivity(ActivityId act, ActivityType type, const std::string & s) override
+    { inner->startActivity(act, type, s); }
+
+    void stopActivity(ActivityId act) override
+    { inner->stopActivity(act); }
+
+    void progress(ActivityId act, uint64_t done, uint64_t expected, uint64_t running, uint64_t failed) override
+    { inner->progress(act, done, expected, running, failed); }
+
+    void setExpected(ActivityId act, ActivityType type, uint64_t expected) override
+    { inner->setExpected(act, type, expected); }
+
+    void result(ActivityId act, ResultType type, const std::vector<Field> & fields) override
+    { inner->result(act, type, fields); }
+
+private:
+
+    void run()
+    {
+        while (true) {
+            Item item;
+            {
+                auto state(state_.lock());
+                while (state->queue.empty() && !state->quit) {
+                    if (state->dropped) {
+                        auto n = state->dropped;
+                        state->dropped = 0;
+                        inner->log(lvlError, fmt("(%1% messages dropped)", n));
+                    }
+                    state.wait(wakeup);
+                }
+                if (state->queue.empty()) return;
+                item = std::move(state->queue.front());
+                state->queue.pop_front();
+                if (state->queue.empty())
+                    drained.notify_all();
+            }
+            inner->log(item.lvl, item.s);
+        }
     }
 };
 
@@ -69,7 +188,17 @@ void writeToStderr(const string & s)
 
 Logger * makeDefaultLogger()
 {
-    return new SimpleLogger();
+    Logger * l = new SimpleLogger();
+    /* Opt-in, since messages queued at the time of an abnormal exit
+       (other than errors, which are flushed) are lost. */
+    if (getEnv("NIX_ASYNC_LOG") == "1")
+        l = makeAsyncLogger(l);
+    return l;
+}
+
+Logger * makeAsyncLogger(Logger * inner, size_t maxQueued)
+{
+    return new AsyncLogger(inner, maxQueued);
 }
 
 std::atomic<uint64_t> nextId{(uint64_t) getpid() << 32};
@@ -107,6 +107,14 @@ extern Logger * logger;
 
 Logger * makeDefaultLogger();
 
+/* Wrap a logger so that messages are queued and written by a
+   background thread, keeping formatting and I/O off the calling
+   thread. Messages of level lvlError are flushed synchronously. If
+   more than 'maxQueued' messages are pending, further ones are
+   dropped and the number of drops is reported once the queue
+   drains. */
+Logger * makeAsyncLogger(Logger * inner, size_t maxQueued = 8192);
+
 extern Verbosity verbosity; /* suppress msgs > this */
 
 /* Print a message if the current log level is at least the specified
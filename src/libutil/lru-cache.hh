@@ -1,7 +1,8 @@
 #pragma once
 
-#include <map>
+#include <cassert>
 #include <list>
+#include <unordered_map>
 
 namespace nix {
 
@@ -13,14 +14,12 @@ private:
 
     size_t capacity;
 
-    // Stupid wrapper to get around circular dependency between Data
-    // and LRU.
-    struct LRUIterator;
-
-    using Data = std::map<Key, std::pair<LRUIterator, Value>>;
-    using LRU = std::list<typename Data::iterator>;
-
-    struct LRUIterator { typename LRU::iterator it; };
+    /* Stored in order of use, least recently used first.  Keeping the
+       key/value pairs in the list itself makes a get() a single hash
+       lookup plus a splice(), with no tree rebalancing or node
+       allocation. */
+    using LRU = std::list<std::pair<Key, Value>>;
+    using Data = std::unordered_map<Key, typename LRU::iterator>;
 
     Data data;
     LRU lru;
@@ -39,24 +38,21 @@ public:
         if (data.size() >= capacity) {
             /* Retire the oldest item. */
             auto oldest = lru.begin();
-            data.erase(*oldest);
+            data.erase(oldest->first);
             lru.erase(oldest);
         }
 
-        auto res = data.emplace(key, std::make_pair(LRUIterator(), value));
-        assert(res.second);
-        auto & i(res.first);
+        auto j = lru.insert(lru.end(), {key, value});
 
-        auto j = lru.insert(lru.end(), i);
-
-        i->second.first.it = j;
+        auto res = data.emplace(key, j);
+        assert(res.second);
     }
 
     bool erase(const Key & key)
     {
         auto i = data.find(key);
         if (i == data.end()) return false;
-        lru.erase(i->second.first.it);
+        lru.erase(i->second);
         data.erase(i);
         return true;
     }
@@ -69,12 +65,12 @@ public:
         auto i = data.find(key);
         if (i == data.end()) return 0;
 
-        /* Move this item to the back of the LRU list. */
-        lru.erase(i->second.first.it);
-        auto j = lru.insert(lru.end(), i);
-        i->second.first.it = j;
+        /* Move this item to the back of the LRU list.  splice()
+           relinks the existing node, so the iterator stored in 'data'
+           stays valid. */
+        lru.splice(lru.end(), lru, i->second);
 
-        return &i->second.second;
+        return &i->second->second;
     }
 
     size_t size()
@@ -1,9 +1,12 @@
 #pragma once
 
+#include <algorithm>
+#include <chrono>
 #include <functional>
 #include <limits>
 #include <list>
 #include <memory>
+#include <vector>
 #include <cassert>
 
 #include "sync.hh"
@@ -45,24 +48,52 @@ private:
     Factory factory;
     Validator validator;
 
+    /* How long a resource may sit idle before it is closed, or zero
+       to keep idle resources forever. */
+    std::chrono::seconds maxIdleTime;
+
+    /* An idle resource, together with the time it was last
+       returned to the pool. */
+    struct Idle
+    {
+        ref<R> r;
+        std::chrono::steady_clock::time_point lastUsed;
+    };
+
     struct State
     {
         size_t inUse = 0;
         size_t max;
-        std::vector<ref<R>> idle;
+        std::vector<Idle> idle;
     };
 
     Sync<State> state;
 
     std::condition_variable wakeup;
 
+    /* Drop idle resources that have not been used for longer than
+       maxIdleTime. Must be called with the state lock held. */
+    void evictStale(State & state_)
+    {
+        if (maxIdleTime == std::chrono::seconds(0)) return;
+        auto deadline = std::chrono::steady_clock::now() - maxIdleTime;
+        auto & idle = state_.idle;
+        /* The list is in order of return, so stale entries are at the
+           front. */
+        auto i = idle.begin();
+        while (i != idle.end() && i->lastUsed < deadline) ++i;
+        idle.erase(idle.begin(), i);
+    }
+
 public:
 
     Pool(size_t max = std::numeric_limits<size_t>::max(),
         const Factory & factory = []() { return make_ref<R>(); },
-        const Validator & validator = [](ref<R> r) { return true; })
+        const Validator & validator = [](ref<R> r) { return true; },
+        std::chrono::seconds maxIdleTime = std::chrono::seconds(0))
         : factory(factory)
         , validator(validator)
+        , maxIdleTime(maxIdleTime)
     {
         auto state_(state.lock());
         state_->max = max;
@@ -112,7 +143,7 @@ public:
             if (!r) return;
             {
                 auto state_(pool.state.lock());
-                state_->idle.push_back(ref<R>(r));
+                state_->idle.push_back(Idle{ref<R>(r), std::chrono::steady_clock::now()});
                 assert(state_->inUse);
                 state_->inUse--;
             }
@@ -133,8 +164,12 @@ public:
             while (state_->idle.empty() && state_->inUse >= state_->max)
                 state_.wait(wakeup);
 
+            evictStale(*state_);
+
+            /* Reuse the most recently returned resource, so that
+               rarely used ones at the front age out. */
             while (!state_->idle.empty()) {
-                auto p = state_->idle.back();
+                auto p = state_->idle.back().r;
                 state_->idle.pop_back();
                 if (validator(p)) {
                     state_->inUse++;
@@ -158,6 +193,25 @@ public:
         }
     }
 
+    /* Create resources until the pool holds at least ‘n’ of them (or
+       ‘max’, whichever is smaller), so that a subsequent burst of
+       get() calls doesn't pay the creation latency. */
+    void warmUp(size_t n)
+    {
+        while (true) {
+            {
+                auto state_(state.lock());
+                if (state_->idle.size() + state_->inUse >= std::min(n, state_->max))
+                    return;
+            }
+            /* Create the resource without holding the lock, like
+               get() does. */
+            auto r = factory();
+            auto state_(state.lock());
+            state_->idle.push_back(Idle{r, std::chrono::steady_clock::now()});
+        }
+    }
+
     size_t count()
     {
         auto state_(state.lock());
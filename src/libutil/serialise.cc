@@ -5,6 +5,8 @@
 #include <cerrno>
 #include <memory>
 
+#include <sys/uio.h>
+
 
 namespace nix {
 
@@ -17,8 +19,15 @@ void BufferedSink::operator () (const unsigned char * data, size_t len)
         /* Optimisation: bypass the buffer if the data exceeds the
            buffer size. */
         if (bufPos + len >= bufSize) {
-            flush();
-            write(data, len);
+            /* Hand any buffered bytes and the payload to the
+               subclass together, so that it can use a single
+               (vectored) write. */
+            size_t n = bufPos;
+            bufPos = 0;
+            if (n)
+                write2(buffer.get(), n, data, len);
+            else
+                write(data, len);
             break;
         }
         /* Otherwise, copy the bytes to the buffer.  Flush the buffer
@@ -48,6 +57,8 @@ FdSink::~FdSink()
 
 size_t threshold = 256 * 1024 * 1024;
 
+static bool warned = false;
+
 static void warnLargeDump()
 {
     printError("warning: dumping very large path (> 256 MiB); this may run out of memory");
@@ -57,7 +68,6 @@ static void warnLargeDump()
 void FdSink::write(const unsigned char * data, size_t len)
 {
     written += len;
-    static bool warned = false;
     if (warn && !warned) {
         if (written > threshold) {
             warnLargeDump();
@@ -72,6 +82,45 @@ void FdSink::write(const unsigned char * data, size_t len)
 }
 
 
+void FdSink::write2(const unsigned char * data1, size_t len1,
+    const unsigned char * data2, size_t len2)
+{
+    written += len1 + len2;
+    if (warn && !warned) {
+        if (written > threshold) {
+            warnLargeDump();
+            warned = true;
+        }
+    }
+    try {
+        struct iovec iov[2];
+        iov[0].iov_base = (void *) data1;
+        iov[0].iov_len = len1;
+        iov[1].iov_base = (void *) data2;
+        iov[1].iov_len = len2;
+        int cur = 0;
+        while (cur < 2) {
+            checkInterrupt();
+            ssize_t n = writev(fd, iov + cur, 2 - cur);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("writing to file");
+            }
+            while (cur < 2 && (size_t) n >= iov[cur].iov_len) {
+                n -= iov[cur].iov_len;
+                cur++;
+            }
+            if (cur < 2) {
+                iov[cur].iov_base = (char *) iov[cur].iov_base + n;
+                iov[cur].iov_len -= n;
+            }
+        }
+    } catch (SysError & e) {
+        _good = true;
+    }
+}
+
+
 bool FdSink::good()
 {
     return _good;
@@ -164,9 +213,24 @@ Sink & operator << (Sink & sink, const string & s)
 
 template<class T> void writeStrings(const T & ss, Sink & sink)
 {
-    sink << ss.size();
+    /* Small lists aren't worth a heap allocation. */
+    if (ss.size() < 16) {
+        sink << ss.size();
+        for (auto & i : ss)
+            sink << i;
+        return;
+    }
+
+    /* Big lists go through a flat frame, so the whole message is
+       built with inlined appends and crosses the virtual Sink
+       interface exactly once. */
+    FrameBuilder frame;
+    size_t len = 8;
     for (auto & i : ss)
-        sink << i;
+        len += 8 + ((i.size() + 7) & ~(size_t) 7);
+    frame.buf.reserve(len);
+    frame.appendStrings(ss);
+    frame.flushTo(sink);
 }
 
 Sink & operator << (Sink & sink, const Strings & s)
@@ -46,12 +46,48 @@ void ThreadPool::enqueue(const work_t & t)
 
 void ThreadPool::process()
 {
+    /* Instead of just waiting for the workers, the calling thread
+       processes work items as well, so that a pool is useful even
+       before any worker thread has been spawned and the caller's
+       core doesn't idle. */
     while (true) {
-        auto state(state_.lock());
-        if (state->exception)
-            std::rethrow_exception(state->exception);
-        if (state->left.empty() && !state->pending) break;
-        state.wait(done);
+        work_t w;
+        {
+            auto state(state_.lock());
+            if (state->exception)
+                std::rethrow_exception(state->exception);
+            if (state->left.empty()) {
+                if (!state->pending) break;
+                state.wait(done);
+                continue;
+            }
+            w = std::move(state->left.front());
+            state->left.pop();
+            state->pending++;
+        }
+
+        try {
+            w();
+        } catch (std::exception & e) {
+            auto state(state_.lock());
+            if (state->exception) {
+                if (!dynamic_cast<Interrupted*>(&e) &&
+                    !dynamic_cast<ThreadPoolShutDown*>(&e))
+                    printError(format("error: %s") % e.what());
+            } else {
+                state->exception = std::current_exception();
+                work.notify_all();
+                done.notify_all();
+            }
+        }
+
+        {
+            auto state(state_.lock());
+            assert(state->pending);
+            state->pending--;
+            if (state->left.empty() && !state->pending)
+                done.notify_all();
+        }
     }
 }
 
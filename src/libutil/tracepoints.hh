@@ -0,0 +1,25 @@
+#pragma once
+
+/* Statically-defined tracepoints (USDT).  These compile to a single
+   nop when not traced, so they can stay in production builds;
+   bpftrace, perf or systemtap can attach to them by name under the
+   'nix' provider.  When <sys/sdt.h> is not available at configure
+   time they expand to nothing. */
+
+#if HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define NIX_PROBE(name) DTRACE_PROBE(nix, name)
+#define NIX_PROBE1(name, a1) DTRACE_PROBE1(nix, name, a1)
+#define NIX_PROBE2(name, a1, a2) DTRACE_PROBE2(nix, name, a1, a2)
+#define NIX_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(nix, name, a1, a2, a3)
+
+#else
+
+#define NIX_PROBE(name)
+#define NIX_PROBE1(name, a1)
+#define NIX_PROBE2(name, a1, a2)
+#define NIX_PROBE3(name, a1, a2, a3)
+
+#endif
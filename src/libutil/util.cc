@@ -18,6 +18,7 @@
 #include <limits.h>
 #include <pwd.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -279,10 +280,13 @@ string readFile(int fd)
     if (fstat(fd, &st) == -1)
         throw SysError("statting file");
 
-    auto buf = std::make_unique<unsigned char[]>(st.st_size);
-    readFull(fd, buf.get(), st.st_size);
+    /* Read straight into the result; going through a separate buffer
+       allocated and copied every file twice. */
+    string s;
+    s.resize(st.st_size);
+    if (st.st_size) readFull(fd, (unsigned char *) &s[0], st.st_size);
 
-    return string((char *) buf.get(), st.st_size);
+    return s;
 }
 
 
@@ -570,6 +574,80 @@ string drainFD(int fd)
 }
 
 
+void sendFd(int socketFd, int fd)
+{
+    /* The descriptor is attached to a single dummy byte so that it
+       has a definite position in the byte stream. */
+    char ch = 0;
+    struct iovec iov;
+    iov.iov_base = &ch;
+    iov.iov_len = 1;
+
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } cmsgbuf;
+    memset(&cmsgbuf, 0, sizeof(cmsgbuf));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgbuf.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int));
+
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    while (sendmsg(socketFd, &msg, 0) == -1) {
+        if (errno != EINTR) throw SysError("sending file descriptor");
+        checkInterrupt();
+    }
+}
+
+
+AutoCloseFD receiveFd(int socketFd)
+{
+    char ch;
+    struct iovec iov;
+    iov.iov_base = &ch;
+    iov.iov_len = 1;
+
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } cmsgbuf;
+    memset(&cmsgbuf, 0, sizeof(cmsgbuf));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgbuf.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int));
+
+    ssize_t n;
+    while ((n = recvmsg(socketFd, &msg, 0)) == -1) {
+        if (errno != EINTR) throw SysError("receiving file descriptor");
+        checkInterrupt();
+    }
+    if (n != 1)
+        throw Error("unexpected EOF while receiving file descriptor");
+
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+        throw Error("message does not contain a file descriptor");
+
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return AutoCloseFD(fd);
+}
+
+
 
 //////////////////////////////////////////////////////////////////////
 
@@ -725,7 +803,7 @@ Pid::operator pid_t()
 }
 
 
-int Pid::kill()
+int Pid::kill(struct rusage * usage)
 {
     assert(pid != -1);
 
@@ -744,16 +822,16 @@ int Pid::kill()
             printError((SysError("killing process %d", pid).msg()));
     }
 
-    return wait();
+    return wait(usage);
 }
 
 
-int Pid::wait()
+int Pid::wait(struct rusage * usage)
 {
     assert(pid != -1);
     while (1) {
         int status;
-        int res = waitpid(pid, &status, 0);
+        int res = usage ? wait4(pid, &status, 0, usage) : waitpid(pid, &status, 0);
         if (res == pid) {
             pid = -1;
             return status;
@@ -997,7 +1075,7 @@ void closeOnExec(int fd)
 //////////////////////////////////////////////////////////////////////
 
 
-bool _isInterrupted = false;
+std::atomic<bool> _isInterrupted{false};
 
 static thread_local bool interruptThrown = false;
 
@@ -1029,8 +1107,7 @@ template<class C> C tokenizeString(const string & s, const string & separators)
     while (pos != string::npos) {
         string::size_type end = s.find_first_of(separators, pos + 1);
         if (end == string::npos) end = s.size();
-        string token(s, pos, end - pos);
-        result.insert(result.end(), token);
+        result.insert(result.end(), string(s, pos, end - pos));
         pos = s.find_first_not_of(separators, end);
     }
     return result;
@@ -1043,7 +1120,10 @@ template vector<string> tokenizeString(const string & s, const string & separato
 
 string concatStringsSep(const string & sep, const Strings & ss)
 {
+    size_t size = 0;
+    for (auto & i : ss) size += sep.size() + i.size();
     string s;
+    s.reserve(size);
     for (auto & i : ss) {
         if (s.size() != 0) s += sep;
         s += i;
@@ -1054,7 +1134,10 @@ string concatStringsSep(const string & sep, const Strings & ss)
 
 string concatStringsSep(const string & sep, const StringSet & ss)
 {
+    size_t size = 0;
+    for (auto & i : ss) size += sep.size() + i.size();
     string s;
+    s.reserve(size);
     for (auto & i : ss) {
         if (s.size() != 0) s += sep;
         s += i;
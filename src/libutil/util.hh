@@ -5,10 +5,12 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <signal.h>
 
+#include <atomic>
 #include <functional>
 #include <limits>
 #include <cstdio>
@@ -191,6 +193,12 @@ public:
 };
 
 
+/* Send a file descriptor to the peer of a Unix domain socket (via
+   SCM_RIGHTS), and receive one. */
+void sendFd(int socketFd, int fd);
+AutoCloseFD receiveFd(int socketFd);
+
+
 struct DIRDeleter
 {
     void operator()(DIR * dir) const {
@@ -212,8 +220,10 @@ public:
     ~Pid();
     void operator =(pid_t pid);
     operator pid_t();
-    int kill();
-    int wait();
+    /* If 'usage' is non-null, it receives the resource usage of the
+       child (and its waited-for descendants) when it is reaped. */
+    int kill(struct rusage * usage = nullptr);
+    int wait(struct rusage * usage = nullptr);
 
     void setSeparatePG(bool separatePG);
     void setKillSignal(int signal);
@@ -271,7 +281,11 @@ void closeOnExec(int fd);
 
 /* User interruption. */
 
-extern bool _isInterrupted;
+/* Set from the signal handler thread and read by every other
+   thread, so it has to be an atomic; a relaxed load suffices since
+   the flag only ever goes from false to true and carries no other
+   data. */
+extern std::atomic<bool> _isInterrupted;
 
 void setInterruptThrown();
 
@@ -279,7 +293,7 @@ void _interrupted();
 
 void inline checkInterrupt()
 {
-    if (_isInterrupted) _interrupted();
+    if (_isInterrupted.load(std::memory_order_relaxed)) _interrupted();
 }
 
 MakeError(Interrupted, BaseError)
@@ -2,6 +2,7 @@
 #include "profiles.hh"
 #include "shared.hh"
 #include "globals.hh"
+#include "thread-pool.hh"
 
 #include <iostream>
 #include <cerrno>
@@ -16,7 +17,7 @@ bool dryRun = false;
  * Of course, this makes rollbacks to before this point in time
  * impossible. */
 
-void removeOldGenerations(std::string dir)
+void removeOldGenerations(ThreadPool & pool, std::string dir)
 {
     if (access(dir.c_str(), R_OK) != 0) return;
 
@@ -36,14 +37,21 @@ void removeOldGenerations(std::string dir)
                 if (e.errNo == ENOENT) continue;
             }
             if (link.find("link") != string::npos) {
-                printInfo(format("removing old generations of profile %1%") % path);
-                if (deleteOlderThan != "")
-                    deleteGenerationsOlderThan(path, deleteOlderThan, dryRun);
-                else
-                    deleteOldGenerations(path, dryRun);
+                /* Profiles are pruned in parallel: each holds its own
+                   profile lock, and on multi-user machines with
+                   hundreds of profiles the per-profile directory
+                   scans dominate this pre-phase. */
+                pool.enqueue([path]() {
+                    checkInterrupt();
+                    printInfo(format("removing old generations of profile %1%") % path);
+                    if (deleteOlderThan != "")
+                        deleteGenerationsOlderThan(path, deleteOlderThan, dryRun);
+                    else
+                        deleteOldGenerations(path, dryRun);
+                });
             }
         } else if (type == DT_DIR) {
-            removeOldGenerations(path);
+            removeOldGenerations(pool, path);
         }
     }
 }
@@ -78,7 +86,14 @@ int main(int argc, char * * argv)
         });
 
         auto profilesDir = settings.nixStateDir + "/profiles";
-        if (removeOld) removeOldGenerations(profilesDir);
+        if (removeOld) {
+            ThreadPool pool;
+            removeOldGenerations(pool, profilesDir);
+            /* All deletions must have finished before the collector
+               starts reading GC roots, or a generation we are about
+               to unlink could still be picked up as a root. */
+            pool.process();
+        }
 
         // Run the actual garbage collector.
         if (!dryRun) {
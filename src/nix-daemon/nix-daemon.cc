@@ -10,6 +10,7 @@
 #include "derivations.hh"
 
 #include <algorithm>
+#include <chrono>
 
 #include <cstring>
 #include <unistd.h>
@@ -295,6 +296,66 @@ static void performOp(ref<LocalStore> store, bool trusted, unsigned int clientVe
         break;
     }
 
+    case wopAddMultipleToStore: {
+        /* Like wopAddToStore, but many paths in a single exchange.
+           All NARs are read off the socket before the work phase
+           starts, since stderr cannot be forwarded while we are
+           still consuming the client's input.  This op is meant for
+           large numbers of small paths, so buffering them is
+           acceptable. */
+        struct Entry {
+            std::string baseName;
+            bool recursive;
+            bool regular = true;
+            HashType hashAlgo;
+            std::string data;
+        };
+
+        unsigned int n = readInt(from);
+        std::vector<Entry> entries;
+        entries.reserve(n);
+
+        for (unsigned int i = 0; i < n; i++) {
+            Entry entry;
+            bool fixed;
+            std::string s;
+            from >> entry.baseName >> fixed /* obsolete */ >> entry.recursive >> s;
+            /* Compatibility hack. */
+            if (!fixed) {
+                s = "sha256";
+                entry.recursive = true;
+            }
+            entry.hashAlgo = parseHashType(s);
+
+            TeeSource savedNAR(from);
+            RetrieveRegularNARSink savedRegular;
+
+            if (entry.recursive) {
+                ParseSink sink; /* null sink; just parse the NAR */
+                parseDump(sink, savedNAR);
+                entry.data = std::move(*savedNAR.data);
+            } else {
+                parseDump(savedRegular, from);
+                entry.regular = savedRegular.regular;
+                entry.data = std::move(savedRegular.s);
+            }
+
+            entries.push_back(std::move(entry));
+        }
+
+        startWork();
+        Paths paths;
+        for (auto & entry : entries) {
+            if (!entry.regular) throw Error("regular file expected");
+            paths.push_back(store->addToStoreFromDump(
+                entry.data, entry.baseName, entry.recursive, entry.hashAlgo));
+        }
+        stopWork();
+
+        to << paths;
+        break;
+    }
+
     case wopAddTextToStore: {
         string suffix = readString(from);
         string s = readString(from);
@@ -626,6 +687,60 @@ static void performOp(ref<LocalStore> store, bool trusted, unsigned int clientVe
         break;
     }
 
+    case wopAddToStoreNarFd: {
+        bool repair, dontCheckSigs;
+        ValidPathInfo info;
+        info.path = readStorePath(*store, from);
+        from >> info.deriver;
+        if (!info.deriver.empty())
+            store->assertStorePath(info.deriver);
+        info.narHash = Hash(readString(from), htSHA256);
+        info.references = readStorePaths<PathSet>(*store, from);
+        from >> info.registrationTime >> info.narSize >> info.ultimate;
+        info.sigs = readStrings<StringSet>(from);
+        from >> info.ca >> repair >> dontCheckSigs;
+        if (!trusted && dontCheckSigs)
+            dontCheckSigs = false;
+        if (!trusted)
+            info.ultimate = false;
+
+        /* Tell the client we're ready, then receive the NAR as a
+           file descriptor instead of over the socket.  The contents
+           are checked against the NAR hash by addToStore(). */
+        to << 1;
+        ::to.flush();
+        AutoCloseFD narFd = receiveFd(::from.fd);
+
+        struct stat st;
+        if (fstat(narFd.get(), &st) == -1)
+            throw SysError("getting size of NAR");
+        if ((unsigned long long) st.st_size != info.narSize)
+            throw Error(format("NAR size mismatch for path '%1%'") % info.path);
+        if (lseek(narFd.get(), 0, SEEK_SET) == -1)
+            throw SysError("seeking in NAR");
+        auto nar = make_ref<std::string>(st.st_size, '\0');
+        readFull(narFd.get(), (unsigned char *) &(*nar)[0], nar->size());
+        narFd = -1;
+
+        startWork();
+        store->addToStore(info, nar, (RepairFlag) repair,
+            dontCheckSigs ? NoCheckSigs : CheckSigs, nullptr);
+        stopWork();
+        break;
+    }
+
+    case wopComputeFSClosure: {
+        PathSet paths = readStorePaths<PathSet>(*store, from);
+        bool flipDirection, includeOutputs, includeDerivers;
+        from >> flipDirection >> includeOutputs >> includeDerivers;
+        startWork();
+        PathSet res;
+        store->computeFSClosure(paths, res, flipDirection, includeOutputs, includeDerivers);
+        stopWork();
+        to << res;
+        break;
+    }
+
     case wopQueryMissing: {
         PathSet targets = readStorePaths<PathSet>(*store, from);
         startWork();
@@ -643,6 +758,40 @@ static void performOp(ref<LocalStore> store, bool trusted, unsigned int clientVe
 }
 
 
+/* If NIX_DAEMON_TRACE_FILE is set, append one line per worker op to
+   that file: "<epoch-us> <pid> <op> <duration-us>".  The file is
+   opened with O_APPEND and each line is written with a single
+   write(), so lines from the per-connection child processes don't
+   interleave.  The resulting trace captures the arrival pattern and
+   latency of real traffic, for replaying against a scratch store. */
+static AutoCloseFD openTraceFile()
+{
+    auto path = getEnv("NIX_DAEMON_TRACE_FILE");
+    if (path.empty()) return -1;
+    AutoCloseFD fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (!fd)
+        printError(format("warning: cannot open trace file '%1%'") % path);
+    return fd;
+}
+
+static void traceOp(int traceFd, WorkerOp op,
+    std::chrono::system_clock::time_point start,
+    std::chrono::steady_clock::time_point opStart)
+{
+    auto durationUs = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - opStart).count();
+    auto startUs = std::chrono::duration_cast<std::chrono::microseconds>(
+        start.time_since_epoch()).count();
+    auto line = (format("%1% %2% %3% %4%\n")
+        % startUs % getpid() % (int) op % durationUs).str();
+    try {
+        writeFull(traceFd, line, false);
+    } catch (SysError &) {
+        /* Don't let a full disk take the daemon down. */
+    }
+}
+
+
 static void processConnection(bool trusted)
 {
     MonitorFdHup monitor(from.fd);
@@ -693,6 +842,8 @@ static void processConnection(bool trusted)
         /* Process client requests. */
         unsigned int opCount = 0;
 
+        auto traceFd = openTraceFile();
+
         while (true) {
             WorkerOp op;
             try {
@@ -705,8 +856,12 @@ static void processConnection(bool trusted)
 
             opCount++;
 
+            auto opWallStart = std::chrono::system_clock::now();
+            auto opStart = std::chrono::steady_clock::now();
+
             try {
                 performOp(store, trusted, clientVersion, from, to, op);
+                if (traceFd) traceOp(traceFd.get(), op, opWallStart, opStart);
             } catch (Error & e) {
                 /* If we're not in a state where we can send replies, then
                    something went wrong processing the input of the
@@ -879,7 +1034,10 @@ static void daemonLoop(char * * argv)
         if (chdir("/") == -1) /* back to the root */
             throw SysError("cannot change current directory");
 
-        if (listen(fdSocket.get(), 5) == -1)
+        /* A deep backlog, so that bursts of short-lived clients
+           (e.g. many parallel 'nix-store -q' calls) are queued
+           instead of refused while we fork off earlier ones. */
+        if (listen(fdSocket.get(), SOMAXCONN) == -1)
             throw SysError(format("cannot listen on socket '%1%'") % socketPath);
     }
 
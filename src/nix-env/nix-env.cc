@@ -546,6 +546,18 @@ static void upgradeDerivations(Globals & globals,
         DrvInfos availElems;
         queryInstSources(*globals.state, globals.instSource, args, availElems, false);
 
+        /* Group the available derivations by package name, so that
+           each installed element is matched only against candidates
+           with the same name instead of the whole input set.  This
+           also parses each available name exactly once, and defers
+           the (evaluating) priority comparison until after the name
+           check. */
+        std::map<string, std::vector<std::pair<DrvInfos::iterator, DrvName>>> availByName;
+        for (auto j = availElems.begin(); j != availElems.end(); ++j) {
+            DrvName newName(j->queryName());
+            availByName[newName.name].emplace_back(j, std::move(newName));
+        }
+
         /* Go through all installed derivations. */
         DrvInfos newElems;
         for (auto & i : installedElems) {
@@ -567,11 +579,14 @@ static void upgradeDerivations(Globals & globals,
                    Do not upgrade if it would decrease the priority. */
                 DrvInfos::iterator bestElem = availElems.end();
                 string bestVersion;
-                for (auto j = availElems.begin(); j != availElems.end(); ++j) {
+                auto candidates = availByName.find(drvName.name);
+                if (candidates != availByName.end())
+                for (auto & candidate : candidates->second) {
+                    auto j = candidate.first;
                     if (comparePriorities(*globals.state, i, *j) > 0)
                         continue;
-                    DrvName newName(j->queryName());
-                    if (newName.name == drvName.name) {
+                    DrvName & newName = candidate.second;
+                    {
                         int d = compareVersions(drvName.version, newName.version);
                         if ((upgradeType == utLt && d < 0) ||
                             (upgradeType == utLeq && d <= 0) ||
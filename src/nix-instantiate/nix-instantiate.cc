@@ -100,6 +100,7 @@ int main(int argc, char * * argv)
         bool strict = false;
         Strings attrPaths;
         bool wantsReadWrite = false;
+        bool serve = false;
         std::map<string, string> autoArgs_;
         RepairFlag repair = NoRepair;
 
@@ -142,6 +143,8 @@ int main(int argc, char * * argv)
                 repair = Repair;
             else if (*arg == "--dry-run")
                 settings.readOnlyMode = true;
+            else if (*arg == "--serve")
+                serve = true;
             else if (*arg != "" && arg->at(0) == '-')
                 return false;
             else
@@ -170,6 +173,38 @@ int main(int argc, char * * argv)
             return;
         }
 
+        if (serve) {
+            /* Serve mode: amortise evaluator startup over many
+               requests.  Each line on stdin is a request of the form
+               '<file> [<attrpath> ...]'; the response is the normal
+               output for that file followed by an empty line.  The
+               EvalState, and with it the parse and file-evaluation
+               caches, persists across requests, so a dispatcher that
+               asks for many attributes of the same release file only
+               pays for the shared evaluation once. */
+            if (readStdin || fromArgs)
+                throw UsageError("'--serve' cannot be combined with '-' or '--expr'");
+
+            string line;
+            while (std::getline(std::cin, line)) {
+                auto tokens = tokenizeString<Strings>(line);
+                if (tokens.empty()) continue;
+                try {
+                    auto file = tokens.front();
+                    Strings reqAttrPaths(std::next(tokens.begin()), tokens.end());
+                    if (reqAttrPaths.empty()) reqAttrPaths = attrPaths;
+                    Expr * e = state.parseExprFromFile(resolveExprPath(lookupFileArg(state, file)));
+                    processExpr(state, reqAttrPaths, parseOnly, strict, autoArgs,
+                        evalOnly, outputKind, xmlOutputSourceLocation, e);
+                } catch (Error & e) {
+                    std::cout << "error: " << e.msg() << "\n";
+                }
+                /* Empty line terminates the response. */
+                std::cout << std::endl;
+            }
+            return;
+        }
+
         if (readStdin) {
             Expr * e = state.parseStdin();
             processExpr(state, attrPaths, parseOnly, strict, autoArgs,
@@ -7,6 +7,7 @@
 #include "common-opts.hh"
 #include "attr-path.hh"
 
+#include <future>
 #include <iostream>
 
 using namespace nix;
@@ -54,6 +55,7 @@ int main(int argc, char * * argv)
         string attrPath;
         std::map<string, string> autoArgs_;
         bool unpack = false;
+        bool batch = false;
         string name;
 
         parseCmdLine(argc, argv, [&](Strings::iterator & arg, const Strings::iterator & end) {
@@ -75,6 +77,8 @@ int main(int argc, char * * argv)
             }
             else if (*arg == "--unpack")
                 unpack = true;
+            else if (*arg == "--batch")
+                batch = true;
             else if (*arg == "--name")
                 name = getArg(*arg, arg, end);
             else if (parseAutoArgs(arg, end, autoArgs_))
@@ -96,6 +100,90 @@ int main(int argc, char * * argv)
 
         Bindings & autoArgs(*evalAutoArgs(state, autoArgs_));
 
+        /* In batch mode, read "URL [HASH] [NAME]" lines from stdin
+           and fetch them all through one downloader, so that the
+           connections (and this process's startup cost) are shared
+           across the whole set.  Downloads run concurrently; hashing
+           and store ingestion happen on this thread as results come
+           in. */
+        if (batch) {
+            if (fromExpr || unpack || !args.empty())
+                throw UsageError("'--batch' reads URLs from stdin and cannot be combined with '--attr', '--unpack' or URL arguments");
+
+            struct Item
+            {
+                string uri, name;
+                Hash expectedHash;
+                Path storePath;
+                std::future<DownloadResult> result;
+            };
+
+            std::list<Item> items;
+
+            string line;
+            while (std::getline(std::cin, line)) {
+                auto tokens = tokenizeString<std::vector<string>>(line);
+                if (tokens.empty() || tokens[0][0] == '#') continue;
+                if (tokens.size() > 3)
+                    throw UsageError(format("invalid batch line '%1%'") % line);
+
+                items.emplace_back();
+                auto & item = items.back();
+                item.uri = tokens[0];
+                item.expectedHash = Hash(ht);
+                if (tokens.size() > 1 && tokens[1] != "") item.expectedHash = Hash(tokens[1], ht);
+                item.name = tokens.size() > 2 ? tokens[2] : baseNameOf(item.uri);
+                if (item.name.empty())
+                    throw Error(format("cannot figure out file name for '%1%'") % item.uri);
+
+                /* Skip the download if the file is already in the
+                   store under its expected hash. */
+                if (item.expectedHash != Hash(ht)) {
+                    auto storePath = store->makeFixedOutputPath(false, item.expectedHash, item.name);
+                    if (store->isValidPath(storePath)) {
+                        item.storePath = storePath;
+                        continue;
+                    }
+                }
+
+                item.result = getDownloader()->enqueueDownload(
+                    DownloadRequest(resolveMirrorUri(state, item.uri)));
+            }
+
+            bool failed = false;
+
+            for (auto & item : items) {
+                try {
+                    Hash hash = item.expectedHash;
+
+                    if (item.storePath.empty()) {
+                        auto result = item.result.get();
+
+                        hash = hashString(ht, *result.data);
+                        if (item.expectedHash != Hash(ht) && item.expectedHash != hash)
+                            throw Error(format("hash mismatch for '%1%'") % item.uri);
+
+                        AutoDelete tmpDir(createTempDir(), true);
+                        Path tmpFile = (Path) tmpDir + "/tmp";
+                        writeFile(tmpFile, *result.data);
+
+                        item.storePath = store->addToStore(item.name, tmpFile, false, ht);
+                    }
+
+                    std::cout << item.uri << " " << printHash16or32(hash)
+                              << " " << item.storePath << std::endl;
+                } catch (Error & e) {
+                    printError(format("error fetching '%1%': %2%") % item.uri % e.msg());
+                    failed = true;
+                }
+            }
+
+            if (failed)
+                throw Error("some downloads failed");
+
+            return;
+        }
+
         /* If -A is given, get the URI from the specified Nix
            expression. */
         string uri;
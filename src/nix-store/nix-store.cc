@@ -22,6 +22,10 @@
 #include <sodium.h>
 #endif
 
+#if __linux__
+#include <sys/sendfile.h>
+#endif
+
 
 using namespace nix;
 using std::cin;
@@ -168,8 +172,12 @@ static void opAdd(Strings opFlags, Strings opArgs)
 {
     if (!opFlags.empty()) throw UsageError("unknown flag");
 
+    std::vector<std::pair<std::string, Path>> srcPaths;
     for (auto & i : opArgs)
-        cout << format("%1%\n") % store->addToStore(baseNameOf(i), i);
+        srcPaths.push_back({baseNameOf(i), i});
+
+    for (auto & path : store->addMultipleToStore(srcPaths))
+        cout << format("%1%\n") % path;
 }
 
 
@@ -770,10 +778,23 @@ static void opOptimise(Strings opFlags, Strings opArgs)
 static void opServe(Strings opFlags, Strings opArgs)
 {
     bool writeAllowed = false;
+    bool useNarCache = false;
     for (auto & i : opFlags)
         if (i == "--write") writeAllowed = true;
+        else if (i == "--nar-cache") useNarCache = true;
         else throw UsageError(format("unknown flag '%1%'") % i);
 
+    /* With --nar-cache, cmdDumpStorePath serialises each path to a
+       file once and serves subsequent requests straight from that
+       file, using sendfile() where available.  Store path contents
+       are immutable while valid, so a NAR keyed by the hash part
+       never goes stale. */
+    Path narCacheDir;
+    if (useNarCache) {
+        narCacheDir = getCacheDir() + "/nix/serve-nar-cache";
+        createDirs(narCacheDir);
+    }
+
     if (!opArgs.empty()) throw UsageError("no arguments expected");
 
     FdSource in(STDIN_FILENO);
@@ -865,9 +886,75 @@ static void opServe(Strings opFlags, Strings opArgs)
                 break;
             }
 
-            case cmdDumpStorePath:
-                dumpPath(readStorePath(*store, in), out);
+            case cmdDumpStorePath: {
+                auto path = readStorePath(*store, in);
+
+                if (narCacheDir.empty()) {
+                    dumpPath(path, out);
+                    break;
+                }
+
+                Path cacheFile = narCacheDir + "/" + storePathToHash(path) + ".nar";
+
+                if (!pathExists(cacheFile)) {
+                    /* Serialise once; the rename makes the cached NAR
+                       appear atomically for concurrent serve
+                       processes. */
+                    Path tmpFile = fmt("%s.tmp.%d", cacheFile, getpid());
+                    AutoDelete del(tmpFile, false);
+                    {
+                        AutoCloseFD fd = open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+                        if (!fd) throw SysError(format("creating '%1%'") % tmpFile);
+                        FdSink fileSink(fd.get());
+                        dumpPath(path, fileSink);
+                        fileSink.flush();
+                    }
+                    if (rename(tmpFile.c_str(), cacheFile.c_str()) == -1)
+                        throw SysError(format("renaming '%1%' to '%2%'") % tmpFile % cacheFile);
+                    del.cancel();
+                }
+
+                AutoCloseFD fd = open(cacheFile.c_str(), O_RDONLY | O_CLOEXEC);
+                if (!fd) throw SysError(format("opening '%1%'") % cacheFile);
+
+                struct stat st;
+                if (fstat(fd.get(), &st) == -1)
+                    throw SysError(format("statting '%1%'") % cacheFile);
+
+                /* The NAR bytes bypass the sink's buffer, so drain it
+                   first to keep the stream in order. */
+                out.flush();
+
+                off_t left = st.st_size;
+#if __linux__
+                off_t offset = 0;
+                while (left > 0) {
+                    auto n = sendfile(out.fd, fd.get(), &offset, left);
+                    if (n <= 0) {
+                        if (n == -1 && errno == EINTR) continue;
+                        /* E.g. stdout is not a socket; fall back to a
+                           copy through user space. */
+                        break;
+                    }
+                    left -= n;
+                }
+                if (left > 0 && lseek(fd.get(), offset, SEEK_SET) == -1)
+                    throw SysError(format("seeking in '%1%'") % cacheFile);
+#endif
+                while (left > 0) {
+                    unsigned char buf[65536];
+                    auto n = read(fd.get(), buf, std::min(left, (off_t) sizeof(buf)));
+                    if (n == -1) {
+                        if (errno == EINTR) continue;
+                        throw SysError(format("reading from '%1%'") % cacheFile);
+                    }
+                    if (n == 0) throw Error(format("unexpected end of file '%1%'") % cacheFile);
+                    writeFull(out.fd, buf, n);
+                    left -= n;
+                }
+
                 break;
+            }
 
             case cmdImportPaths: {
                 if (!writeAllowed) throw Error("importing paths is not allowed");
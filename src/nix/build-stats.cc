@@ -0,0 +1,60 @@
+#include "command.hh"
+#include "shared.hh"
+#include "local-store.hh"
+
+#include <iostream>
+
+using namespace nix;
+
+struct CmdBuildStats : StorePathsCommand
+{
+    std::string name() override
+    {
+        return "build-stats";
+    }
+
+    std::string description() override
+    {
+        return "show recorded build performance of derivations";
+    }
+
+    Examples examples() override
+    {
+        return {
+            Example{
+                "To show every recorded build of a derivation:",
+                "nix build-stats /nix/store/zvs3qz3r...-hello-2.10.drv"
+            },
+        };
+    }
+
+    void run(ref<Store> store, Paths storePaths) override
+    {
+        auto store2 = store.dynamic_pointer_cast<LocalStore>();
+        if (!store2)
+            throw UsageError("'nix build-stats' requires a local store");
+
+        for (auto & drvPath : storePaths) {
+            auto records = store2->queryBuildMetrics(drvPath);
+
+            if (records.empty()) {
+                printInfo("no builds recorded for '%s'", drvPath);
+                continue;
+            }
+
+            std::cout << drvPath << "\n";
+            std::cout << fmt("%-20s %10s %10s %10s %10s %12s\n",
+                "started", "wall (s)", "user (s)", "sys (s)", "RSS (MiB)", "outputs (B)");
+
+            for (auto & r : records) {
+                char buf[32];
+                strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&r.startTime));
+                std::cout << fmt("%-20s %10d %10d %10d %10d %12d\n",
+                    buf, r.duration, r.cpuUser / 1000, r.cpuSystem / 1000,
+                    r.peakRSS / 1024, r.outputSize);
+            }
+        }
+    }
+};
+
+static RegisterCommand r1(make_ref<CmdBuildStats>());
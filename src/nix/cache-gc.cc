@@ -0,0 +1,72 @@
+#include "command.hh"
+#include "shared.hh"
+#include "store-api.hh"
+#include "binary-cache-store.hh"
+#include "common-args.hh"
+
+using namespace nix;
+
+struct CmdCacheGC : StoreCommand, MixDryRun
+{
+    Strings rootsFiles;
+
+    CmdCacheGC()
+    {
+        expectArgs("roots-files", &rootsFiles);
+    }
+
+    std::string name() override
+    {
+        return "cache-gc";
+    }
+
+    std::string description() override
+    {
+        return "delete unreachable NARs from a binary cache";
+    }
+
+    Examples examples() override
+    {
+        return {
+            Example{
+                "To delete everything in a binary cache not reachable from the closures listed in 'roots.txt':",
+                "nix cache-gc --store file:///tmp/cache roots.txt"
+            },
+            Example{
+                "To show what would be deleted without deleting it:",
+                "nix cache-gc --dry-run --store s3://my-cache roots.txt"
+            },
+        };
+    }
+
+    void run(ref<Store> store) override
+    {
+        auto cacheStore = store.dynamic_pointer_cast<BinaryCacheStore>();
+        if (!cacheStore)
+            throw UsageError(format("'%s' is not a binary cache store") % store->getUri());
+
+        /* Refuse to run without roots: an empty live set would wipe
+           the entire cache. */
+        if (rootsFiles.empty())
+            throw UsageError("you must specify at least one file containing root paths");
+
+        PathSet roots;
+        for (auto & file : rootsFiles)
+            for (auto & line : tokenizeString<Strings>(readFile(file), "\n")) {
+                auto path = trim(line);
+                if (path.empty()) continue;
+                cacheStore->assertStorePath(path);
+                roots.insert(path);
+            }
+
+        GCResults results;
+        cacheStore->deleteUnreachable(roots, dryRun, results);
+
+        printInfo(format("%1% %2% paths, %3$.2f MiB")
+            % (dryRun ? "would delete" : "deleted")
+            % results.paths.size()
+            % (results.bytesFreed / (1024.0 * 1024.0)));
+    }
+};
+
+static RegisterCommand r1(make_ref<CmdCacheGC>());
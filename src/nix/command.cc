@@ -1,6 +1,7 @@
 #include "command.hh"
 #include "store-api.hh"
 #include "derivations.hh"
+#include "download.hh"
 
 namespace nix {
 
@@ -94,7 +95,15 @@ ref<Store> StoreCommand::createStore()
 
 void StoreCommand::run()
 {
-    run(createStore());
+    auto store = getStore();
+
+    run(store);
+
+    /* Analogous to the evaluator's NIX_SHOW_STATS. */
+    if (getEnv("NIX_SHOW_STATS", "0") != "0") {
+        store->dumpStats();
+        getDownloader()->dumpStats();
+    }
 }
 
 StorePathsCommand::StorePathsCommand()
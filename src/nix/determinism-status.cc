@@ -0,0 +1,60 @@
+#include "command.hh"
+#include "shared.hh"
+#include "local-store.hh"
+
+#include <iostream>
+
+using namespace nix;
+
+struct CmdDeterminismStatus : StorePathsCommand
+{
+    std::string name() override
+    {
+        return "determinism-status";
+    }
+
+    std::string description() override
+    {
+        return "show recorded determinism check results of derivations";
+    }
+
+    Examples examples() override
+    {
+        return {
+            Example{
+                "To show the determinism audit history of a derivation:",
+                "nix determinism-status /nix/store/zvs3qz3r...-hello-2.10.drv"
+            },
+        };
+    }
+
+    void run(ref<Store> store, Paths storePaths) override
+    {
+        auto store2 = store.dynamic_pointer_cast<LocalStore>();
+        if (!store2)
+            throw UsageError("'nix determinism-status' requires a local store");
+
+        for (auto & drvPath : storePaths) {
+            auto records = store2->queryDeterminismChecks(drvPath);
+
+            if (records.empty()) {
+                printInfo("no determinism checks recorded for '%s'", drvPath);
+                continue;
+            }
+
+            std::cout << drvPath << "\n";
+
+            for (auto & r : records) {
+                char buf[32];
+                strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&r.checkTime));
+                std::cout << fmt("%-20s %s\n", buf,
+                    r.deterministic ? "deterministic" : "NOT deterministic");
+                if (!r.diff.empty())
+                    for (auto & line : tokenizeString<Strings>(r.diff, "\n"))
+                        std::cout << "    " << line << "\n";
+            }
+        }
+    }
+};
+
+static RegisterCommand r1(make_ref<CmdDeterminismStatus>());
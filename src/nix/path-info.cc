@@ -14,12 +14,14 @@ struct CmdPathInfo : StorePathsCommand, MixJSON
     bool showSize = false;
     bool showClosureSize = false;
     bool showSigs = false;
+    int64_t registeredSince = 0;
 
     CmdPathInfo()
     {
         mkFlag('s', "size", "print size of the NAR dump of each path", &showSize);
         mkFlag('S', "closure-size", "print sum size of the NAR dumps of the closure of each path", &showClosureSize);
         mkFlag(0, "sigs", "show signatures", &showSigs);
+        mkIntFlag(0, "registered-since", "only show paths registered at or after the given Unix timestamp", &registeredSince);
     }
 
     std::string name() override
@@ -60,6 +62,22 @@ struct CmdPathInfo : StorePathsCommand, MixJSON
 
     void run(ref<Store> store, Paths storePaths) override
     {
+        /* Incremental inventory mode: drop paths older than the
+           cutoff.  Paths whose info carries no registration time
+           (e.g. from a binary cache) are dropped too, since their age
+           cannot be established. */
+        if (registeredSince) {
+            Paths filtered;
+            for (auto & storePath : storePaths) {
+                try {
+                    if (store->queryPathInfo(storePath)->registrationTime >= registeredSince)
+                        filtered.push_back(storePath);
+                } catch (InvalidPath &) {
+                }
+            }
+            storePaths = std::move(filtered);
+        }
+
         size_t pathLen = 0;
         for (auto & storePath : storePaths)
             pathLen = std::max(pathLen, storePath.size());
@@ -74,8 +92,16 @@ struct CmdPathInfo : StorePathsCommand, MixJSON
 
         else {
 
+            /* Sum the sizes over one union-closure walk rather than
+               one closure per root; see Store::getClosureSizes(). */
+            std::map<Path, std::pair<uint64_t, uint64_t>> closureSizes;
+            if (showClosureSize)
+                closureSizes = store->getClosureSizes(
+                    PathSet(storePaths.begin(), storePaths.end()));
+
             for (auto storePath : storePaths) {
                 auto info = store->queryPathInfo(storePath);
+                auto closureSize = showClosureSize ? closureSizes[storePath].first : 0;
                 storePath = info->path; // FIXME: screws up padding
 
                 std::cout << storePath << std::string(std::max(0, (int) pathLen - (int) storePath.size()), ' ');
@@ -84,7 +110,7 @@ struct CmdPathInfo : StorePathsCommand, MixJSON
                     std::cout << '\t' << std::setw(11) << info->narSize;
 
                 if (showClosureSize)
-                    std::cout << '\t' << std::setw(11) << store->getClosureSize(storePath).first;
+                    std::cout << '\t' << std::setw(11) << closureSize;
 
                 if (showSigs) {
                     std::cout << '\t';
@@ -5,6 +5,7 @@
 
 #include <map>
 #include <atomic>
+#include <thread>
 
 #include <sys/ioctl.h>
 
@@ -57,10 +58,21 @@ private:
         uint64_t filesLinked = 0, bytesLinked = 0;
 
         uint64_t corruptedPaths = 0, untrustedPaths = 0;
+
+        bool haveUpdate = true;
+        bool quit = false;
     };
 
     Sync<State> state_;
 
+    /* The bar is drawn by a dedicated thread at a bounded frame
+       rate.  Activity events only flip 'haveUpdate' under the state
+       lock; the expensive rendering and terminal write happen here,
+       and a burst of events between two frames is drawn once. */
+    std::thread updateThread;
+
+    std::condition_variable updateCV, quitCV;
+
     int width = 0;
 
 public:
@@ -70,10 +82,31 @@ public:
         struct winsize ws;
         if (ioctl(1, TIOCGWINSZ, &ws) == 0)
             width = ws.ws_col;
+
+        updateThread = std::thread([&]() {
+            auto state(state_.lock());
+            while (!state->quit) {
+                if (!state->haveUpdate)
+                    state.wait(updateCV);
+                draw(*state);
+                /* Cap the frame rate at 20 Hz.  The lock is released
+                   while sleeping, so events keep flowing. */
+                state.wait_for(quitCV, std::chrono::milliseconds(50),
+                    [&]() { return state->quit; });
+            }
+        });
     }
 
     ~ProgressBar()
     {
+        {
+            auto state(state_.lock());
+            state->quit = true;
+            updateCV.notify_one();
+            quitCV.notify_one();
+        }
+        updateThread.join();
+
         auto state(state_.lock());
         std::string status = getStatus(*state);
         writeToStderr("\r\e[K");
@@ -89,8 +122,10 @@ public:
 
     void log(State & state, Verbosity lvl, const std::string & s)
     {
+        /* Erase the current bar so the message appears on its own
+           line; the bar is redrawn on the next frame. */
         writeToStderr("\r\e[K" + s + "\n");
-        update(state);
+        draw(state);
     }
 
     void startActivity(ActivityId act, ActivityType type, const std::string & s) override
@@ -197,8 +232,18 @@ public:
         update(*state);
     }
 
+    /* Schedule a redraw by the update thread. */
     void update(State & state)
     {
+        state.haveUpdate = true;
+        updateCV.notify_one();
+    }
+
+    void draw(State & state)
+    {
+        state.haveUpdate = false;
+        if (state.quit) return;
+
         std::string line = "\r";
 
         std::string status = getStatus(state);
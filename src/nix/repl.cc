@@ -40,6 +40,11 @@ struct NixRepl
     int displ;
     StringSet varNames;
 
+    /* Attribute names per completed expression ("pkgs" ->
+       {"hello", ...}), so that repeated <TAB>s on the same set don't
+       re-evaluate it.  Invalidated whenever the scope changes. */
+    std::map<string, StringSet> attrCompletionCache;
+
     const Path historyFile;
 
     NixRepl(const Strings & searchPath, nix::ref<Store> store);
@@ -234,13 +239,20 @@ StringSet NixRepl::completePrefix(string prefix)
             string expr(cur, 0, dot);
             string cur2 = string(cur, dot + 1);
 
-            Expr * e = parseString(expr);
-            Value v;
-            e->eval(state, *env, v);
-            state.forceAttrs(v);
+            auto cached = attrCompletionCache.find(expr);
+            if (cached == attrCompletionCache.end()) {
+                Expr * e = parseString(expr);
+                Value v;
+                e->eval(state, *env, v);
+                state.forceAttrs(v);
+
+                StringSet names;
+                for (auto & i : *v.attrs)
+                    names.insert(i.name);
+                cached = attrCompletionCache.emplace(expr, std::move(names)).first;
+            }
 
-            for (auto & i : *v.attrs) {
-                string name = i.name;
+            for (auto & name : cached->second) {
                 if (string(name, 0, cur2.size()) != cur2) continue;
                 completions.insert(prev + expr + "." + name);
             }
@@ -444,6 +456,7 @@ void NixRepl::initEnv()
     staticEnv.vars.clear();
 
     varNames.clear();
+    attrCompletionCache.clear();
     for (auto & i : state.staticBaseEnv.vars)
         varNames.insert(i.first);
 }
@@ -482,6 +495,9 @@ void NixRepl::addVarToScope(const Symbol & name, Value & v)
     staticEnv.vars[name] = displ;
     env->values[displ++] = &v;
     varNames.insert((string) name);
+    /* The new variable may shadow something a cached completion was
+       computed from. */
+    attrCompletionCache.clear();
 }
 
 
@@ -8,6 +8,7 @@
 #include "json.hh"
 #include "json-to-value.hh"
 
+#include <cstring>
 #include <regex>
 #include <fstream>
 
@@ -62,6 +63,13 @@ struct CmdSearch : SourceExprCommand, MixJSON
 
         std::regex regex(re, std::regex::extended | std::regex::icase);
 
+        /* Most queries are plain substrings rather than regular
+           expressions.  For those, non-matching packages (the vast
+           majority) can be rejected with a cheap case-insensitive
+           substring scan, leaving the regex machinery (still needed
+           for highlighting) to run only on actual hits. */
+        bool literal = re.find_first_of("^$.*+?()[]{}|\\") == std::string::npos;
+
         auto state = getEvalState();
 
         bool first = true;
@@ -95,17 +103,25 @@ struct CmdSearch : SourceExprCommand, MixJSON
 
                     DrvName parsed(drv.queryName());
 
-                    std::smatch attrPathMatch;
-                    std::regex_search(attrPath, attrPathMatch, regex);
-
                     auto name = parsed.name;
-                    std::smatch nameMatch;
-                    std::regex_search(name, nameMatch, regex);
 
                     std::string description = drv.queryMetaString("description");
                     std::replace(description.begin(), description.end(), '\n', ' ');
+
+                    bool skip = literal
+                        && !strcasestr(attrPath.c_str(), re.c_str())
+                        && !strcasestr(name.c_str(), re.c_str())
+                        && !strcasestr(description.c_str(), re.c_str());
+
+                    std::smatch attrPathMatch;
+                    std::smatch nameMatch;
                     std::smatch descriptionMatch;
-                    std::regex_search(description, descriptionMatch, regex);
+
+                    if (!skip) {
+                        std::regex_search(attrPath, attrPathMatch, regex);
+                        std::regex_search(name, nameMatch, regex);
+                        std::regex_search(description, descriptionMatch, regex);
+                    }
 
                     if (!attrPathMatch.empty()
                         || !nameMatch.empty()
@@ -1,6 +1,7 @@
 #include "command.hh"
 #include "shared.hh"
 #include "store-api.hh"
+#include "sync.hh"
 #include "thread-pool.hh"
 
 #include <atomic>
@@ -121,23 +122,36 @@ struct CmdSignPaths : StorePathsCommand
 
         SecretKey secretKey(readFile(secretKeyFile));
 
-        size_t added{0};
+        /* Sign in parallel (queryPathInfo() and the signing itself
+           both benefit), then add all new signatures in a single
+           batch so that a local store commits them in one database
+           transaction instead of one per path. */
+        Sync<std::map<Path, StringSet>> pathSigs_;
 
-        for (auto & storePath : storePaths) {
-            auto info = store->queryPathInfo(storePath);
+        ThreadPool pool;
 
-            auto info2(*info);
-            info2.sigs.clear();
-            info2.sign(secretKey);
-            assert(!info2.sigs.empty());
+        for (auto & storePath : storePaths)
+            pool.enqueue([&, storePath]() {
+                checkInterrupt();
 
-            if (!info->sigs.count(*info2.sigs.begin())) {
-                store->addSignatures(storePath, info2.sigs);
-                added++;
-            }
-        }
+                auto info = store->queryPathInfo(storePath);
+
+                auto info2(*info);
+                info2.sigs.clear();
+                info2.sign(secretKey);
+                assert(!info2.sigs.empty());
+
+                if (!info->sigs.count(*info2.sigs.begin()))
+                    (*pathSigs_.lock())[storePath] = info2.sigs;
+            });
+
+        pool.process();
+
+        auto pathSigs(std::move(*pathSigs_.lock()));
+
+        store->addSignatures(pathSigs);
 
-        printInfo(format("added %d signatures") % added);
+        printInfo(format("added %d signatures") % pathSigs.size());
     }
 };
 
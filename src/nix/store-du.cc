@@ -0,0 +1,76 @@
+#include "command.hh"
+#include "shared.hh"
+#include "store-api.hh"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <functional>
+#include <set>
+
+using namespace nix;
+
+struct CmdStoreDu : StorePathsCommand
+{
+    std::string name() override
+    {
+        return "store-du";
+    }
+
+    std::string description() override
+    {
+        return "show the disk space actually used by store paths, counting hard-linked files once";
+    }
+
+    Examples examples() override
+    {
+        return {
+            Example{
+                "To show the real disk usage of the current NixOS system closure:",
+                "nix store-du -r /run/current-system"
+            },
+            Example{
+                "To show how much of the store's apparent size is shared through optimise-store:",
+                "nix store-du --all"
+            },
+        };
+    }
+
+    void run(ref<Store> store, Paths storePaths) override
+    {
+        auto store2 = store.dynamic_pointer_cast<LocalFSStore>();
+        if (!store2)
+            throw UsageError("'nix store-du' requires a store with local file system access");
+
+        /* Attribute each inode once, like du(1).  Files that
+           optimise-store has hard-linked into .links show up with a
+           link count > 1; every occurrence after the first only adds
+           to the 'shared' tally. */
+        std::set<std::pair<dev_t, ino_t>> seen;
+        unsigned long long diskUsage = 0, shared = 0, narTotal = 0;
+
+        std::function<void(const Path &)> visit = [&](const Path & path) {
+            auto st = lstat(path);
+            if (S_ISDIR(st.st_mode)) {
+                diskUsage += st.st_blocks * 512;
+                for (auto & i : readDirectory(path))
+                    visit(path + "/" + i.name);
+            } else if (st.st_nlink > 1 && !seen.insert({st.st_dev, st.st_ino}).second)
+                shared += st.st_blocks * 512;
+            else
+                diskUsage += st.st_blocks * 512;
+        };
+
+        for (auto & storePath : storePaths) {
+            narTotal += store->queryPathInfo(storePath)->narSize;
+            visit(store2->toRealPath(storePath));
+        }
+
+        std::cout << fmt("%d store paths\n", storePaths.size());
+        std::cout << fmt("%14d bytes on disk\n", diskUsage);
+        std::cout << fmt("%14d bytes shared through hard links\n", shared);
+        std::cout << fmt("%14d bytes total NAR size\n", narTotal);
+    }
+};
+
+static RegisterCommand r1(make_ref<CmdStoreDu>());
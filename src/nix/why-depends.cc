@@ -0,0 +1,124 @@
+#include "command.hh"
+#include "shared.hh"
+#include "store-api.hh"
+
+#include <queue>
+
+using namespace nix;
+
+struct CmdWhyDepends : InstallablesCommand
+{
+    std::string name() override
+    {
+        return "why-depends";
+    }
+
+    std::string description() override
+    {
+        return "show the shortest reference chain from one store path to another";
+    }
+
+    Examples examples() override
+    {
+        return {
+            Example{
+                "To show why the 'hello' closure contains glibc:",
+                "nix why-depends nixpkgs.hello nixpkgs.glibc"
+            },
+            Example{
+                "To show why a system closure pulls in a store path:",
+                "nix why-depends /run/current-system /nix/store/...-openssl-1.0.2"
+            },
+        };
+    }
+
+    bool useDefaultInstallables() override { return false; }
+
+    void run(ref<Store> store) override
+    {
+        if (installables.size() != 2)
+            throw UsageError("'nix why-depends' requires exactly two arguments: a package and a dependency");
+
+        auto toPath = [&](std::shared_ptr<Installable> installable) {
+            PathSet paths;
+            for (auto & b : installable->toBuildable())
+                paths.insert(b.first);
+            if (paths.size() != 1)
+                throw Error("argument '%s' should evaluate to a single store path", installable->what());
+            return *paths.begin();
+        };
+
+        settings.readOnlyMode = true;
+
+        auto packagePath = toPath(installables[0]);
+        auto dependencyPath = toPath(installables[1]);
+
+        if (packagePath == dependencyPath) {
+            std::cout << fmt("%s\n", packagePath);
+            return;
+        }
+
+        /* Computing the closure pulls every path info into the cache,
+           so building the in-memory graph below is free of further
+           store round-trips. */
+        PathSet closure;
+        store->computeFSClosure(packagePath, closure);
+
+        if (!closure.count(dependencyPath)) {
+            printError("'%s' does not depend on '%s'", packagePath, dependencyPath);
+            throw Exit(1);
+        }
+
+        std::map<Path, PathSet> refs, referrers;
+        for (auto & path : closure)
+            for (auto & ref : store->queryPathInfo(path)->references)
+                if (ref != path && closure.count(ref)) {
+                    refs[path].insert(ref);
+                    referrers[ref].insert(path);
+                }
+
+        /* Bidirectional BFS: grow a frontier forward from the package
+           along references and one backward from the dependency along
+           referrers, always expanding the smaller side.  The first
+           node seen from both directions lies on a shortest chain. */
+        std::map<Path, Path> parentFwd, parentBwd;
+        parentFwd[packagePath] = "";
+        parentBwd[dependencyPath] = "";
+        PathSet frontFwd{packagePath}, frontBwd{dependencyPath};
+        Path meet;
+
+        while (meet.empty() && !frontFwd.empty() && !frontBwd.empty()) {
+            bool fwd = frontFwd.size() <= frontBwd.size();
+            auto & front = fwd ? frontFwd : frontBwd;
+            auto & parent = fwd ? parentFwd : parentBwd;
+            auto & other = fwd ? parentBwd : parentFwd;
+            auto & edges = fwd ? refs : referrers;
+
+            PathSet next;
+            for (auto & path : front)
+                for (auto & to : edges[path]) {
+                    if (parent.count(to)) continue;
+                    parent[to] = path;
+                    if (other.count(to)) { meet = to; break; }
+                    next.insert(to);
+                }
+            front = std::move(next);
+        }
+
+        assert(!meet.empty());
+
+        /* Stitch the two half-chains together into package -> ... ->
+           dependency order. */
+        Paths chain;
+        for (Path p = meet; p != ""; p = parentFwd[p])
+            chain.push_front(p);
+        for (Path p = parentBwd[meet]; p != ""; p = parentBwd[p])
+            chain.push_back(p);
+
+        unsigned int depth = 0;
+        for (auto & path : chain)
+            std::cout << fmt("%s%s\n", std::string(2 * depth++, ' '), path);
+    }
+};
+
+static RegisterCommand r1(make_ref<CmdWhyDepends>());
@@ -2,8 +2,11 @@
 #include "globals.hh"
 #include "shared.hh"
 #include "store-api.hh"
+#include "sync.hh"
+#include "thread-pool.hh"
 #include <sys/utsname.h>
 #include <algorithm>
+#include <thread>
 #include <iostream>
 #include <fstream>
 #include <sys/mman.h>
@@ -17,10 +20,13 @@ using namespace nix;
 
 static auto cacheDir = Path{};
 
-Path resolveCacheFile(Path lib)
+Path resolveCacheFile(Path lib, const struct stat & st)
 {
     std::replace(lib.begin(), lib.end(), '/', '%');
-    return cacheDir + "/" + lib;
+    /* Include the size and modification time in the key, so that a
+       system update invalidates the entry instead of serving the
+       install names of the old library forever. */
+    return (format("%1%/%2%-%3%-%4%") % cacheDir % lib % st.st_size % (long) st.st_mtime).str();
 }
 
 std::set<string> readCacheFile(const Path & file)
@@ -133,7 +139,11 @@ std::set<string> getPath(const Path & path)
 {
     if (hasPrefix(path, "/dev")) return {};
 
-    Path cacheFile = resolveCacheFile(path);
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1)
+        throw SysError("getting attributes of path '%1%'", path);
+
+    Path cacheFile = resolveCacheFile(path, st);
     if (pathExists(cacheFile))
         return readCacheFile(cacheFile);
 
@@ -149,7 +159,12 @@ std::set<string> getPath(const Path & path)
     for (auto & t : resolveTree(nextPath, deps))
         paths.insert(t);
 
-    writeFile(cacheFile, concatStringsSep("\n", paths));
+    /* Write-to-temporary and rename, since several workers may
+       resolve the same library concurrently. */
+    Path tmpFile = (format("%1%.tmp.%2%.%3%") % cacheFile % getpid() % std::this_thread::get_id()).str();
+    writeFile(tmpFile, concatStringsSep("\n", paths));
+    if (rename(tmpFile.c_str(), cacheFile.c_str()) == -1)
+        throw SysError("renaming '%1%' to '%2%'", tmpFile, cacheFile);
 
     return paths;
 }
@@ -186,14 +201,24 @@ int main(int argc, char ** argv)
             impurePaths.insert("/usr/lib/libSystem.dylib");
         }
 
-        std::set<string> allPaths;
+        /* The impure paths are independent roots, so resolve them in
+           parallel; the header parsing is read-only and the cache
+           files are written atomically. */
+        Sync<std::set<string>> allPaths_;
 
+        ThreadPool pool;
         for (auto & path : impurePaths)
-            for (auto & p : getPath(path))
-                allPaths.insert(p);
+            pool.enqueue([&, path]() {
+                auto found = getPath(path);
+                auto allPaths(allPaths_.lock());
+                allPaths->insert(found.begin(), found.end());
+            });
+        pool.process();
+
+        auto allPaths(allPaths_.lock());
 
         std::cout << "extra-chroot-dirs" << std::endl;
-        for (auto & path : allPaths)
+        for (auto & path : *allPaths)
             std::cout << path << std::endl;
         std::cout << std::endl;
     });
@@ -0,0 +1,41 @@
+source common.sh
+
+clearStore
+
+startDaemon
+
+# Create a batch of small files and add them in one invocation; the
+# daemon handles this as a single wopAddMultipleToStore exchange.
+mkdir -p $TEST_ROOT/batch
+rm -f $TEST_ROOT/batch/*
+for i in $(seq -w 1 20); do echo content-$i > $TEST_ROOT/batch/file-$i; done
+
+paths=$(nix-store --add $TEST_ROOT/batch/file-*)
+
+[ "$(echo "$paths" | wc -l)" = 20 ]
+
+# The paths come back in argument order and are all valid.
+i=1
+for p in $paths; do
+    grep -q content-$(printf '%02d' $i) $p
+    i=$((i + 1))
+done
+nix-store -q --hash $paths > /dev/null
+
+# Adding the same batch again yields the same paths.
+paths2=$(nix-store --add $TEST_ROOT/batch/file-*)
+[ "$paths" = "$paths2" ]
+
+# And the same path as a non-daemon add.
+path1=$(NIX_REMOTE= nix-store --add $TEST_ROOT/batch/file-01)
+[ "$path1" = "$(echo "$paths" | head -n 1)" ]
+
+# Round-trip a path through export/import via the daemon; --import
+# must print the path it imported.
+exported=$(echo "$paths" | head -n 1)
+nix-store --export $exported > $TEST_ROOT/batch.exp
+nix-store --delete $exported
+imported=$(nix-store --import < $TEST_ROOT/batch.exp)
+[ "$imported" = "$exported" ]
+
+killDaemon
@@ -0,0 +1,24 @@
+source common.sh
+
+clearStore
+
+lowerPath=$(nix-build dependencies.nix --no-out-link)
+
+upperRoot=$TEST_ROOT/overlay-upper
+rm -rf $upperRoot
+
+overlay="overlay://?lower=local&upper=local?root=$upperRoot"
+
+# Both layer parameters are required.
+(! nix path-info --store "overlay://" $lowerPath)
+
+# Paths from the lower layer are visible through the overlay.
+[ "$(nix path-info --store "$overlay" $lowerPath)" = "$lowerPath" ]
+
+# Writes through the overlay land in the upper layer only.
+upperPath=$(nix eval --store "$overlay" --raw '(builtins.toFile "overlay-test" "hello overlay")')
+
+nix path-info --store "$overlay" $upperPath > /dev/null
+nix path-info --store "local?root=$upperRoot" $upperPath > /dev/null
+(! nix path-info $upperPath)
+grep -q "hello overlay" $upperRoot$upperPath
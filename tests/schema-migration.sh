@@ -0,0 +1,22 @@
+source common.sh
+
+clearStore
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+
+schema=$NIX_STATE_DIR/db/schema
+[ "$(cat $schema)" = 13 ]
+
+# Pretend the database predates the BuildMetrics and DeterminismChecks
+# tables; reopening the store must upgrade it in place.
+echo 11 > $schema
+
+nix-store -q --references $outPath > /dev/null
+
+[ "$(cat $schema)" = 13 ]
+
+# The store is fully functional after the upgrade, including the
+# tables added by the migrations.
+nix-store --verify --check-contents
+nix-store -qR $outPath > /dev/null
+nix determinism-status $outPath